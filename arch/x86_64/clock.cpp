@@ -0,0 +1,180 @@
+#include "arch/clock.hpp"
+#include "arch/kvmclock.hpp"
+#include "arch/asm.h"
+#include "otrix/immediate_console.hpp"
+
+#define PIT_FREQUENCY_HZ 1193182
+#define PIT_CHANNEL2_DATA 0x42
+#define PIT_COMMAND 0x43
+#define PIT_CHANNEL2_GATE 0x61
+#define PIT_CHANNEL2_GATE_ENABLE 0x01
+#define PIT_SPEAKER_ENABLE 0x02
+#define PIT_CHANNEL2_OUT 0x20
+// Channel 2, lobyte/hibyte access, mode 0 (interrupt on terminal count), binary
+#define PIT_CHANNEL2_ONESHOT 0xb0
+
+namespace otrix::arch::clock
+{
+
+static constexpr uint64_t NSEC_PER_SEC = 1000 * 1000 * 1000;
+static constexpr auto CALIBRATION_MS = 10;
+// Minimal number of PIT polls for calibration to be trusted, bound to detect missing PIT
+static constexpr auto CALIBRATION_MIN_LOOPS = 1000;
+static constexpr auto CALIBRATION_MAX_LOOPS = 1 << 24;
+
+struct params_t
+{
+    uint32_t version;       // pvclock version the parameters were taken from
+    uint64_t tsc_timestamp;
+    uint64_t system_time;   // Nanoseconds at tsc_timestamp
+    uint32_t mul;           // TSC -> ns: ((tsc << shift) * mul) >> 32
+    int8_t shift;
+    uint64_t inv_mul;       // ns -> TSC: (ns * inv_mul) >> 32
+};
+
+static params_t params;
+static bool use_kvmclock;
+static bool initialized;
+
+static void compute_inverse(params_t *p)
+{
+    // tsc = ns * 2^(32 - shift) / mul, keeping 32 fractional bits
+    p->inv_mul = (uint64_t)(((unsigned __int128)1 << (64 - p->shift)) / p->mul);
+}
+
+static void refresh()
+{
+    kvmclock::pvclock_params pv;
+    kvmclock::read(&pv);
+    params.version = pv.version;
+    params.tsc_timestamp = pv.tsc_timestamp;
+    params.system_time = pv.system_time;
+    params.mul = pv.tsc_to_system_mul;
+    params.shift = pv.tsc_shift;
+    compute_inverse(&params);
+}
+
+// Parameters are recomputed only when the host has published new ones
+static params_t snapshot()
+{
+    auto flags = arch_irq_save();
+    if (use_kvmclock && kvmclock::version() != params.version) {
+        refresh();
+    }
+    const params_t p = params;
+    arch_irq_restore(flags);
+    return p;
+}
+
+static uint64_t scale_tsc(uint64_t tsc, const params_t &p)
+{
+    if (p.shift >= 0) {
+        tsc <<= p.shift;
+    } else {
+        tsc >>= -p.shift;
+    }
+    return (uint64_t)(((unsigned __int128)tsc * p.mul) >> 32);
+}
+
+// Same algorithm as the host uses to compute pvclock parameters
+static void set_time_scale(uint64_t tsc_hz, params_t *p)
+{
+    uint64_t tps64 = tsc_hz;
+    uint64_t scaled64 = NSEC_PER_SEC;
+    int shift = 0;
+    while (tps64 > scaled64 * 2 || (tps64 & 0xffffffff00000000ull)) {
+        tps64 >>= 1;
+        shift--;
+    }
+    uint32_t tps32 = (uint32_t)tps64;
+    while (tps32 <= scaled64 || (scaled64 & 0xffffffff00000000ull)) {
+        if ((scaled64 & 0xffffffff00000000ull) || (tps32 & 0x80000000)) {
+            scaled64 >>= 1;
+        } else {
+            tps32 <<= 1;
+        }
+        shift++;
+    }
+    p->mul = (uint32_t)((scaled64 << 32) / tps32);
+    p->shift = shift;
+    compute_inverse(p);
+}
+
+static uint64_t pit_calibrate_tsc_khz()
+{
+    constexpr uint32_t latch = PIT_FREQUENCY_HZ * CALIBRATION_MS / 1000;
+
+    auto flags = arch_irq_save();
+    arch_io_write8(PIT_CHANNEL2_GATE,
+            (arch_io_read8(PIT_CHANNEL2_GATE) & ~PIT_SPEAKER_ENABLE) | PIT_CHANNEL2_GATE_ENABLE);
+    arch_io_write8(PIT_COMMAND, PIT_CHANNEL2_ONESHOT);
+    arch_io_write8(PIT_CHANNEL2_DATA, latch & 0xff);
+    arch_io_write8(PIT_CHANNEL2_DATA, latch >> 8);
+
+    const uint64_t start = arch_tsc();
+    int loops = 0;
+    while (0 == (arch_io_read8(PIT_CHANNEL2_GATE) & PIT_CHANNEL2_OUT) && loops < CALIBRATION_MAX_LOOPS) {
+        loops++;
+    }
+    const uint64_t end = arch_tsc();
+    arch_irq_restore(flags);
+
+    if (loops < CALIBRATION_MIN_LOOPS || loops >= CALIBRATION_MAX_LOOPS) {
+        return 0;
+    }
+    return (end - start) / CALIBRATION_MS;
+}
+
+bool init()
+{
+    if (kvmclock::init()) {
+        use_kvmclock = true;
+        refresh();
+        initialized = true;
+        return true;
+    }
+
+    const uint64_t khz = pit_calibrate_tsc_khz();
+    if (0 == khz) {
+        return false;
+    }
+    immediate_console::print("TSC calibrated against PIT: %lu kHz\n", khz);
+    params.tsc_timestamp = arch_tsc();
+    params.system_time = 0;
+    set_time_scale(khz * 1000, &params);
+    initialized = true;
+    return true;
+}
+
+uint64_t monotonic_ns()
+{
+    const params_t p = snapshot();
+    return p.system_time + scale_tsc(arch_tsc() - p.tsc_timestamp, p);
+}
+
+uint64_t realtime_ns()
+{
+    return (use_kvmclock ? kvmclock::boottime_ns() : 0) + monotonic_ns();
+}
+
+uint64_t ns_to_tsc(uint64_t ns)
+{
+    const params_t p = snapshot();
+    return (uint64_t)(((unsigned __int128)ns * p.inv_mul) >> 32);
+}
+
+uint64_t tsc_to_ns(uint64_t tsc)
+{
+    const params_t p = snapshot();
+    return scale_tsc(tsc, p);
+}
+
+uint64_t tsc_khz()
+{
+    if (!initialized) {
+        return 0;
+    }
+    return ns_to_tsc(1000 * 1000);
+}
+
+} // namespace otrix::arch::clock
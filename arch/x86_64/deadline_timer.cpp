@@ -0,0 +1,52 @@
+#include "arch/deadline_timer.hpp"
+#include "arch/lapic.hpp"
+#include "arch/asm.h"
+#include "otrix/immediate_console.hpp"
+
+namespace otrix::arch
+{
+
+uint64_t deadline_timer::armed_;
+deadline_timer::stats_t deadline_timer::stats_;
+
+void deadline_timer::arm(uint64_t tsc_deadline, uint64_t slack_tsc)
+{
+    auto flags = arch_irq_save();
+    if (0 != armed_) {
+        if (armed_ == tsc_deadline) {
+            stats_.skipped_same++;
+            arch_irq_restore(flags);
+            return;
+        }
+        if (armed_ < tsc_deadline) {
+            stats_.skipped_later++;
+            arch_irq_restore(flags);
+            return;
+        }
+        if (armed_ - tsc_deadline <= slack_tsc) {
+            stats_.coalesced++;
+            arch_irq_restore(flags);
+            return;
+        }
+    }
+
+    armed_ = tsc_deadline;
+    stats_.writes++;
+    local_apic::start_timer(tsc_deadline);
+    arch_irq_restore(flags);
+}
+
+void deadline_timer::expired()
+{
+    // The deadline MSR is cleared by hardware once the timer fires
+    armed_ = 0;
+}
+
+void deadline_timer::print_stats()
+{
+    const uint64_t avoided = stats_.skipped_same + stats_.skipped_later + stats_.coalesced;
+    immediate_console::print("deadline timer: writes %lu, avoided %lu (same %lu, later %lu, coalesced %lu)\n",
+            stats_.writes, avoided, stats_.skipped_same, stats_.skipped_later, stats_.coalesced);
+}
+
+} // namespace otrix::arch
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+//!
+//! Time keeping based on TSC.
+//!
+//! Conversion parameters come from kvmclock when available, otherwise TSC
+//! frequency is calibrated against the PIT. Conversions use precomputed
+//! multiply/shift pairs, which are refreshed only when the host publishes
+//! new pvclock parameters.
+//!
+namespace otrix::arch::clock
+{
+
+//! Select clock source and compute conversion parameters.
+//! Must be called once during boot, before any other function.
+//!
+//! \retval false Neither kvmclock nor PIT calibration is usable.
+bool init();
+
+//! Monotonic time in nanoseconds (since host boot for kvmclock, since init() otherwise).
+uint64_t monotonic_ns();
+
+//! Wall clock time in nanoseconds since the Unix epoch.
+//! Without kvmclock there is no wall clock source and it equals monotonic time.
+uint64_t realtime_ns();
+
+//! Convert time interval to TSC ticks.
+uint64_t ns_to_tsc(uint64_t ns);
+
+//! Convert interval in TSC ticks to nanoseconds.
+uint64_t tsc_to_ns(uint64_t tsc);
+
+//! TSC frequency in kHz, 0 if the clock is not initialized.
+uint64_t tsc_khz();
+
+} // namespace otrix::arch::clock
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+
+namespace otrix::arch
+{
+
+//!
+//! Programming layer over the LAPIC TSC-deadline timer.
+//!
+//! Every IA32_TSC_DEADLINE write is a VM exit, so the armed deadline is cached
+//! and writes which cannot change the outcome are skipped:
+//!  - the same deadline is already armed;
+//!  - an earlier deadline is armed: its interrupt handler re-arms the timer
+//!    for the remaining deadlines anyway;
+//!  - a later deadline is armed, but within the slack the caller tolerates.
+//!
+class deadline_timer
+{
+public:
+    deadline_timer() = delete;
+
+    //! Request timer interrupt at tsc_deadline, but no later than tsc_deadline + slack_tsc.
+    static void arm(uint64_t tsc_deadline, uint64_t slack_tsc = 0);
+
+    //! Must be called from the timer interrupt handler: the armed deadline has fired.
+    static void expired();
+
+    //! Currently armed deadline, 0 if disarmed.
+    static uint64_t armed()
+    {
+        return armed_;
+    }
+
+    struct stats_t
+    {
+        uint64_t writes;        //!< Deadline MSR writes
+        uint64_t skipped_same;  //!< Requests for the already armed deadline
+        uint64_t skipped_later; //!< Requests later than the armed deadline
+        uint64_t coalesced;     //!< Requests served by a later deadline within slack
+    };
+
+    static const stats_t &stats()
+    {
+        return stats_;
+    }
+
+    static void print_stats();
+
+private:
+    static uint64_t armed_;
+    static stats_t stats_;
+};
+
+} // namespace otrix::arch
@@ -2,7 +2,7 @@
 
 #include <cstdint>
 
-extern "C" void irq_manager_irq_handler();
+extern "C" void irq_manager_irq_handler(uint64_t vector);
 
 namespace otrix::arch
 {
@@ -87,9 +87,10 @@ private:
 
     static irq_entry irq_table[NUM_IRQ];
 
-    static void irq_handler();
+    // Called by the entry stub of the vector
+    static void irq_handler(uint64_t vector);
 
-    friend void ::irq_manager_irq_handler();
+    friend void ::irq_manager_irq_handler(uint64_t vector);
 };
 
 } // namespace otrix::arch
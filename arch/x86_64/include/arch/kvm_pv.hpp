@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+//!
+//! KVM paravirtual interfaces advertised through the KVM CPUID leaves.
+//!
+namespace otrix::arch::kvm_pv
+{
+
+enum kvm_feature
+{
+    KVM_FEATURE_CLOCKSOURCE2 = 3,
+    KVM_FEATURE_STEAL_TIME = 5,
+    KVM_FEATURE_PV_EOI = 6,
+    KVM_FEATURE_PV_SEND_IPI = 11,
+    KVM_FEATURE_PV_SCHED_YIELD = 13,
+};
+
+//! Check if running under KVM with the feature available.
+bool has_feature(kvm_feature feature);
+
+//! Enable PV EOI and steal time, if available.
+//! Must be called after LAPIC initialization.
+void init();
+
+//! Acknowledge interrupt without VM exit if the host allows it.
+//!
+//! \retval false EOI has to be signalled to the LAPIC.
+bool try_fast_eoi();
+
+//! Total time in nanoseconds the host did not run this vCPU
+//! while it was runnable, 0 if steal time is not available.
+uint64_t steal_time_ns();
+
+//! Send IPI with a single hypercall instead of ICR writes.
+//!
+//! \param[in] apic_id Destination APIC ID.
+//! \param[in] icr_low Low 32 bits of ICR (vector and delivery mode).
+//! \retval false PV send-IPI is not available.
+bool send_ipi(uint32_t apic_id, uint32_t icr_low);
+
+//! Yield this vCPU in favor of the (preempted) destination vCPU,
+//! e.g. when spinning on a lock it holds.
+//!
+//! \retval false PV sched-yield is not available.
+bool sched_yield(uint32_t apic_id);
+
+} // namespace otrix::arch::kvm_pv
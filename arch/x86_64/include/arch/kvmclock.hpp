@@ -5,13 +5,35 @@
 namespace otrix::arch::kvmclock
 {
 
+/**
+ * Conversion parameters published by the host in the pvclock page:
+ * system_time_ns = system_time + scale(tsc - tsc_timestamp),
+ * where scale(x) = ((tsc_shift >= 0 ? x << tsc_shift : x >> -tsc_shift) * tsc_to_system_mul) >> 32.
+ */
+struct pvclock_params
+{
+    uint32_t version;
+    uint64_t tsc_timestamp;
+    uint64_t system_time;
+    uint32_t tsc_to_system_mul;
+    int8_t tsc_shift;
+};
+
 bool init();
 
-uint64_t boottime_ns();
-uint64_t systime_ns();
-uint64_t systime_us();
-uint64_t systime_ms();
+/**
+ * Current version of the pvclock page, changes whenever the host updates parameters.
+ */
+uint32_t version();
 
-uint64_t ns_to_tsc(uint64_t ns);
+/**
+ * Take consistent snapshot of the pvclock parameters.
+ */
+void read(pvclock_params *p_out);
+
+/**
+ * Wall clock time in nanoseconds at which system time was zero.
+ */
+uint64_t boottime_ns();
 
 } // namespace otrix::arch::kvmclock
@@ -41,8 +41,17 @@ public:
     //! Retrieve number of timer tick counts since the last shot.
     static int32_t get_timer_counts();
 
+    //! Retrieve vector currently in service by scanning ISR registers.
+    //! Costly under virtualization, every register read is an MSR access.
     static int get_active_irq();
 
+    //! Raise interrupt with the given vector on the current CPU.
+    static void send_self_ipi(uint8_t vector);
+
+    //! Send fixed interrupt to the CPU with the given APIC ID,
+    //! using a KVM hypercall when available.
+    static void send_ipi(uint32_t apic_id, uint8_t vector);
+
     static void signal_eoi();
 
     static void print_regs();
@@ -2,6 +2,7 @@
 #define OTRIX_ARCH_PAGING_HPP
 
 #include <cstddef>
+#include <cstdint>
 
 namespace otrix::arch
 {
@@ -11,6 +12,18 @@ namespace otrix::arch
 //! \note This function will upate cr3 register.
 void init_identity_mapping();
 
+//! Map physical range of device memory as uncacheable.
+//!
+//! Memory is identity-mapped, so the range stays at the same address,
+//! only caching attributes of the covering large pages are changed.
+//! RAM keeps the default write-back type, which is also correct for
+//! memory shared with DMA-coherent devices (e.g. virtqueues).
+//!
+//! \param phys_addr Physical address of the range.
+//! \param size Size of the range in bytes.
+//! \return Virtual address of the range, nullptr if it can't be mapped.
+void *map_mmio(uint64_t phys_addr, size_t size);
+
 } // namespace otrix::arch
 
 #endif // OTRIX_ARCH_PAGING_HPP
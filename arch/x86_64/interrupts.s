@@ -4,9 +4,28 @@
 arch_unused_irq_handler:
     iretq
 
+# Per-vector entry stubs push the vector number and continue in the common path,
+# so the handler does not need to query LAPIC for the vector in service.
+.altmacro
+.macro irq_stub vector
+.align 16
+arch_irq_stub_\vector:
+    push $\vector
+    jmp arch_irq_common
+.endm
+
+.macro irq_stub_address vector
+    .quad arch_irq_stub_\vector
+.endm
+
+.set vector, 32
+.rept 224
+    irq_stub %vector
+    .set vector, vector + 1
+.endr
+
 .extern irq_manager_irq_handler
-.global arch_used_irq_handler
-arch_used_irq_handler:
+arch_irq_common:
    push %rax
    push %rcx
    push %rdx
@@ -16,7 +35,12 @@ arch_used_irq_handler:
    push %r9
    push %r10
    push %r11
+   # Vector pushed by the stub
+   mov 72(%rsp), %rdi
+   # Interrupt frame, vector and saved registers take 120 bytes, keep the stack 16-byte aligned
+   sub $8, %rsp
    call irq_manager_irq_handler
+   add $8, %rsp
    pop %r11
    pop %r10
    pop %r9
@@ -26,8 +50,20 @@ arch_used_irq_handler:
    pop %rdx
    pop %rcx
    pop %rax
+   add $8, %rsp
    iretq
 
 .global arch_exception_handler
 arch_exception_handler:
     jmp .
+
+.section .rodata
+.align 8
+# Entry points of vectors 32-255
+.global arch_irq_stubs
+arch_irq_stubs:
+.set vector, 32
+.rept 224
+    irq_stub_address %vector
+    .set vector, vector + 1
+.endr
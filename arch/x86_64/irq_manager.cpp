@@ -6,14 +6,16 @@
 #include <cstdio>
 #include <otrix/immediate_console.hpp>
 #include "kernel/kthread.hpp"
+#include "kernel/kbench.hpp"
 
-extern "C" void arch_used_irq_handler(void *ctx);
+// Per-vector entry stubs, starting from FIRST_USER_IRQ_NUM
+extern "C" void (* const arch_irq_stubs[])(void *ctx);
 extern "C" void arch_unused_irq_handler(void *ctx);
 extern "C" void arch_exception_handler(void *ctx);
 
-extern "C" void irq_manager_irq_handler()
+extern "C" void irq_manager_irq_handler(uint64_t vector)
 {
-    otrix::arch::irq_manager::irq_handler();
+    otrix::arch::irq_manager::irq_handler(vector);
 }
 
 
@@ -46,7 +48,7 @@ int irq_manager::request_irq(irq_handler_t p_handler, const char *p_owner, void
             irq_table[i].counter = 0;
             irq_table[i].handler = p_handler;
             irq_table[i].p_context = p_handler_context;
-            set_entry(arch_used_irq_handler, i);
+            set_entry(arch_irq_stubs[i - FIRST_USER_IRQ_NUM], i);
             ret = i;
             break;
         }
@@ -99,20 +101,65 @@ irq_manager::idt_pointer irq_manager::generate_idt()
     return { sizeof(idt_table) - 1, idt_addr };
 }
 
-void irq_manager::irq_handler()
+void irq_manager::irq_handler(uint64_t vector)
 {
     scheduler::get().preempt_disable();
-    const int irq_n = local_apic::get_active_irq();
 
     local_apic::signal_eoi();
 
-    if (irq_n >= 0 && irq_table[irq_n].allocated) {
-        irq_table[irq_n].counter++;
-        if (irq_table[irq_n].handler) {
-            irq_table[irq_n].handler(irq_table[irq_n].p_context);
+    irq_entry &entry = irq_table[vector % NUM_IRQ];
+    if (entry.allocated) {
+        entry.counter++;
+        if (entry.handler) {
+            entry.handler(entry.p_context);
         }
     }
     scheduler::get().preempt_enable();
 }
 
 } // namespace otrix::arch
+
+static volatile uint64_t kbench_irq_tsc;
+
+// Entry-to-handler latency of a self-IPI.
+// With scan_isr the handler also looks up the vector in LAPIC ISR registers,
+// which is what every interrupt paid before per-vector entry stubs.
+static void kbench_irq_latency(otrix::kbench::state &s, bool scan_isr)
+{
+    using otrix::arch::irq_manager;
+    using otrix::arch::local_apic;
+
+    const otrix::arch::irq_handler_t handler = [] (void *) {
+        kbench_irq_tsc = arch_tsc();
+    };
+    const otrix::arch::irq_handler_t scan_isr_handler = [] (void *) {
+        otrix::kbench::do_not_optimize(local_apic::get_active_irq());
+        kbench_irq_tsc = arch_tsc();
+    };
+    const int irq = irq_manager::request_irq(scan_isr ? scan_isr_handler : handler, "kbench");
+    if (irq < 0) {
+        return;
+    }
+
+    while (s.run()) {
+        kbench_irq_tsc = 0;
+        const uint64_t start = arch_tsc();
+        local_apic::send_self_ipi(irq);
+        while (0 == kbench_irq_tsc) {
+            asm volatile("pause");
+        }
+        s.record(kbench_irq_tsc - start);
+    }
+
+    irq_manager::free_irq(irq);
+}
+
+KBENCH(irq_entry_latency)
+{
+    kbench_irq_latency(s, false);
+}
+
+KBENCH(irq_entry_latency_isr_scan)
+{
+    kbench_irq_latency(s, true);
+}
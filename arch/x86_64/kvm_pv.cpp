@@ -0,0 +1,129 @@
+#include "arch/kvm_pv.hpp"
+#include "arch/asm.h"
+#include "otrix/immediate_console.hpp"
+
+#define KVM_CPUID_SIGNATURE 0x40000000
+#define KVM_CPUID_FEATURES 0x40000001
+#define MSR_KVM_STEAL_TIME 0x4b564d03
+#define MSR_KVM_PV_EOI_EN 0x4b564d04
+#define KVM_MSR_ENABLED 1
+#define KVM_PV_EOI_BIT 0
+#define KVM_HC_SEND_IPI 10
+#define KVM_HC_SCHED_YIELD 11
+
+namespace otrix::arch::kvm_pv
+{
+
+struct kvm_steal_time {
+    uint64_t steal;
+    uint32_t version;
+    uint32_t flags;
+    uint8_t preempted;
+    uint8_t u8_pad[3];
+    uint32_t pad[11];
+} __attribute__((packed));
+
+// Shared with the host, memory is identity-mapped so addresses are physical
+alignas(64) static volatile kvm_steal_time steal_time;
+alignas(8) static volatile uint64_t pv_eoi;
+
+static bool pv_eoi_enabled;
+static bool steal_time_enabled;
+
+static uint32_t features()
+{
+    static bool detected;
+    static uint32_t kvm_features;
+    if (!detected) {
+        uint32_t eax, ebx, ecx, edx;
+        arch_cpuid(KVM_CPUID_SIGNATURE, 0, &eax, &ebx, &ecx, &edx);
+        if (ebx == 0x4b4d564b && ecx == 0x564b4d56 && edx == 0x4d && eax >= KVM_CPUID_FEATURES) {
+            arch_cpuid(KVM_CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+            kvm_features = eax;
+        }
+        detected = true;
+    }
+    return kvm_features;
+}
+
+static inline long hypercall(unsigned int nr, unsigned long a0, unsigned long a1 = 0,
+        unsigned long a2 = 0, unsigned long a3 = 0)
+{
+    long ret;
+    asm volatile("vmcall"
+            : "=a"(ret)
+            : "a"(nr), "b"(a0), "c"(a1), "d"(a2), "S"(a3)
+            : "memory");
+    return ret;
+}
+
+bool has_feature(kvm_feature feature)
+{
+    return 0 != (features() & (1u << feature));
+}
+
+void init()
+{
+    if (has_feature(KVM_FEATURE_PV_EOI)) {
+        pv_eoi = 0;
+        arch_write_msr(MSR_KVM_PV_EOI_EN, reinterpret_cast<uint64_t>(&pv_eoi) | KVM_MSR_ENABLED);
+        pv_eoi_enabled = true;
+    }
+    if (has_feature(KVM_FEATURE_STEAL_TIME)) {
+        arch_write_msr(MSR_KVM_STEAL_TIME, reinterpret_cast<uint64_t>(&steal_time) | KVM_MSR_ENABLED);
+        steal_time_enabled = true;
+    }
+    immediate_console::print("KVM PV: eoi %d, steal time %d, send ipi %d, sched yield %d\n",
+            pv_eoi_enabled, steal_time_enabled, has_feature(KVM_FEATURE_PV_SEND_IPI),
+            has_feature(KVM_FEATURE_PV_SCHED_YIELD));
+}
+
+bool try_fast_eoi()
+{
+    if (!pv_eoi_enabled) {
+        return false;
+    }
+    // Host sets the bit when EOI can be skipped, clearing it acknowledges the interrupt
+    bool was_set;
+    asm volatile("lock btrq %2, %1"
+            : "=@ccc"(was_set), "+m"(pv_eoi)
+            : "Ir"((uint64_t)KVM_PV_EOI_BIT)
+            : "memory");
+    return was_set;
+}
+
+uint64_t steal_time_ns()
+{
+    if (!steal_time_enabled) {
+        return 0;
+    }
+    uint32_t version;
+    uint64_t steal;
+    do {
+        version = steal_time.version;
+        asm("lfence" ::: "memory");
+        steal = steal_time.steal;
+        asm("lfence" ::: "memory");
+    } while ((version & 1) || (steal_time.version != version));
+    return steal;
+}
+
+bool send_ipi(uint32_t apic_id, uint32_t icr_low)
+{
+    if (!has_feature(KVM_FEATURE_PV_SEND_IPI)) {
+        return false;
+    }
+    // Destination bitmap starts at apic_id
+    return hypercall(KVM_HC_SEND_IPI, 1, 0, apic_id, icr_low) > 0;
+}
+
+bool sched_yield(uint32_t apic_id)
+{
+    if (!has_feature(KVM_FEATURE_PV_SCHED_YIELD)) {
+        return false;
+    }
+    hypercall(KVM_HC_SCHED_YIELD, apic_id);
+    return true;
+}
+
+} // namespace otrix::arch::kvm_pv
@@ -1,6 +1,7 @@
 #include "arch/lapic.hpp"
 #include "otrix/immediate_console.hpp"
 #include "arch/asm.h"
+#include "arch/kvm_pv.hpp"
 
 #define IA32_APIC_BASE_MSR 0x1B
 #define IA32_APIC_BASE_MSR_ENABLE 0x800
@@ -20,10 +21,12 @@ enum lapic_registers
     lapic_eoi_reg = 0x0B,
     lapic_spurious_interrupt = 0x0F,
     lapic_isr = 0x10,
+    lapic_icr = 0x30,
     lapic_timer_lvt = 0x32,
     lapic_timer_divider_cfg = 0x3E,
     lapic_timer_initial_cnt = 0x38,
     lapic_timer_current_cnt = 0x39,
+    lapic_self_ipi = 0x3F,
 };
 
 volatile uint32_t *local_apic::lapic_ptr_;
@@ -91,17 +94,35 @@ int32_t local_apic::get_timer_counts()
 
 int local_apic::get_active_irq()
 {
-    for (int i = 8; i >= 1; i--) {
+    // Vector in service is the highest one set in ISR0-ISR7
+    for (int i = 7; i >= 1; i--) {
         const uint32_t isr = read32(lapic_isr + i);
         if (isr) {
-            return 32 * i + __builtin_ffs(isr) - 1;
+            return 32 * i + 31 - __builtin_clz(isr);
         }
     }
     return -1;
 }
 
+void local_apic::send_self_ipi(uint8_t vector)
+{
+    write32(lapic_self_ipi, vector);
+}
+
+void local_apic::send_ipi(uint32_t apic_id, uint8_t vector)
+{
+    // Fixed delivery mode, physical destination
+    if (kvm_pv::send_ipi(apic_id, vector)) {
+        return;
+    }
+    arch_write_msr(IA32_MSR_X2APIC_MMIO + lapic_icr, ((uint64_t)apic_id << 32) | vector);
+}
+
 void local_apic::signal_eoi()
 {
+    if (kvm_pv::try_fast_eoi()) {
+        return;
+    }
     write32(lapic_eoi_reg, 0);
 }
 
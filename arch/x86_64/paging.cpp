@@ -3,6 +3,8 @@
 #include <cstdint>
 #include <type_traits>
 
+#include "arch/asm.h"
+
 namespace otrix::arch
 {
 
@@ -19,6 +21,17 @@ constexpr auto PAGE_CD       = 1LU << 4;
 constexpr auto PAGE_HUGE     = 1LU << 7;
 constexpr auto PAGE_PAT_HUGE = 1LU << 12;
 
+// PAT index 3 (PCD | PWT) is UC in the power-on PAT configuration
+constexpr auto PAGE_CACHE_UC = PAGE_CD | PAGE_WT;
+
+constexpr uint64_t PAGE_SIZE_2M = 2 << 20;
+constexpr uint64_t PAGE_SIZE_1G = 1 << 30;
+// Memory below this address is mapped by 2M pages of p2_tables
+constexpr uint64_t P2_MAPPED_LIMIT = 4 * PAGE_SIZE_1G;
+
+#define CPUID_EXT_FEATURES 0x80000001
+#define CPUID_EXT_FEATURES_EDX_PDPE1GB (1 << 26)
+
 static uint64_t make_p4_entry(const uint64_t p3_addr)
 {
     return PAGE_PRESENT | PAGE_RW | p3_addr;
@@ -54,4 +67,50 @@ void init_identity_mapping()
     asm volatile("mov %0, %%rax\n\tmov %%rax, %%cr3" : : "m" (p4_addr) : "memory", "eax");
 }
 
+static bool has_1g_pages()
+{
+    uint32_t eax, ebx, ecx, edx;
+    arch_cpuid(CPUID_EXT_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    return 0 != (edx & CPUID_EXT_FEATURES_EDX_PDPE1GB);
+}
+
+static void flush_tlb()
+{
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0\n\tmov %0, %%cr3" : "=r" (cr3) : : "memory");
+}
+
+void *map_mmio(uint64_t phys_addr, size_t size)
+{
+    if (0 == size) {
+        return nullptr;
+    }
+    const uint64_t end = phys_addr + size;
+    // Single p3 table limits the address space to 512G
+    if (end < phys_addr || end > 512 * PAGE_SIZE_1G) {
+        return nullptr;
+    }
+    if (end > P2_MAPPED_LIMIT && !has_1g_pages()) {
+        return nullptr;
+    }
+
+    auto flags = arch_irq_save();
+    uint64_t addr = phys_addr;
+    while (addr < end) {
+        if (addr < P2_MAPPED_LIMIT) {
+            const uint64_t page = addr / PAGE_SIZE_2M;
+            p2_tables[page / 512][page % 512] |= PAGE_CACHE_UC;
+            addr = (page + 1) * PAGE_SIZE_2M;
+        } else {
+            const uint64_t page = addr / PAGE_SIZE_1G;
+            p3_table[page] = make_p3_entry_huge(page * PAGE_SIZE_1G) | PAGE_CACHE_UC;
+            addr = (page + 1) * PAGE_SIZE_1G;
+        }
+    }
+    flush_tlb();
+    arch_irq_restore(flags);
+
+    return reinterpret_cast<void *>(phys_addr);
+}
+
 } // namespace otrix::arch
@@ -176,12 +176,13 @@ static inline struct intrusive_list *intrusive_list_insert(struct intrusive_list
 }
 
 /**
- * Inserts node after prev.
+ * Inserts node before the first entry for which compare(entry, node) returns true.
  *
- * @param[in] prev  List node to insert after.
- * @param[in] node  List node to insert.
+ * @param[in] head      Head of the sorted list.
+ * @param[in] node      List node to insert.
+ * @param[in] compare   Ordering predicate.
  *
- * @return Pointer to inserted node.
+ * @return New head of list.
  */
 static inline struct intrusive_list *intrusive_list_insert_sorted(struct intrusive_list *head,
         struct intrusive_list *node, bool (*compare)(struct intrusive_list *a, struct intrusive_list *b))
@@ -189,32 +190,24 @@ static inline struct intrusive_list *intrusive_list_insert_sorted(struct intrusi
     kASSERT(node != NULL);
 
     if (NULL == head) {
-        return node;
+        return intrusive_list_init(node);
     }
 
-    // Replace head
-    if (compare(head, node)) {
-        node->next = head;
-        node->prev = head->prev;
-        head->prev = node;
-        if (head->next == head) {
-            head->next = node;
+    const bool replace_head = compare(head, node);
+    struct intrusive_list *current = head;
+    if (!replace_head) {
+        current = head->next;
+        while (current != head && !compare(current, node)) {
+            current = current->next;
         }
-        return node;
     }
 
-    struct intrusive_list *current = head->next;
-    while(current != head && !compare(current, node)) {
-        current = current->next;
-    }
     node->next = current;
     node->prev = current->prev;
+    current->prev->next = node;
     current->prev = node;
-    if (current->next == current) {
-        current->next = node;
-    }
 
-    return head;
+    return replace_head ? node : head;
 }
 
 #ifdef __cplusplus
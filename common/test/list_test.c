@@ -85,9 +85,35 @@ TEST(list_tests, test_list_insert)
     TEST_ASSERT_EQUAL_PTR(tdt2.node.prev, &to_insert.node);
 }
 
+static bool greater_than(struct intrusive_list *a, struct intrusive_list *b)
+{
+    return container_of(a, test_data_t, node)->data > container_of(b, test_data_t, node)->data;
+}
+
+TEST(list_tests, test_list_insert_sorted)
+{
+    const int values[] = { 5, 1, 9, 3, 7, 0 };
+    test_data_t test_data[sizeof(values) / sizeof(values[0])];
+    struct intrusive_list *head = NULL;
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        test_data[i].data = values[i];
+        head = intrusive_list_insert_sorted(head, &test_data[i].node, greater_than);
+    }
+
+    const int expected[] = { 0, 1, 3, 5, 7, 9 };
+    struct intrusive_list *current = head;
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        TEST_ASSERT_EQUAL_INT(expected[i], container_of(current, test_data_t, node)->data);
+        TEST_ASSERT_EQUAL_PTR(current, current->next->prev);
+        current = current->next;
+    }
+    TEST_ASSERT_EQUAL_PTR(head, current);
+}
+
 TEST_GROUP_RUNNER(list_tests)
 {
     RUN_TEST_CASE(list_tests, test_list_push_back);
     RUN_TEST_CASE(list_tests, test_list_delete_first);
     RUN_TEST_CASE(list_tests, test_list_insert);
+    RUN_TEST_CASE(list_tests, test_list_insert_sorted);
 }
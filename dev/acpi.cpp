@@ -4,6 +4,7 @@
 #include <cstring>
 
 #include "otrix/immediate_console.hpp"
+#include "kernel/boot_info.hpp"
 
 #define ACPI_BIOS_AREA_START ((void *)0x000E0000)
 #define ACPI_BIOS_AREA_END ((void *)0x000FFFFF)
@@ -182,16 +183,24 @@ static kerror_t acpi_parse_rsdt(const acpi_rsdt *rsdt)
 
     acpi_print_sdt_hdr(&rsdt->hdr);
 
-    if (memcmp(rsdt->hdr.signature, rsdt_signature,
-                    strlen(rsdt_signature)) != 0) {
+    // XSDT holds 64-bit pointers
+    size_t entry_size;
+    if (memcmp(rsdt->hdr.signature, rsdt_signature, strlen(rsdt_signature)) == 0) {
+        entry_size = sizeof(uint32_t);
+    } else if (memcmp(rsdt->hdr.signature, xsdt_signature, strlen(xsdt_signature)) == 0) {
+        entry_size = sizeof(uint64_t);
+    } else {
         immediate_console::print("Failed %d %02x %02x %02x %02x %.4s\n", __LINE__, rsdt->hdr.signature[0], rsdt->hdr.signature[1], rsdt->hdr.signature[2], rsdt->hdr.signature[3], (char *)rsdt->hdr.signature);
         return E_INVAL;
     }
 
-    const int num_entries = (rsdt->hdr.length - sizeof(struct acpi_rsdt)) / 4;
+    const int num_entries = (rsdt->hdr.length - sizeof(struct acpi_rsdt)) / entry_size;
     immediate_console::print("num_entries: %d\n", num_entries);
+    const uint8_t *entries = reinterpret_cast<const uint8_t *>(rsdt->sdt_pointers);
     for (int i = 0; i < num_entries; i++) {
-        kerror_t ret = acpi_parse_sdt_entry(rsdt->sdt_pointers[i]);
+        uint64_t addr = 0;
+        memcpy(&addr, entries + i * entry_size, entry_size);
+        kerror_t ret = acpi_parse_sdt_entry(addr);
         if (ret != E_OK) {
             immediate_console::print("Failed %d\n", __LINE__);
             return ret;
@@ -201,31 +210,41 @@ static kerror_t acpi_parse_rsdt(const acpi_rsdt *rsdt)
     return E_OK;
 }
 
+static kerror_t acpi_parse_rsdp(const acpi_rsdp *rsdp)
+{
+    immediate_console::print("ACPI version %d @ %p OEMID %.6s\n", rsdp->revision, rsdp, rsdp->OEMID);
+    if (0 == rsdp->revision) {
+        immediate_console::print("RSDT addr %d 0x%08x\n", rsdp->revision, rsdp->rsdt_addr);
+        return acpi_parse_rsdt(reinterpret_cast<const acpi_rsdt *>(rsdp->rsdt_addr));
+    } else {
+        immediate_console::print("XSDT addr %d 0x%08x\n", rsdp->revision, rsdp->xsdt_addr);
+        return acpi_parse_rsdt(reinterpret_cast<const acpi_rsdt *>(rsdp->xsdt_addr));
+    }
+}
+
 kerror_t acpi_init(void)
 {
+    // Bootloader has already located RSDP, no need to scan BIOS memory
+    const void *boot_rsdp = otrix::boot_info::acpi_rsdp();
+    if (nullptr != boot_rsdp) {
+        return acpi_parse_rsdp(reinterpret_cast<const acpi_rsdp *>(boot_rsdp));
+    }
+
     const uint64_t *ptr = reinterpret_cast<const uint64_t *>(ACPI_BIOS_AREA_START);
 
-    while (ptr != ACPI_BIOS_AREA_END) {
+    while (ptr < ACPI_BIOS_AREA_END) {
         if (memcmp(ptr, rsdp_signature, strlen(rsdp_signature)) != 0) {
             ptr++;
             continue;
         }
-        const acpi_rsdp *rsdp = (struct acpi_rsdp *)ptr;
-        immediate_console::print("ACPI version %d @ %p OEMID %.6s\n", rsdp->revision, ptr, rsdp->OEMID);
-        if (0 == rsdp->revision) {
-            immediate_console::print("RSDT addr %d 0x%08x\n", rsdp->revision, rsdp->rsdt_addr);
-            return acpi_parse_rsdt(reinterpret_cast<const acpi_rsdt *>(rsdp->rsdt_addr));
-        } else {
-            immediate_console::print("XSDT addr %d 0x%08x\n", rsdp->revision, rsdp->xsdt_addr);
-            return acpi_parse_rsdt(reinterpret_cast<const acpi_rsdt *>(rsdp->xsdt_addr));
-        }
+        return acpi_parse_rsdp(reinterpret_cast<const acpi_rsdp *>(ptr));
     }
 
     immediate_console::print("Failed %d\n", __LINE__);
     return E_NODEV;
 }
 
-void *acpi_get_io_apic(void)
+void *acpi_get_ioapic_addr(void)
 {
     return acpi_context.ioapic_base;
 }
@@ -32,14 +32,45 @@ public:
         return 0;
     }
 
+    /**
+     * Get address of memory or I/O space decoded by BAR @c num.
+     * Address of 64-bit memory BAR is combined from @c num and the following BAR.
+     */
+    uint64_t bar_address(unsigned int num) const;
+
+    bool bar_is_io(unsigned int num) const {
+        return num < NUM_BARS && (io_bars_ & (1 << num));
+    }
+
     kerror_t enable_bus_mastering(bool enable);
 
+    kerror_t enable_memory_space(bool enable);
+
     kerror_t enable_msix(bool enable);
 
     std::pair<kerror_t, uint16_t> request_msix(void (*p_handler)(void *), const char *p_owner, void *p_handler_context = nullptr);
 
     void free_msix(uint16_t vector);
 
+    /**
+     * Number of MSI-X vectors supported by the device.
+     */
+    uint16_t msix_vectors() const {
+        return msix_table_size_;
+    }
+
+    /**
+     * Find capability @c cap_id in the capability list.
+     * @param[in] prev Offset returned by the previous call to find following capability
+     *                 with the same ID, 0 to find the first one.
+     * @return Offset of capability in configuration space, 0 if not found.
+     */
+    uint8_t find_cap(uint8_t cap_id, uint8_t prev = 0) const;
+
+    uint8_t cfg_read8(uint8_t reg);
+    uint16_t cfg_read16(uint8_t reg);
+    uint32_t cfg_read32(uint8_t reg);
+
     void print_info() const;
 
     struct descriptor_t
@@ -57,10 +88,6 @@ public:
 private:
     pci_dev(uint8_t bus, uint8_t dev, uint8_t function, uint16_t device_id, uint16_t vendor_id);
 
-    uint8_t cfg_read8(uint8_t reg);
-    uint16_t cfg_read16(uint8_t reg);
-    uint32_t cfg_read32(uint8_t reg);
-
     void cfg_write8(uint8_t reg, uint8_t value);
     void cfg_write16(uint8_t reg, uint16_t value);
     void cfg_write32(uint8_t reg, uint32_t value);
@@ -81,6 +108,7 @@ private:
 
     static constexpr auto NUM_BARS = 6;
     uint32_t bar_[NUM_BARS];
+    uint8_t io_bars_; // Bitmask of BARs decoding I/O space
 
     struct msix_entry_t {
         uint32_t message_address_low;
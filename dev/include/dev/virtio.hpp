@@ -4,10 +4,26 @@
 #include <cstddef>
 #include "dev/pci.hpp"
 #include "common/error.h"
+#include "kernel/tunable.hpp"
+
+namespace otrix
+{
+class semaphore;
+} // namespace otrix
 
 namespace otrix::dev
 {
 
+struct virtio_pci_common_cfg;
+
+/**
+ * Base class for virtio PCI devices.
+ *
+ * Virtio 1.0 (modern) transport is used when the device exposes vendor-specific
+ * PCI capabilities: registers are accessed through uncached MMIO and each queue
+ * is notified with a single store. Legacy I/O port interface of BAR0 is used
+ * otherwise, or when "virtio.force_legacy" is set.
+ */
 class virtio_dev
 {
 public:
@@ -36,11 +52,29 @@ protected:
         isr_status         = 0x13,
         config_msix_vector = 0x14,
         queue_msix_vector  = 0x16,
+        // Device-specific configuration follows, the legacy offset assumes MSI-X is enabled
+        device_config      = 0x18,
     };
 
+    /**
+     * Access common registers.
+     * Register numbers use legacy layout and are translated for the modern transport.
+     * Device-specific registers are handled by subclasses via config_read/config_write.
+     */
     virtual uint32_t read_reg(uint16_t reg);
     virtual void write_reg(uint16_t reg, uint32_t value);
 
+    /**
+     * Access device-specific configuration.
+     * @param[in] offset Offset from the start of the device-specific configuration.
+     */
+    uint8_t config_read8(uint16_t offset);
+    uint16_t config_read16(uint16_t offset);
+    uint32_t config_read32(uint16_t offset);
+    void config_write8(uint16_t offset, uint8_t value);
+    void config_write16(uint16_t offset, uint16_t value);
+    void config_write32(uint16_t offset, uint32_t value);
+
     struct virtio_descriptor
     {
         uint64_t addr;
@@ -61,8 +95,48 @@ protected:
         uint32_t len;
     } __attribute__((packed));
 
+    struct virtio_packed_descriptor
+    {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t id;
+        uint16_t flags;
+    } __attribute__((packed));
+
+    struct virtio_packed_event
+    {
+        uint16_t off_wrap;
+        uint16_t flags;
+    } __attribute__((packed));
+
+    // Called with the first segment of a used buffer, @c len is the number of bytes written by the device
     typedef void (*vq_irq_handler_t)(void *ctx, void *data_ctx, void *data, size_t len);
 
+    // Buffer state of packed virtqueue, indexed by buffer ID
+    struct virtq_packed_buf {
+        void *addr; // First segment
+        uint32_t len;
+        uint16_t next; // Next free buffer ID
+        uint16_t num_descriptors; // Ring descriptors taken by the buffer
+        void *indirect; // Indirect descriptor table, freed on completion
+    };
+
+    // Segment of a scatter-gather buffer
+    struct virtq_iovec {
+        void *addr;
+        uint32_t len;
+    };
+
+    struct virtq_stats_t {
+        uint64_t buffers;          // Buffers added to the available ring
+        uint64_t completions;      // Buffers returned in the used ring
+        uint64_t kicks;            // Device notifications
+        uint64_t kicks_suppressed; // Notifications skipped because the device didn't ask for them
+        uint64_t irqs;
+        uint64_t publishes;        // Updates of the available index, one per batch
+        uint64_t polls;            // virtq_poll() calls
+    };
+
     struct virtq {
         int index;
         uint16_t size;
@@ -74,15 +148,40 @@ protected:
         volatile virtio_used_elem *used_ring;
         void **desc_ctx; // array of descriptor contexts specified in virtq_send_buffer
         uint16_t used_idx;
+        uint16_t num_in_flight; // Buffers made available and not used yet, a buffer may take several descriptors
         int num_free_descriptors;
         int free_list;
         vq_irq_handler_t irq_handler;
         void *irq_handler_ctx;
+        volatile uint16_t *notify_addr; // Queue notification register, nullptr for legacy transport
+        volatile uint16_t *used_event;  // Driver asks for interrupt when used index passes it (EVENT_IDX)
+        volatile uint16_t *avail_event; // Device asks for notification when avail index passes it (EVENT_IDX)
+        uint16_t kicked_avail_idx;      // Avail index at the last notification decision
+        uint16_t irq_batch;             // Max number of completions per interrupt with EVENT_IDX
+        bool event_idx;
+        bool indirect;                  // VIRTIO_F_INDIRECT_DESC
+        semaphore *poll_event;          // Given on interrupt in poll mode, nullptr in interrupt mode
+        virtq_stats_t stats;
+
+        // Packed ring (VIRTIO_F_RING_PACKED), split ring fields above are unused except desc_ctx
+        bool packed;
+        bool in_order;         // VIRTIO_F_IN_ORDER: buffer ID equals ring position
+        volatile virtio_packed_descriptor *packed_ring;
+        volatile virtio_packed_event *driver_event;
+        volatile virtio_packed_event *device_event;
+        virtq_packed_buf *packed_bufs;
+        uint16_t next_avail;
+        uint16_t next_used;
+        bool avail_wrap;
+        bool used_wrap;
+        uint16_t avail_count;  // Free-running number of added buffers
+        uint16_t free_id;
     };
 
     /**
      * Create virtqueue with @c index.
      * This allocates required amount of pages to hold descritor and avail/used rings.
+     * Packed layout is used if VIRTIO_F_RING_PACKED is negotiated, otherwise split.
      * @param[in] index Index of queue to use.
      * @param[out] p_out_virtq Pointer to the created virtqueue handle.
      * @param[in] p_handler If not nullptr, MSI-X is enabled for this queue,
@@ -102,20 +201,168 @@ protected:
     kerror_t virtq_send_buffer(virtq *p_vq, void *p_buffer, uint32_t buffer_size,
             bool device_writable, void *buf_ctx = nullptr);
 
-    virtual uint32_t negotiate_features(uint32_t device_features);
+    /**
+     * Add scatter-gather buffer as a descriptor chain.
+     * Long chains (see "virtio.indirect_min_segments") and chains which don't fit into the ring
+     * are put into an indirect descriptor table if VIRTIO_F_INDIRECT_DESC is negotiated.
+     * The completion handler gets @c buf_ctx and the first segment.
+     * @param[in] p_iov Segments, device-readable ones followed by device-writable ones.
+     * @param[in] num_readable Number of device-readable segments.
+     * @param[in] num_writable Number of device-writable segments.
+     * @retval E_NOMEM Not enough free descriptors.
+     * @retval E_INVAL Chain is empty or longer than the ring.
+     */
+    kerror_t virtq_send_chain(virtq *p_vq, const virtq_iovec *p_iov, size_t num_readable,
+            size_t num_writable, void *buf_ctx = nullptr);
+
+    // Buffers added to a batch become visible to the device together
+    struct virtq_batch {
+        virtq *vq;
+        long irq_flags;
+        size_t num_reserved;     // Descriptors which can still be added
+        uint16_t num_buffers;
+        uint16_t num_descriptors;
+        uint16_t head_pos;       // Packed ring: position of the first descriptor, its flags are written on publish
+        uint16_t head_flags;
+    };
+
+    /**
+     * Start a batch of buffers for @c p_vq and reserve up to @c num_descriptors descriptors.
+     * Interrupts are disabled until virtq_batch_publish(), so buffers are added without locking,
+     * and the batch must be published without sleeping.
+     * @return Number of reserved descriptors, may be less than requested if the ring is full.
+     */
+    size_t virtq_batch_begin(virtq *p_vq, virtq_batch *p_batch, size_t num_descriptors);
+
+    /**
+     * Add scatter-gather buffer to the batch, same as virtq_send_chain().
+     * @retval E_NOMEM Reserved descriptors are exhausted.
+     */
+    kerror_t virtq_batch_add(virtq_batch *p_batch, const virtq_iovec *p_iov, size_t num_readable,
+            size_t num_writable, void *buf_ctx = nullptr);
+
+    /**
+     * Make all buffers of the batch available with a single index update and notify the device if needed.
+     */
+    void virtq_batch_publish(virtq_batch *p_batch);
+
+    /**
+     * Request interrupts after up to @c max_completions used buffers instead of every buffer.
+     * Effective only with VIRTIO_F_EVENT_IDX. The device still interrupts once 3/4 of
+     * buffers in flight are used, which delays their completion, so batching is meant for
+     * queues where buffers complete without external events (e.g. TX).
+     */
+    void virtq_set_irq_batch(virtq *p_vq, uint16_t max_completions);
+
+    /**
+     * Switch completion processing of the queue to poll mode.
+     * The interrupt only disables further queue interrupts and gives @c p_event, the poll context
+     * waiting on it calls virtq_poll() until the used ring is empty. Handlers then run in thread context.
+     * @param[in] p_event Poll context event, nullptr returns the queue to interrupt mode.
+     */
+    void virtq_set_poll_event(virtq *p_vq, semaphore *p_event);
+
+    /**
+     * Process up to @c budget used buffers.
+     * Interrupts are re-enabled only when the used ring is found empty.
+     * @retval true Used ring is empty and interrupts are enabled, wait for the poll event.
+     * @retval false Budget is exhausted, poll again.
+     */
+    bool virtq_poll(virtq *p_vq, size_t budget);
+
+    /**
+     * Process up to @c budget used buffers of a poll mode queue in the calling thread.
+     * Queue interrupts are disabled until virtq_busy_poll_end(), the caller must not
+     * run concurrently with the poll context.
+     * @return Number of used buffers processed.
+     */
+    size_t virtq_busy_poll(virtq *p_vq, size_t budget);
+
+    /**
+     * Re-enable queue interrupts disabled by virtq_busy_poll().
+     * Buffers used in the meantime are handed to the poll context.
+     */
+    void virtq_busy_poll_end(virtq *p_vq);
+
+    void print_vq_stats(const virtq *p_vq) const;
+
+    /**
+     * Select features supported by the driver.
+     * Transport features above bit 31 are managed by virtio_dev and are masked out of the result.
+     */
+    virtual uint64_t negotiate_features(uint64_t device_features);
 
     void begin_init();
 
     void init_finished();
 
+    bool modern() const
+    {
+        return nullptr != common_cfg_;
+    }
+
+    uint64_t features() const
+    {
+        return features_;
+    }
+
     pci_dev *pci_dev_;
 
 private:
     static void handle_vq_irq(void *ctx);
 
+    /**
+     * Locate common, notify, ISR and device configuration structures of the modern transport.
+     * @retval false Device doesn't support modern transport, legacy registers are used.
+     */
+    bool init_modern_transport();
+
+    uint64_t read_device_features();
+    void write_driver_features(uint64_t features);
+
+    /**
+     * Decide whether the device has to be notified about entries added to the
+     * available ring after @c old_idx up to @c new_idx.
+     */
+    bool virtq_need_notify(virtq *p_vq, uint16_t old_idx, uint16_t new_idx);
+
+    /**
+     * Same as virtq_need_notify() for packed ring, where entries are identified
+     * by ring positions and the wrap counter at @c new_pos.
+     */
+    bool virtq_need_notify_packed(virtq *p_vq, uint16_t old_pos, uint16_t new_pos, bool wrap);
+
+    kerror_t virtq_batch_add_packed(virtq_batch *p_batch, const virtq_iovec *p_iov, size_t num_readable,
+            size_t num_writable, void *buf_ctx);
+
+    bool virtq_use_indirect(const virtq *p_vq, size_t num_segments, size_t num_available) const;
+
+    static size_t virtq_process_used(virtq *p_vq, size_t budget);
+    static size_t virtq_process_used_packed(virtq *p_vq, size_t budget);
+    static bool virtq_has_used(virtq *p_vq);
+    static void virtq_disable_irq(virtq *p_vq);
+
+    /**
+     * Enable queue interrupts.
+     * @return true if there are no used buffers left, which would otherwise be missed.
+     */
+    static bool virtq_enable_irq(virtq *p_vq);
+
+    void virtq_notify(virtq *p_vq);
+
 private:
     bool valid_;
-    uint32_t features_;
+    uint64_t features_;
+
+    volatile virtio_pci_common_cfg *common_cfg_;
+    volatile uint8_t *isr_;
+    volatile uint8_t *device_cfg_;
+    volatile uint8_t *notify_base_;
+    uint32_t notify_off_multiplier_;
+
+    static tunable<bool> force_legacy_;
+    static tunable<bool> packed_;
+    static tunable<size_t> indirect_min_segments_;
 };
 
 } // namespace otrix::dev
@@ -2,6 +2,12 @@
 
 #include "dev/virtio.hpp"
 
+namespace otrix::kbench
+{
+class state;
+void bench_virtio_blk_read_4k(state &s);
+} // namespace otrix::kbench
+
 namespace otrix::dev
 {
 
@@ -13,17 +19,47 @@ public:
 
     void print_info() override;
 
+    static constexpr size_t SECTOR_SIZE = 512;
+
+    /**
+     * Read from the device, blocks until the request is completed.
+     * @param[in] sector First sector to read.
+     * @param[out] p_buf Destination buffer.
+     * @param[in] size Number of bytes to read, multiple of SECTOR_SIZE.
+     * @retval E_INVAL Size isn't a multiple of SECTOR_SIZE.
+     * @retval E_NOMEM Request queue is full.
+     * @retval E_NOIMPL Request is not supported by the device.
+     * @retval E_NODEV Device reported I/O error.
+     */
+    kerror_t read(uint64_t sector, void *p_buf, size_t size);
+
+    /**
+     * Write to the device, blocks until the request is completed.
+     * Return values are the same as for read().
+     */
+    kerror_t write(uint64_t sector, const void *p_buf, size_t size);
+
+    /**
+     * Flush volatile write cache of the device.
+     */
+    kerror_t flush();
+
+    /**
+     * Device capacity in sectors.
+     */
+    uint64_t capacity();
+
     static bool is_virtio_blk_device(pci_dev *p_dev)
     {
         if (nullptr == p_dev) {
             return false;
         }
-        return p_dev->vendor_id() == 0x1af4 && p_dev->device_id() == 0x1001;
+        return p_dev->vendor_id() == 0x1af4 && (p_dev->device_id() == 0x1001 || p_dev->device_id() == 0x1042);
     }
 
 protected:
 
-    uint32_t negotiate_features(uint32_t device_features) override;
+    uint64_t negotiate_features(uint64_t device_features) override;
 
     enum virtio_blk_registers {
         capacity1 = 0x18,
@@ -40,7 +76,15 @@ protected:
 
     void handle_request_completion(void *data_ctx, void *data, size_t size);
 
+    kerror_t submit_request(uint32_t type, uint64_t sector, void *p_buf, size_t size);
+
     virtq *request_q_;
+
+    static constexpr size_t MAX_REQUEST_SIZE = 64 * 1024;
+    static constexpr size_t MAX_BATCH_REQUESTS = 16;
+    static tunable<size_t> max_request_size_; // Larger transfers are split into several requests
+
+    friend void kbench::bench_virtio_blk_read_4k(kbench::state &s);
 };
 
 } // namespace otrix::dev
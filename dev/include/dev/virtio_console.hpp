@@ -16,13 +16,13 @@ public:
         if (nullptr == p_dev) {
             return false;
         }
-        return p_dev->vendor_id() == 0x1af4 && p_dev->device_id() == 0x1003;
+        return p_dev->vendor_id() == 0x1af4 && (p_dev->device_id() == 0x1003 || p_dev->device_id() == 0x1043);
     }
 
     size_t write(const char *data, size_t size);
 
 protected:
-    uint32_t negotiate_features(uint32_t device_features) override;
+    uint64_t negotiate_features(uint64_t device_features) override;
 
     enum virtio_console_registers {
         console_cols = 0x18,
@@ -2,13 +2,23 @@
 
 #include "dev/virtio.hpp"
 #include "net/linkif.hpp"
+#include "net/gro.hpp"
+#include "net/packet_filter.hpp"
 #include "common/utils.h"
 #include "kernel/semaphore.hpp"
-#include "kernel/msgq.hpp"
 #include "kernel/kthread.hpp"
+#include "kernel/tunable.hpp"
 
 #include <tuple>
 
+namespace otrix::kbench
+{
+class state;
+void bench_virtq_send_buffer(state &s);
+void bench_virtq_tx_completion(state &s);
+void bench_virtq_send_burst(state &s);
+} // namespace otrix::kbench
+
 namespace otrix::dev
 {
 
@@ -25,7 +35,8 @@ public:
         if (nullptr == p_dev) {
             return false;
         }
-        return p_dev->vendor_id() == 0x1af4 && p_dev->device_id() == 0x1000;
+        // Transitional or modern-only device ID
+        return p_dev->vendor_id() == 0x1af4 && (p_dev->device_id() == 0x1000 || p_dev->device_id() == 0x1041);
     }
 
     void get_mac(net::mac_t *p_out) override;
@@ -35,8 +46,43 @@ public:
 
     size_t headers_size() const override;
 
+    uint32_t offloads() const override;
+
+    bool busy_poll_begin() override;
+    size_t busy_poll(size_t budget) override;
+    void busy_poll_end() override;
+
+    /**
+     * Switch device-side promiscuous and all-multicast receive modes.
+     * @retval E_NOIMPL VIRTIO_NET_F_CTRL_RX is not negotiated.
+     */
+    kerror_t set_rx_mode(bool promisc, bool allmulti);
+
+    /**
+     * Replace addresses accepted by the device besides own address and broadcast.
+     * @retval E_INVAL More than MAX_MAC_FILTERS addresses in a table.
+     */
+    kerror_t set_mac_filter(const net::mac_t *p_unicast, size_t num_unicast,
+            const net::mac_t *p_multicast, size_t num_multicast);
+
+    /**
+     * Accept or drop frames tagged with VLAN @c vid. With VIRTIO_NET_F_CTRL_VLAN negotiated
+     * tagged frames are dropped unless accepted here.
+     */
+    kerror_t set_vlan_filter(uint16_t vid, bool accept);
+
+    static constexpr auto MAX_MAC_FILTERS = 16;
+
+    /**
+     * Run on every received frame right after it is taken from the RX queue.
+     */
+    net::packet_filter *rx_packet_filter() override
+    {
+        return &packet_filter_;
+    }
+
 protected:
-    uint32_t negotiate_features(uint32_t device_features) override;
+    uint64_t negotiate_features(uint64_t device_features) override;
 
     enum virtio_net_registers {
         mac_0 = 0x18,
@@ -54,24 +100,193 @@ protected:
 
 private:
 
+    // Receive queue with its poll context
+    struct rx_queue
+    {
+        rx_queue(virtio_net *p_dev, size_t index);
+
+        virtio_net *p_dev;
+        size_t index; // Index of the queue pair
+        virtq *vq;
+        semaphore poll_event;
+        kthread thread;
+        size_t num_buffers; // Number of buffers sent to the queue
+        uint8_t *p_pool; // Page per buffer, sockbuf of a received packet lives in the buffer headroom
+        uint8_t **p_free_buffers; // Stack of buffers neither in the queue nor in the network stack
+        size_t num_free_buffers;
+        size_t pool_size;
+        size_t pool_recycled; // Buffers returned straight to the queue
+        size_t pool_exhausted; // Refills stopped by an empty pool
+        size_t pool_copied; // Frames copied out of their buffer while the pool was low
+        uint8_t *p_merge; // Copy of the packet spread over several buffers (VIRTIO_NET_F_MRG_RXBUF)
+        size_t merge_size;
+        size_t merge_remaining; // Buffers of the packet yet to arrive
+        net::gro gro; // Flushed at the end of each poll budget
+        bool processing; // Used ring is being processed by rx_thread() or a busy poller
+        bool deferred; // rx_thread() was woken while busy pollers held the queue
+    };
+
+    // Transmit queue with frames waiting for room in it
+    struct tx_queue
+    {
+        tx_queue();
+
+        virtio_net *p_dev;
+        virtq *vq;
+        intrusive_list *p_backlog; // Frames waiting for descriptors, oldest first
+        size_t backlog_len;
+        intrusive_list *p_completed; // Transmitted frames, freed by reclaim_tx()
+        size_t num_completed;
+        semaphore space_event; // Given on completion while senders are blocked on a full backlog
+        size_t num_blocked;
+        size_t backlogged; // Frames which went through the backlog
+        size_t blocked; // Times a sender was blocked
+        size_t reclaimed;
+    };
+
     static void tx_completion_event(void *ctx, void *data_ctx, void *data, size_t size);
     static void rx_handler(void *ctx, void *data_ctx, void *data, size_t size);
-    void rx_thread();
+    static void ctrl_completion_event(void *ctx, void *data_ctx, void *data, size_t size);
+    void rx_thread(rx_queue *p_rxq);
+    void handle_rx(rx_queue *p_rxq, net::sockbuf *skb);
+    void deliver_rx(net::sockbuf *skb); // Pass frame to the L3 handler, called by GRO
+
+    /**
+     * Run packet filter on a received frame.
+     * @return true if the frame was dropped or sent back.
+     */
+    bool filter_rx(rx_queue *p_rxq, net::sockbuf *skb);
+
+    /**
+     * Send received frame back out through the TX queue of the same pair.
+     */
+    void tx_bounce(rx_queue *p_rxq, net::sockbuf *skb);
+    void refill_rx(rx_queue *p_rxq);
+
+    /**
+     * Allocate fixed RX buffer pool of the queue, sized from rx_queue_size.
+     */
+    kerror_t init_rx_pool(rx_queue *p_rxq);
+
+    /**
+     * Return received buffer to its queue, or to the pool if the queue is full.
+     */
+    void recycle_rx_buffer(rx_queue *p_rxq, void *buf);
+
+    /**
+     * Check if data lies in the receive buffer pool of the queue.
+     */
+    bool is_rx_buffer(const rx_queue *p_rxq, const void *p_data) const;
+
+    /**
+     * Queue frames with all headers in place, the device is notified at most once.
+     * Queued frames are owned by the TX queue and freed on completion.
+     * @return Number of queued frames, the rest stays with the caller.
+     */
+    size_t tx_burst(virtq *p_vq, net::sockbuf *const *p_frames, size_t num_frames);
 
-    virtq *tx_q_;
-    virtq *rx_q_;
+    /**
+     * Queue frames to the ring, or to the backlog when the ring is full. Sender is blocked
+     * for up to @c timeout_ms while the backlog is full too.
+     * @param overcommit Queue all frames, the backlog may grow past its size limit.
+     * @return Number of queued frames, the rest stays with the caller.
+     */
+    size_t tx_submit(tx_queue *p_txq, net::sockbuf *const *p_frames, size_t num_frames, uint64_t timeout_ms,
+            bool overcommit = false);
+
+    /**
+     * Move backlogged frames to the ring, called with interrupts disabled.
+     */
+    void tx_drain_backlog(tx_queue *p_txq);
+
+    /**
+     * Free up to @c budget transmitted frames.
+     */
+    void reclaim_tx(tx_queue *p_txq, size_t budget);
+
+    /**
+     * GSO type of a TCP frame larger than its segment size,
+     * VIRTIO_NET_HDR_GSO_NONE if the device can't segment it.
+     */
+    uint8_t tso_type(const net::sockbuf *data) const;
+
+    /**
+     * Split TCP frame into segments of data->gso_size() payload bytes and queue them.
+     * Segments reference the payload of the frame, which is freed after the last one is transmitted.
+     * Either all segments are queued or none.
+     * @retval E_NOMEM Nothing was queued, the frame stays with the caller.
+     */
+    kerror_t tx_gso(tx_queue *p_txq, net::sockbuf *data, uint64_t timeout_ms);
+
+    /**
+     * Send command over the control queue and wait for the device to acknowledge it.
+     * @retval E_NOIMPL Control queue is not negotiated.
+     * @retval E_INVAL Device rejected the command.
+     */
+    kerror_t send_ctrl_command(uint8_t cls, uint8_t cmd, const void *p_data, size_t size);
+
+    /**
+     * Turn promiscuous mode off and limit accepted addresses to own one and broadcast.
+     */
+    kerror_t program_rx_filter();
+
+    static constexpr auto MAX_QUEUE_PAIRS = 4;
+    tx_queue tx_q_[MAX_QUEUE_PAIRS];
+    rx_queue *rx_q_[MAX_QUEUE_PAIRS];
+    size_t num_queue_pairs_; // Active queue pairs, TX queue is selected by flow hash
+    virtq *ctrl_q_;
+    bool ctrl_timed_out_; // Device stopped completing control commands
+    semaphore ctrl_poll_event_; // Control queue is polled by send_ctrl_command()
 
     static constexpr auto MAX_RX_HANDLERS = 2;
     std::tuple<net::ethertype, net::l3_handler_t, void *> rx_handlers_[MAX_RX_HANDLERS];
 
     static constexpr auto RX_QUEUE_SIZE = 16;
+    static constexpr auto RX_THREAD_STACK_SIZE = 64 * 1024;
+    static constexpr auto RX_THREAD_PRIORITY = 3;
+    static constexpr auto RX_BUDGET = 64;
+    static constexpr auto TX_IRQ_BATCH = 16;
+    static constexpr auto CTRL_TIMEOUT_MS = 1000;
+    static constexpr auto TX_DRAIN_BURST = 16;
+    static constexpr auto TX_BACKLOG_SIZE = 256;
+    static constexpr auto TX_RECLAIM_BUDGET = 64;
+    static tunable<size_t> rx_queue_size_;
+    static tunable<size_t> rx_thread_stack_size_; // In bytes
+    static tunable<int> rx_thread_priority_;
+    static tunable<size_t> rx_budget_; // Max packets processed before yielding
+    static tunable<uint16_t> tx_irq_batch_; // Max TX completions per interrupt
+    static tunable<size_t> max_queue_pairs_;
+    static tunable<bool> csum_offload_; // Negotiate VIRTIO_NET_F_CSUM and VIRTIO_NET_F_GUEST_CSUM
+    static tunable<bool> tso_; // Negotiate VIRTIO_NET_F_HOST_TSO4, software GSO is used otherwise
+    static tunable<size_t> tx_backlog_size_; // Frames queued in software while the ring is full
+    static tunable<size_t> tx_reclaim_budget_; // Max completed frames freed per transmit
+    static tunable<bool> rx_filter_; // Negotiate VIRTIO_NET_F_CTRL_RX, CTRL_MAC_ADDR and CTRL_VLAN
+    static tunable<bool> lro_; // Negotiate VIRTIO_NET_F_MRG_RXBUF and VIRTIO_NET_F_GUEST_TSO4
 
-    msgq rx_packet_queue_;
-    kthread rx_thread_;
-    size_t num_rx_buffers_; // Number of buffers sent to the RX queue
     net::mac_t addr_;
+    size_t net_hdr_size_; // Legacy header lacks num_buffers field
+    size_t tx_tso_frames_;
+    size_t tx_gso_frames_;
+    size_t tx_gso_segments_;
+    size_t rx_buffer_size_; // Rest of the page after the headroom with VIRTIO_NET_F_MRG_RXBUF
+    size_t rx_ring_size_; // Buffers kept in each RX queue, rx_queue_size_ raised to fit a coalesced segment
+    size_t rx_merged_packets_;
+    size_t rx_merge_drops_;
+    bool rx_filter_on_device_; // Destination address is checked by the device
+    size_t rx_filter_drops_;
+    net::packet_filter packet_filter_;
+    size_t num_busy_pollers_; // While non-zero, RX interrupts are off and busy pollers process the queues
+    size_t rx_busy_polls_;
+    size_t rx_busy_poll_frames_;
 
     static constexpr auto MTU = 1514;
+    static constexpr auto RX_PAGE_SIZE = 4096;
+    static constexpr auto RX_HEADROOM = 256;
+    static constexpr auto RX_POOL_FACTOR = 2;
+
+    friend void kbench::bench_virtq_send_buffer(kbench::state &s);
+    friend void kbench::bench_virtq_tx_completion(kbench::state &s);
+    friend void kbench::bench_virtq_send_burst(kbench::state &s);
 };
 
 } // namespace otrix::dev
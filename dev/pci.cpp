@@ -7,6 +7,7 @@
 
 #include "arch/lapic.hpp"
 #include "arch/irq_manager.hpp"
+#include "arch/paging.hpp"
 
 #define PCI_CFG_ADDR 0xCF8
 #define PCI_CFG_DATA 0xCFC
@@ -55,6 +56,14 @@
 
 #define PCI_REG_STATUS_CAPLIST (1 << 4)
 
+#define PCI_BAR_IO_SPACE   (1 << 0)
+#define PCI_BAR_TYPE(reg)  (((reg) >> 1) & 0x03)
+#define PCI_BAR_TYPE_64BIT 0x02
+#define PCI_BAR_MEM_MASK   0xFFFFFFF0
+
+#define PCI_COMMAND_MEMORY_SPACE (1 << 1)
+#define PCI_COMMAND_BUS_MASTER   (1 << 2)
+
 #define PCI_CAP_ID_NULL   0x00
 #define PCI_CAP_ID_MSIX   0x11
 #define PCI_CAP_ID_VENDOR 0x09
@@ -154,13 +163,14 @@ static inline void pci_config_write8(const uint8_t bus, const uint8_t dev,
 pci_dev::pci_dev(uint8_t bus, uint8_t dev, uint8_t function,
         uint16_t device_id, uint16_t vendor_id):
     bus_(bus), dev_(dev), function_(function),
-    device_id_(device_id), vendor_id_(vendor_id),
+    device_id_(device_id), vendor_id_(vendor_id), capabilities_(), io_bars_(0),
     msix_table_(nullptr), msix_table_size_(0) {
     for (int i = 0; i < NUM_BARS; i++) {
         bar_[i] = cfg_read32(PCI_REG_BAR0 + i * 4);
-        if (bar_[i] & 1) {
+        if (bar_[i] & PCI_BAR_IO_SPACE) {
             // IO space
             bar_[i] &= 0xFFFC;
+            io_bars_ |= 1 << i;
         }
     }
 
@@ -198,6 +208,35 @@ uint8_t pci_dev::get_cap(uint8_t cap_id) const {
     return 0;
 }
 
+uint8_t pci_dev::find_cap(uint8_t cap_id, uint8_t prev) const {
+    int i = 0;
+    if (0 != prev) {
+        while (i < MAX_CAPABILITIES && capabilities_[i].second != prev) {
+            i++;
+        }
+        i++;
+    }
+    for (; i < MAX_CAPABILITIES; i++) {
+        if (capabilities_[i].first == cap_id) {
+            return capabilities_[i].second;
+        }
+    }
+    return 0;
+}
+
+uint64_t pci_dev::bar_address(unsigned int num) const {
+    if (num >= NUM_BARS) {
+        return 0;
+    }
+    if (bar_is_io(num)) {
+        return bar_[num];
+    }
+    uint64_t addr = bar_[num] & PCI_BAR_MEM_MASK;
+    if (PCI_BAR_TYPE(bar_[num]) == PCI_BAR_TYPE_64BIT && num + 1 < NUM_BARS) {
+        addr |= (uint64_t)bar_[num + 1] << 32;
+    }
+    return addr;
+}
 
 kerror_t pci_dev::find_devices(pci_dev::descriptor_t *p_targets, size_t num_targets)
 {
@@ -257,9 +296,20 @@ void pci_dev::cfg_write32(uint8_t reg, uint32_t value) {
 kerror_t pci_dev::enable_bus_mastering(bool enable) {
     uint32_t command_status = cfg_read32(PCI_REG_STATUS_COMMAND);
     if (enable) {
-        command_status |= (1 << 2);
+        command_status |= PCI_COMMAND_BUS_MASTER;
     } else {
-        command_status &= ~(1 << 2);
+        command_status &= ~PCI_COMMAND_BUS_MASTER;
+    }
+    cfg_write32(PCI_REG_STATUS_COMMAND, command_status);
+    return E_OK;
+}
+
+kerror_t pci_dev::enable_memory_space(bool enable) {
+    uint32_t command_status = cfg_read32(PCI_REG_STATUS_COMMAND);
+    if (enable) {
+        command_status |= PCI_COMMAND_MEMORY_SPACE;
+    } else {
+        command_status &= ~PCI_COMMAND_MEMORY_SPACE;
     }
     cfg_write32(PCI_REG_STATUS_COMMAND, command_status);
     return E_OK;
@@ -287,10 +337,14 @@ kerror_t pci_dev::enable_msix(bool enable) {
     cfg_write32(PCI_REG_STATUS_COMMAND, command_status | (1 << 10));
 
     const uint32_t table_addr = cfg_read32(msix_cap + 0x04);
-    const uint32_t base_addr = bar(table_addr & 0x7) & ~0xf;
-    msix_table_ = reinterpret_cast<msix_entry_t *>(base_addr + (table_addr & ~0x7));
-
+    const uint64_t base_addr = bar_address(table_addr & 0x7);
     msix_table_size_ = ((message_control >> 16) & 0x3FF) + 1;
+    msix_table_ = reinterpret_cast<msix_entry_t *>(arch::map_mmio(base_addr + (table_addr & ~0x7),
+                msix_table_size_ * sizeof(msix_entry_t)));
+    if (nullptr == msix_table_) {
+        msix_table_size_ = 0;
+        return E_NODEV;
+    }
 
     for (int i = 0; i < msix_table_size_; i++) {
         msix_table_[i].message_address_low = 0;
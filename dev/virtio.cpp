@@ -5,15 +5,48 @@
 
 #include "arch/irq_manager.hpp"
 #include "arch/asm.h"
+#include "arch/paging.hpp"
 #include "otrix/immediate_console.hpp"
 #include "kernel/alloc.hpp"
+#include "kernel/semaphore.hpp"
 
 #define VIRTIO_PCI_VENDOR_ID 0x1af4
 
+#define PCI_CAP_ID_VENDOR 0x09
+
+// Layout of virtio_pci_cap
+#define VIRTIO_PCI_CAP_CFG_TYPE 3
+#define VIRTIO_PCI_CAP_BAR 4
+#define VIRTIO_PCI_CAP_OFFSET 8
+#define VIRTIO_PCI_CAP_LENGTH 12
+#define VIRTIO_PCI_NOTIFY_CAP_MULT 16
+
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_F_INDIRECT_DESC 28
 #define VIRTIO_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+#define VIRTIO_F_RING_PACKED 34
+#define VIRTIO_F_IN_ORDER 35
+
+// Reserved transport feature bits above 31, they are negotiated by virtio_dev itself
+#define VIRTIO_TRANSPORT_FEATURES_HIGH (((1ull << 41) - 1) & ~((1ull << 32) - 1))
 
+#define VIRTQ_DESC_F_NEXT 1
 #define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED (1 << 15)
 #define VIRTQ_USED_F_NO_NOTIFY 1
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+#define VIRTQ_PACKED_EVENT_FLAG_ENABLE 0
+#define VIRTQ_PACKED_EVENT_FLAG_DISABLE 1
+#define VIRTQ_PACKED_EVENT_FLAG_DESC 2
+#define VIRTQ_PACKED_EVENT_WRAP_SHIFT 15
 
 namespace otrix::dev
 {
@@ -28,9 +61,39 @@ enum virtio_device_status
     needs_reset = 64,
 };
 
+struct virtio_pci_common_cfg
+{
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    // 64-bit fields are written as two halves, the device isn't required to support 64-bit access
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+} __attribute__((packed));
+
 using otrix::immediate_console;
 
-virtio_dev::virtio_dev(pci_dev *p_dev): pci_dev_(p_dev)
+tunable<bool> virtio_dev::force_legacy_("virtio.force_legacy", false);
+tunable<bool> virtio_dev::packed_("virtio.packed", true);
+tunable<size_t> virtio_dev::indirect_min_segments_("virtio.indirect_min_segments", 4, 2, 256);
+
+virtio_dev::virtio_dev(pci_dev *p_dev): pci_dev_(p_dev), valid_(false), features_(0),
+                                        common_cfg_(nullptr), isr_(nullptr), device_cfg_(nullptr),
+                                        notify_base_(nullptr), notify_off_multiplier_(0)
 {}
 
 void virtio_dev::begin_init()
@@ -46,13 +109,123 @@ void virtio_dev::begin_init()
         return;
     }
 
+    if (force_legacy_ || !init_modern_transport()) {
+        if (!pci_dev_->bar_is_io(0)) {
+            immediate_console::print("Virtio device %04x has no legacy interface\n", pci_dev_->device_id());
+            return;
+        }
+    }
+
     valid_ = true;
 
     write_reg(device_status, 0);
     write_reg(device_status, virtio_device_status::acknowledge | virtio_device_status::driver);
 
-    features_ = negotiate_features(read_reg(device_features));
-    write_reg(driver_features, features_);
+    const uint64_t offered_features = read_device_features();
+    features_ = negotiate_features(offered_features) & offered_features & ~VIRTIO_TRANSPORT_FEATURES_HIGH;
+    if (modern()) {
+        // Modern interface is defined only for VERSION_1 devices
+        features_ |= 1ull << VIRTIO_F_VERSION_1;
+        // In-order completion is handled only for the packed ring
+        const uint64_t packed_features = (1ull << VIRTIO_F_RING_PACKED) | (1ull << VIRTIO_F_IN_ORDER);
+        if (packed_ && (offered_features & (1ull << VIRTIO_F_RING_PACKED))) {
+            features_ |= offered_features & packed_features;
+        }
+    }
+    write_driver_features(features_);
+
+    if (modern()) {
+        write_reg(device_status, read_reg(device_status) | virtio_device_status::features_ok);
+        if (0 == (read_reg(device_status) & virtio_device_status::features_ok)) {
+            immediate_console::print("Virtio device rejected features %016lx\n", features_);
+            write_reg(device_status, read_reg(device_status) | virtio_device_status::failed);
+            valid_ = false;
+        }
+    }
+}
+
+bool virtio_dev::init_modern_transport()
+{
+    volatile void *common_cfg = nullptr;
+    volatile void *isr = nullptr;
+    volatile void *device_cfg = nullptr;
+    volatile void *notify_base = nullptr;
+    uint32_t notify_off_multiplier = 0;
+
+    // Use the first usable capability of each type
+    uint8_t cap = 0;
+    while (0 != (cap = pci_dev_->find_cap(PCI_CAP_ID_VENDOR, cap))) {
+        const uint8_t cfg_type = pci_dev_->cfg_read8(cap + VIRTIO_PCI_CAP_CFG_TYPE);
+        const uint8_t bar = pci_dev_->cfg_read8(cap + VIRTIO_PCI_CAP_BAR);
+        const uint32_t offset = pci_dev_->cfg_read32(cap + VIRTIO_PCI_CAP_OFFSET);
+        const uint32_t length = pci_dev_->cfg_read32(cap + VIRTIO_PCI_CAP_LENGTH);
+        if (bar >= 6 || pci_dev_->bar_is_io(bar) || 0 == pci_dev_->bar_address(bar)) {
+            continue;
+        }
+
+        volatile void **p_target = nullptr;
+        switch (cfg_type) {
+        case VIRTIO_PCI_CAP_COMMON_CFG:
+            if (length >= sizeof(virtio_pci_common_cfg)) {
+                p_target = &common_cfg;
+            }
+            break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG:
+            p_target = &notify_base;
+            break;
+        case VIRTIO_PCI_CAP_ISR_CFG:
+            p_target = &isr;
+            break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG:
+            p_target = &device_cfg;
+            break;
+        default:
+            break;
+        }
+        if (nullptr == p_target || nullptr != *p_target) {
+            continue;
+        }
+        *p_target = arch::map_mmio(pci_dev_->bar_address(bar) + offset, length);
+        if (&notify_base == p_target) {
+            notify_off_multiplier = pci_dev_->cfg_read32(cap + VIRTIO_PCI_NOTIFY_CAP_MULT);
+        }
+    }
+
+    if (nullptr == common_cfg || nullptr == isr || nullptr == notify_base) {
+        return false;
+    }
+
+    pci_dev_->enable_memory_space(true);
+    common_cfg_ = reinterpret_cast<volatile virtio_pci_common_cfg *>(common_cfg);
+    isr_ = reinterpret_cast<volatile uint8_t *>(isr);
+    device_cfg_ = reinterpret_cast<volatile uint8_t *>(device_cfg);
+    notify_base_ = reinterpret_cast<volatile uint8_t *>(notify_base);
+    notify_off_multiplier_ = notify_off_multiplier;
+    return true;
+}
+
+uint64_t virtio_dev::read_device_features()
+{
+    if (!modern()) {
+        return read_reg(device_features);
+    }
+    common_cfg_->device_feature_select = 0;
+    const uint32_t low = common_cfg_->device_feature;
+    common_cfg_->device_feature_select = 1;
+    const uint32_t high = common_cfg_->device_feature;
+    return low | (uint64_t)high << 32;
+}
+
+void virtio_dev::write_driver_features(uint64_t features)
+{
+    if (!modern()) {
+        write_reg(driver_features, features);
+        return;
+    }
+    common_cfg_->driver_feature_select = 0;
+    common_cfg_->driver_feature = features;
+    common_cfg_->driver_feature_select = 1;
+    common_cfg_->driver_feature = features >> 32;
 }
 
 virtio_dev::~virtio_dev()
@@ -61,7 +234,8 @@ virtio_dev::~virtio_dev()
 
 void virtio_dev::print_info()
 {
-    immediate_console::print("Device status %02x, features %08x\n", read_reg(device_status), features_);
+    immediate_console::print("Device status %02x, features %016lx, %s transport\n", read_reg(device_status),
+            features_, modern() ? "modern" : "legacy");
     int queue_idx = 0;
     uint16_t q_size = 0;
     immediate_console::print("VQs: ");
@@ -82,6 +256,32 @@ void virtio_dev::print_info()
 
 uint32_t virtio_dev::read_reg(uint16_t reg)
 {
+    if (modern()) {
+        switch (reg) {
+        case device_features:
+            common_cfg_->device_feature_select = 0;
+            return common_cfg_->device_feature;
+        case driver_features:
+            common_cfg_->driver_feature_select = 0;
+            return common_cfg_->driver_feature;
+        case queue_size:
+            return common_cfg_->queue_size;
+        case queue_select:
+            return common_cfg_->queue_select;
+        case device_status:
+            return common_cfg_->device_status;
+        case isr_status:
+            return *isr_;
+        case config_msix_vector:
+            return common_cfg_->msix_config;
+        case queue_msix_vector:
+            return common_cfg_->queue_msix_vector;
+        default:
+            // Queue address and notification have no readable modern equivalent
+            return 0;
+        }
+    }
+
     switch (reg) {
     case device_features:
     case driver_features:
@@ -104,6 +304,41 @@ uint32_t virtio_dev::read_reg(uint16_t reg)
 
 void virtio_dev::write_reg(uint16_t reg, uint32_t value)
 {
+    if (modern()) {
+        switch (reg) {
+        case device_features:
+            break;
+        case driver_features:
+            common_cfg_->driver_feature_select = 0;
+            common_cfg_->driver_feature = value;
+            break;
+        case queue_size:
+            common_cfg_->queue_size = value;
+            break;
+        case queue_select:
+            common_cfg_->queue_select = value;
+            break;
+        case queue_notify:
+            common_cfg_->queue_select = value;
+            *reinterpret_cast<volatile uint16_t *>(notify_base_ +
+                    common_cfg_->queue_notify_off * notify_off_multiplier_) = value;
+            break;
+        case device_status:
+            common_cfg_->device_status = value;
+            break;
+        case config_msix_vector:
+            common_cfg_->msix_config = value;
+            break;
+        case queue_msix_vector:
+            common_cfg_->queue_msix_vector = value;
+            break;
+        default:
+            // Queues are configured with separate ring addresses in virtq_create()
+            break;
+        }
+        return;
+    }
+
     switch (reg) {
     case device_features:
     case driver_features:
@@ -126,21 +361,91 @@ void virtio_dev::write_reg(uint16_t reg, uint32_t value)
     }
 }
 
+uint8_t virtio_dev::config_read8(uint16_t offset)
+{
+    if (modern()) {
+        return nullptr != device_cfg_ ? device_cfg_[offset] : 0;
+    }
+    return arch_io_read8(pci_dev_->bar(0) + device_config + offset);
+}
+
+uint16_t virtio_dev::config_read16(uint16_t offset)
+{
+    if (modern()) {
+        return nullptr != device_cfg_ ? *reinterpret_cast<volatile uint16_t *>(device_cfg_ + offset) : 0;
+    }
+    return arch_io_read16(pci_dev_->bar(0) + device_config + offset);
+}
+
+uint32_t virtio_dev::config_read32(uint16_t offset)
+{
+    if (modern()) {
+        return nullptr != device_cfg_ ? *reinterpret_cast<volatile uint32_t *>(device_cfg_ + offset) : 0;
+    }
+    return arch_io_read32(pci_dev_->bar(0) + device_config + offset);
+}
+
+void virtio_dev::config_write8(uint16_t offset, uint8_t value)
+{
+    if (modern()) {
+        if (nullptr != device_cfg_) {
+            device_cfg_[offset] = value;
+        }
+        return;
+    }
+    arch_io_write8(pci_dev_->bar(0) + device_config + offset, value);
+}
+
+void virtio_dev::config_write16(uint16_t offset, uint16_t value)
+{
+    if (modern()) {
+        if (nullptr != device_cfg_) {
+            *reinterpret_cast<volatile uint16_t *>(device_cfg_ + offset) = value;
+        }
+        return;
+    }
+    arch_io_write16(pci_dev_->bar(0) + device_config + offset, value);
+}
+
+void virtio_dev::config_write32(uint16_t offset, uint32_t value)
+{
+    if (modern()) {
+        if (nullptr != device_cfg_) {
+            *reinterpret_cast<volatile uint32_t *>(device_cfg_ + offset) = value;
+        }
+        return;
+    }
+    arch_io_write32(pci_dev_->bar(0) + device_config + offset, value);
+}
+
 kerror_t virtio_dev::virtq_create(uint16_t index, virtq **p_out_virtq, vq_irq_handler_t p_handler, void *p_handler_context)
 {
     write_reg(queue_select, index);
     const uint16_t queue_len = read_reg(queue_size);
-
-    const size_t descriptor_table_size = sizeof(virtio_descriptor) * queue_len;
-    const size_t available_ring_size = sizeof(virtio_ring_hdr) + sizeof(uint16_t) * queue_len;
-    const size_t used_ring_size = sizeof(virtio_ring_hdr) + sizeof(virtio_used_elem) * queue_len;
+    if (0 == queue_len) {
+        return E_NODEV;
+    }
 
     auto vq_align = [] (auto in) {
         return (in + 4095) & ~4095;
     };
 
-    const size_t virtq_size = vq_align(descriptor_table_size + available_ring_size) + vq_align(used_ring_size) +
-                              sizeof(void *) * queue_len;
+    const bool packed = 0 != (features_ & (1ull << VIRTIO_F_RING_PACKED));
+
+    size_t virtq_size;
+    // Split ring
+    // Both rings are followed by event index fields (used_event and avail_event)
+    const size_t descriptor_table_size = sizeof(virtio_descriptor) * queue_len;
+    const size_t available_ring_size = sizeof(virtio_ring_hdr) + sizeof(uint16_t) * queue_len + sizeof(uint16_t);
+    const size_t used_ring_size = sizeof(virtio_ring_hdr) + sizeof(virtio_used_elem) * queue_len + sizeof(uint16_t);
+    // Packed ring, descriptors are followed by driver and device event suppression structures
+    const size_t packed_ring_size = sizeof(virtio_packed_descriptor) * queue_len + 2 * sizeof(virtio_packed_event);
+    if (packed) {
+        virtq_size = vq_align(packed_ring_size) + sizeof(void *) * queue_len + sizeof(virtq_packed_buf) * queue_len;
+    } else {
+        virtq_size = vq_align(descriptor_table_size + available_ring_size) + vq_align(used_ring_size) +
+                     sizeof(void *) * queue_len;
+    }
 
     virtq *p_vq = (virtq *)otrix::alloc(sizeof(virtq));
     if (nullptr == p_vq) {
@@ -152,6 +457,11 @@ kerror_t virtio_dev::virtq_create(uint16_t index, virtq **p_out_virtq, vq_irq_ha
     p_vq->size = queue_len;
     p_vq->irq_handler = p_handler;
     p_vq->irq_handler_ctx = p_handler_context;
+    p_vq->event_idx = 0 != (features_ & (1ull << VIRTIO_F_EVENT_IDX));
+    p_vq->indirect = 0 != (features_ & (1ull << VIRTIO_F_INDIRECT_DESC));
+    p_vq->irq_batch = 1;
+    p_vq->packed = packed;
+    p_vq->in_order = packed && 0 != (features_ & (1ull << VIRTIO_F_IN_ORDER));
     // 4095 to adjust the descriptor pointer to be 4kb aligned
     // TODO: Instead of relying on root heap allocator implement page allocator
     const size_t alloc_size = virtq_size + 4095;
@@ -162,23 +472,67 @@ kerror_t virtio_dev::virtq_create(uint16_t index, virtq **p_out_virtq, vq_irq_ha
     }
     memset(p_vq->allocated_mem, 0, alloc_size);
 
-    p_vq->desc_table =
-        reinterpret_cast<virtio_descriptor *>(vq_align((uintptr_t)p_vq->allocated_mem));
-    p_vq->avail_ring_hdr = (virtio_ring_hdr *)((uint8_t *)p_vq->desc_table + descriptor_table_size);
-    p_vq->avail_ring = (uint16_t *)((uint8_t *)p_vq->avail_ring_hdr + sizeof(virtio_ring_hdr));
-    p_vq->used_ring_hdr = (virtio_ring_hdr *)((uint8_t *)p_vq->desc_table +
-                vq_align(descriptor_table_size + available_ring_size));
-    p_vq->used_ring =
-        (virtio_used_elem *)((uint8_t *)p_vq->used_ring_hdr + sizeof(virtio_ring_hdr));
-    p_vq->desc_ctx = (void **)((uint8_t *)p_vq->used_ring_hdr + vq_align(used_ring_size));
+    // Addresses of descriptor, driver and device areas
+    volatile void *driver_area;
+    volatile void *device_area;
+    volatile void *desc_area;
+    if (packed) {
+        p_vq->packed_ring =
+            reinterpret_cast<virtio_packed_descriptor *>(vq_align((uintptr_t)p_vq->allocated_mem));
+        p_vq->driver_event = (virtio_packed_event *)&p_vq->packed_ring[queue_len];
+        p_vq->device_event = p_vq->driver_event + 1;
+        p_vq->desc_ctx = (void **)((uint8_t *)p_vq->packed_ring + vq_align(packed_ring_size));
+        p_vq->packed_bufs = (virtq_packed_buf *)(p_vq->desc_ctx + queue_len);
+
+        for (int i = 0; i < p_vq->size - 1; i++) {
+            p_vq->packed_bufs[i].next = i + 1;
+        }
+        p_vq->avail_wrap = true;
+        p_vq->used_wrap = true;
+        // Without EVENT_IDX the device interrupts on every used buffer
+        p_vq->driver_event->off_wrap = 1 << VIRTQ_PACKED_EVENT_WRAP_SHIFT;
+        p_vq->driver_event->flags = p_vq->event_idx ? VIRTQ_PACKED_EVENT_FLAG_DESC : VIRTQ_PACKED_EVENT_FLAG_ENABLE;
+
+        desc_area = p_vq->packed_ring;
+        driver_area = p_vq->driver_event;
+        device_area = p_vq->device_event;
+    } else {
+        p_vq->desc_table =
+            reinterpret_cast<virtio_descriptor *>(vq_align((uintptr_t)p_vq->allocated_mem));
+        p_vq->avail_ring_hdr = (virtio_ring_hdr *)((uint8_t *)p_vq->desc_table + descriptor_table_size);
+        p_vq->avail_ring = (uint16_t *)((uint8_t *)p_vq->avail_ring_hdr + sizeof(virtio_ring_hdr));
+        p_vq->used_ring_hdr = (virtio_ring_hdr *)((uint8_t *)p_vq->desc_table +
+                    vq_align(descriptor_table_size + available_ring_size));
+        p_vq->used_ring =
+            (virtio_used_elem *)((uint8_t *)p_vq->used_ring_hdr + sizeof(virtio_ring_hdr));
+        p_vq->desc_ctx = (void **)((uint8_t *)p_vq->used_ring_hdr + vq_align(used_ring_size));
+        p_vq->used_event = &p_vq->avail_ring[queue_len];
+        p_vq->avail_event = (volatile uint16_t *)&p_vq->used_ring[queue_len];
 
-    for (int i = 0; i < p_vq->size - 1; i++) {
-        p_vq->desc_table[i].next = i + 1;
+        for (int i = 0; i < p_vq->size - 1; i++) {
+            p_vq->desc_table[i].next = i + 1;
+        }
+        p_vq->desc_table[p_vq->size - 1].next = -1;
+
+        desc_area = p_vq->desc_table;
+        driver_area = p_vq->avail_ring_hdr;
+        device_area = p_vq->used_ring_hdr;
     }
-    p_vq->desc_table[p_vq->size - 1].next = -1;
     p_vq->num_free_descriptors = p_vq->size;
 
-    write_reg(queue_address, (uintptr_t)p_vq->desc_table >> 12);
+    // Rings are in normal write-back memory, memory is identity-mapped so addresses are physical
+    if (modern()) {
+        common_cfg_->queue_desc_lo = (uintptr_t)desc_area;
+        common_cfg_->queue_desc_hi = (uint64_t)(uintptr_t)desc_area >> 32;
+        common_cfg_->queue_driver_lo = (uintptr_t)driver_area;
+        common_cfg_->queue_driver_hi = (uint64_t)(uintptr_t)driver_area >> 32;
+        common_cfg_->queue_device_lo = (uintptr_t)device_area;
+        common_cfg_->queue_device_hi = (uint64_t)(uintptr_t)device_area >> 32;
+        p_vq->notify_addr = reinterpret_cast<volatile uint16_t *>(notify_base_ +
+                common_cfg_->queue_notify_off * notify_off_multiplier_);
+    } else {
+        write_reg(queue_address, (uintptr_t)desc_area >> 12);
+    }
 
     *p_out_virtq = p_vq;
 
@@ -187,8 +541,12 @@ kerror_t virtio_dev::virtq_create(uint16_t index, virtq **p_out_virtq, vq_irq_ha
         write_reg(queue_msix_vector, msix_vector);
     }
 
-    immediate_console::print("Created VQ%d @ %p, msix %04x\n", p_vq->index, p_vq->desc_table,
-            read_reg(queue_msix_vector));
+    if (modern()) {
+        common_cfg_->queue_enable = 1;
+    }
+
+    immediate_console::print("Created %s VQ%d @ %p, msix %04x\n", packed ? "packed" : "split",
+            p_vq->index, desc_area, read_reg(queue_msix_vector));
 
     return E_OK;
 }
@@ -199,8 +557,11 @@ kerror_t virtio_dev::virtq_destroy(virtq *p_vq)
         return E_INVAL;
     }
 
-    write_reg(queue_select, p_vq->index);
-    write_reg(queue_address, 0);
+    // Modern devices release queues only on reset
+    if (!modern()) {
+        write_reg(queue_select, p_vq->index);
+        write_reg(queue_address, 0);
+    }
 
     otrix::free(p_vq->allocated_mem);
     otrix::free(p_vq);
@@ -211,46 +572,319 @@ kerror_t virtio_dev::virtq_destroy(virtq *p_vq)
 kerror_t virtio_dev::virtq_send_buffer(virtq *p_vq, void *p_buffer, uint32_t buffer_size,
         bool device_writable, void *buf_ctx)
 {
-    if (nullptr == p_vq || nullptr == p_buffer || 0 == buffer_size) {
+    const virtq_iovec iov = { p_buffer, buffer_size };
+    return virtq_send_chain(p_vq, &iov, device_writable ? 0 : 1, device_writable ? 1 : 0, buf_ctx);
+}
+
+bool virtio_dev::virtq_use_indirect(const virtq *p_vq, size_t num_segments, size_t num_available) const
+{
+    if (!p_vq->indirect || num_segments < 2) {
+        return false;
+    }
+    return num_segments >= indirect_min_segments_ || num_segments > num_available;
+}
+
+kerror_t virtio_dev::virtq_send_chain(virtq *p_vq, const virtq_iovec *p_iov, size_t num_readable,
+        size_t num_writable, void *buf_ctx)
+{
+    if (nullptr == p_vq) {
         return E_INVAL;
     }
+    virtq_batch batch;
+    virtq_batch_begin(p_vq, &batch, num_readable + num_writable);
+    const kerror_t ret = virtq_batch_add(&batch, p_iov, num_readable, num_writable, buf_ctx);
+    virtq_batch_publish(&batch);
+    return ret;
+}
+
+size_t virtio_dev::virtq_batch_begin(virtq *p_vq, virtq_batch *p_batch, size_t num_descriptors)
+{
+    p_batch->vq = p_vq;
+    p_batch->irq_flags = arch_irq_save();
+    p_batch->num_reserved = std::min<size_t>(num_descriptors, p_vq->num_free_descriptors);
+    p_batch->num_buffers = 0;
+    p_batch->num_descriptors = 0;
+    p_batch->head_pos = 0;
+    p_batch->head_flags = 0;
+    p_vq->num_free_descriptors -= p_batch->num_reserved;
+    return p_batch->num_reserved;
+}
 
-    if (p_vq->free_list == -1 || 0 == p_vq->num_free_descriptors) {
+kerror_t virtio_dev::virtq_batch_add(virtq_batch *p_batch, const virtq_iovec *p_iov, size_t num_readable,
+        size_t num_writable, void *buf_ctx)
+{
+    virtq *p_vq = p_batch->vq;
+    const size_t num_segments = num_readable + num_writable;
+    if (nullptr == p_iov || 0 == num_segments) {
+        return E_INVAL;
+    }
+    for (size_t i = 0; i < num_segments; i++) {
+        if (nullptr == p_iov[i].addr || 0 == p_iov[i].len) {
+            return E_INVAL;
+        }
+    }
+
+    if (p_vq->packed) {
+        return virtq_batch_add_packed(p_batch, p_iov, num_readable, num_writable, buf_ctx);
+    }
+
+    // Long chains are put into a separate table which takes a single ring descriptor
+    virtio_descriptor *p_table = nullptr;
+    if (virtq_use_indirect(p_vq, num_segments, p_batch->num_reserved)) {
+        p_table = (virtio_descriptor *)otrix::alloc(sizeof(virtio_descriptor) * num_segments);
+        if (nullptr == p_table) {
+            return E_NOMEM;
+        }
+        for (size_t i = 0; i < num_segments; i++) {
+            p_table[i].addr = (uint64_t)p_iov[i].addr;
+            p_table[i].len = p_iov[i].len;
+            p_table[i].flags = (i >= num_readable ? VIRTQ_DESC_F_WRITE : 0) |
+                (i + 1 < num_segments ? VIRTQ_DESC_F_NEXT : 0);
+            p_table[i].next = i + 1;
+        }
+    } else if (num_segments > p_vq->size) {
+        return E_INVAL;
+    }
+    const size_t num_descriptors = nullptr != p_table ? 1 : num_segments;
+    if (num_descriptors > p_batch->num_reserved) {
+        otrix::free(p_table);
         return E_NOMEM;
     }
 
-    auto flags = arch_irq_save();
-    const int idx = p_vq->free_list;
-    p_vq->free_list = p_vq->desc_table[idx].next;
-    arch_irq_restore(flags);
+    // Free descriptors are linked through the next field,
+    // so descriptors taken from the head of the list are already chained
+    const int head = p_vq->free_list;
+    int idx = head;
+    if (nullptr != p_table) {
+        volatile virtio_descriptor *p_desc = &p_vq->desc_table[idx];
+        p_desc->addr = (uint64_t)p_table;
+        p_desc->len = sizeof(virtio_descriptor) * num_segments;
+        p_desc->flags = VIRTQ_DESC_F_INDIRECT;
+        idx = p_desc->next;
+    } else {
+        for (size_t i = 0; i < num_segments; i++) {
+            volatile virtio_descriptor *p_desc = &p_vq->desc_table[idx];
+            p_desc->addr = (uint64_t)p_iov[i].addr;
+            p_desc->len = p_iov[i].len;
+            p_desc->flags = (i >= num_readable ? VIRTQ_DESC_F_WRITE : 0) |
+                (i + 1 < num_segments ? VIRTQ_DESC_F_NEXT : 0);
+            idx = p_desc->next;
+        }
+    }
+    p_vq->free_list = idx;
+    p_vq->desc_ctx[head] = buf_ctx;
+
+    // Entry stays invisible to the device until the index is updated on publish
+    const uint16_t avail_slot = p_vq->avail_ring_hdr->idx + p_batch->num_buffers;
+    p_vq->avail_ring[avail_slot % p_vq->size] = head;
 
-    p_vq->desc_ctx[idx] = buf_ctx;
-    p_vq->num_free_descriptors--;
-    volatile virtio_descriptor *p_desc = &p_vq->desc_table[idx];
-    p_desc->addr = (uint64_t)p_buffer;
-    p_desc->len = buffer_size;
-    p_desc->flags = device_writable ? VIRTQ_DESC_F_WRITE : 0;
-    p_desc->next = 0;
+    p_batch->num_reserved -= num_descriptors;
+    p_batch->num_descriptors += num_descriptors;
+    p_batch->num_buffers++;
+    return E_OK;
+}
 
-    flags = arch_irq_save();
-    p_vq->avail_ring[p_vq->avail_ring_hdr->idx % p_vq->size] = idx;
-    const int avail_index = p_vq->avail_ring_hdr->idx + 1;
+void virtio_dev::virtq_batch_publish(virtq_batch *p_batch)
+{
+    virtq *p_vq = p_batch->vq;
+    // Return descriptors which were reserved but not used
+    p_vq->num_free_descriptors += p_batch->num_reserved;
+    p_batch->num_reserved = 0;
+    if (0 == p_batch->num_buffers) {
+        arch_irq_restore(p_batch->irq_flags);
+        return;
+    }
 
-    // Memory barrier to make sure all changes are visible to the device when index is updated
+    // Memory barrier to make sure all descriptors of the batch are visible to the device
+    // before the index (split) or the flags of the first descriptor (packed) are updated
     __sync_synchronize();
-    p_vq->avail_ring_hdr->idx = avail_index;
-    arch_irq_restore(flags);
+    uint16_t old_idx;
+    uint16_t new_idx;
+    bool wrap = false;
+    if (p_vq->packed) {
+        p_vq->packed_ring[p_batch->head_pos].flags = p_batch->head_flags;
+        p_vq->avail_count += p_batch->num_descriptors;
+        const uint16_t num_added = p_vq->avail_count - p_vq->kicked_avail_idx;
+        p_vq->kicked_avail_idx = p_vq->avail_count;
+        new_idx = p_vq->next_avail;
+        old_idx = new_idx - num_added;
+        wrap = p_vq->avail_wrap;
+    } else {
+        new_idx = p_vq->avail_ring_hdr->idx + p_batch->num_buffers;
+        p_vq->avail_ring_hdr->idx = new_idx;
+        p_vq->num_in_flight += p_batch->num_buffers;
+        old_idx = p_vq->kicked_avail_idx;
+        p_vq->kicked_avail_idx = new_idx;
+    }
+    p_vq->stats.buffers += p_batch->num_buffers;
+    p_vq->stats.publishes++;
+    arch_irq_restore(p_batch->irq_flags);
 
-    if (!(p_vq->used_ring_hdr->flags & VIRTQ_USED_F_NO_NOTIFY)) {
-        write_reg(queue_notify, p_vq->index);
+    const bool need_notify = p_vq->packed ? virtq_need_notify_packed(p_vq, old_idx, new_idx, wrap) :
+                                            virtq_need_notify(p_vq, old_idx, new_idx);
+    if (need_notify) {
+        virtq_notify(p_vq);
     }
+}
+
+/**
+ * Check if event index lies within (old_idx, new_idx], i.e. whether the other side
+ * asked to be notified about one of the entries added since the last check.
+ */
+static inline bool vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+bool virtio_dev::virtq_need_notify(virtq *p_vq, uint16_t old_idx, uint16_t new_idx)
+{
+    // Avail index must be visible before the device's suppression state is read,
+    // otherwise the device may go idle without seeing the new buffers
+    __sync_synchronize();
+    bool need_notify;
+    if (p_vq->event_idx) {
+        need_notify = vring_need_event(*p_vq->avail_event, new_idx, old_idx);
+    } else {
+        need_notify = !(p_vq->used_ring_hdr->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+    if (!need_notify) {
+        p_vq->stats.kicks_suppressed++;
+    }
+    return need_notify;
+}
 
+kerror_t virtio_dev::virtq_batch_add_packed(virtq_batch *p_batch, const virtq_iovec *p_iov, size_t num_readable,
+        size_t num_writable, void *buf_ctx)
+{
+    virtq *p_vq = p_batch->vq;
+    const size_t num_segments = num_readable + num_writable;
+    virtio_packed_descriptor *p_table = nullptr;
+    if (virtq_use_indirect(p_vq, num_segments, p_batch->num_reserved)) {
+        p_table = (virtio_packed_descriptor *)otrix::alloc(sizeof(virtio_packed_descriptor) * num_segments);
+        if (nullptr == p_table) {
+            return E_NOMEM;
+        }
+        // Descriptors of indirect table are sequential and don't use NEXT flag
+        for (size_t i = 0; i < num_segments; i++) {
+            p_table[i].addr = (uint64_t)p_iov[i].addr;
+            p_table[i].len = p_iov[i].len;
+            p_table[i].id = 0;
+            p_table[i].flags = i >= num_readable ? VIRTQ_DESC_F_WRITE : 0;
+        }
+    } else if (num_segments > p_vq->size) {
+        return E_INVAL;
+    }
+    const uint16_t num_descriptors = nullptr != p_table ? 1 : num_segments;
+    if (num_descriptors > p_batch->num_reserved) {
+        otrix::free(p_table);
+        return E_NOMEM;
+    }
+
+    const uint16_t head_pos = p_vq->next_avail;
+    uint16_t id = head_pos;
+    if (!p_vq->in_order) {
+        id = p_vq->free_id;
+        p_vq->free_id = p_vq->packed_bufs[id].next;
+    }
+    p_vq->desc_ctx[id] = buf_ctx;
+    p_vq->packed_bufs[id].addr = p_iov[0].addr;
+    p_vq->packed_bufs[id].len = p_iov[0].len;
+    p_vq->packed_bufs[id].num_descriptors = num_descriptors;
+    p_vq->packed_bufs[id].indirect = p_table;
+
+    // The device stops at the first descriptor of the batch until it is published,
+    // so flags of all other descriptors are written right away
+    for (uint16_t i = 0; i < num_descriptors; i++) {
+        volatile virtio_packed_descriptor *p_desc = &p_vq->packed_ring[p_vq->next_avail];
+        uint16_t desc_flags = p_vq->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+        if (nullptr != p_table) {
+            p_desc->addr = (uint64_t)p_table;
+            p_desc->len = sizeof(virtio_packed_descriptor) * num_segments;
+            desc_flags |= VIRTQ_DESC_F_INDIRECT;
+        } else {
+            p_desc->addr = (uint64_t)p_iov[i].addr;
+            p_desc->len = p_iov[i].len;
+            desc_flags |= (i >= num_readable ? VIRTQ_DESC_F_WRITE : 0) |
+                (i + 1 < num_descriptors ? VIRTQ_DESC_F_NEXT : 0);
+        }
+        // Buffer ID is taken from the last descriptor of the chain
+        p_desc->id = id;
+        if (0 == p_batch->num_buffers && 0 == i) {
+            p_batch->head_pos = head_pos;
+            p_batch->head_flags = desc_flags;
+        } else {
+            p_desc->flags = desc_flags;
+        }
+        if (++p_vq->next_avail == p_vq->size) {
+            p_vq->next_avail = 0;
+            p_vq->avail_wrap = !p_vq->avail_wrap;
+        }
+    }
+
+    p_batch->num_reserved -= num_descriptors;
+    p_batch->num_descriptors += num_descriptors;
+    p_batch->num_buffers++;
     return E_OK;
 }
 
-uint32_t virtio_dev::negotiate_features(uint32_t device_features)
+bool virtio_dev::virtq_need_notify_packed(virtq *p_vq, uint16_t old_pos, uint16_t new_pos, bool wrap)
+{
+    __sync_synchronize();
+    bool need_notify;
+    const uint16_t event_flags = p_vq->device_event->flags;
+    if (VIRTQ_PACKED_EVENT_FLAG_DESC != event_flags) {
+        need_notify = VIRTQ_PACKED_EVENT_FLAG_DISABLE != event_flags;
+    } else {
+        const uint16_t off_wrap = p_vq->device_event->off_wrap;
+        uint16_t event_idx = off_wrap & ~(1 << VIRTQ_PACKED_EVENT_WRAP_SHIFT);
+        // Event from the previous lap is moved below the current positions
+        if ((off_wrap >> VIRTQ_PACKED_EVENT_WRAP_SHIFT) != wrap) {
+            event_idx -= p_vq->size;
+        }
+        need_notify = vring_need_event(event_idx, new_pos, old_pos);
+    }
+    if (!need_notify) {
+        p_vq->stats.kicks_suppressed++;
+    }
+    return need_notify;
+}
+
+void virtio_dev::virtq_set_irq_batch(virtq *p_vq, uint16_t max_completions)
 {
-    return device_features & ~(1 << VIRTIO_F_EVENT_IDX);
+    p_vq->irq_batch = std::max<uint16_t>(max_completions, 1);
+}
+
+void virtio_dev::print_vq_stats(const virtq *p_vq) const
+{
+    if (nullptr == p_vq) {
+        return;
+    }
+    const virtq_stats_t &stats = p_vq->stats;
+    // Ratios are printed with two decimal places
+    const uint64_t buffers = std::max<uint64_t>(stats.buffers, 1);
+    const uint64_t kicks_x100 = stats.kicks * 100 / buffers;
+    const uint64_t irqs_x100 = stats.irqs * 100 / buffers;
+    const uint64_t batch_x100 = stats.buffers * 100 / std::max<uint64_t>(stats.publishes, 1);
+    immediate_console::print("VQ%d: buffers %lu, completions %lu, kicks %lu (suppressed %lu, %lu.%02lu per buffer), "
+            "irqs %lu (%lu.%02lu per buffer), publishes %lu (%lu.%02lu buffers each), polls %lu, event_idx %d, packed %d\n",
+            p_vq->index, stats.buffers, stats.completions, stats.kicks, stats.kicks_suppressed,
+            kicks_x100 / 100, kicks_x100 % 100, stats.irqs, irqs_x100 / 100, irqs_x100 % 100,
+            stats.publishes, batch_x100 / 100, batch_x100 % 100, stats.polls, p_vq->event_idx, p_vq->packed);
+}
+
+void virtio_dev::virtq_notify(virtq *p_vq)
+{
+    p_vq->stats.kicks++;
+    if (nullptr != p_vq->notify_addr) {
+        *p_vq->notify_addr = p_vq->index;
+    } else {
+        write_reg(queue_notify, p_vq->index);
+    }
+}
+
+uint64_t virtio_dev::negotiate_features(uint64_t device_features)
+{
+    return device_features;
 }
 
 void virtio_dev::init_finished()
@@ -258,21 +892,212 @@ void virtio_dev::init_finished()
     write_reg(device_status, read_reg(device_status) | virtio_device_status::driver_ok | virtio_device_status::features_ok);
 }
 
+void virtio_dev::virtq_set_poll_event(virtq *p_vq, semaphore *p_event)
+{
+    auto flags = arch_irq_save();
+    p_vq->poll_event = p_event;
+    arch_irq_restore(flags);
+}
+
+bool virtio_dev::virtq_poll(virtq *p_vq, size_t budget)
+{
+    p_vq->stats.polls++;
+    if (virtq_process_used(p_vq, budget) == budget) {
+        return false;
+    }
+    if (virtq_enable_irq(p_vq)) {
+        return true;
+    }
+    // Buffers were used while interrupts were being enabled
+    virtq_disable_irq(p_vq);
+    return false;
+}
+
+size_t virtio_dev::virtq_busy_poll(virtq *p_vq, size_t budget)
+{
+    p_vq->stats.polls++;
+    virtq_disable_irq(p_vq);
+    return virtq_process_used(p_vq, budget);
+}
+
+void virtio_dev::virtq_busy_poll_end(virtq *p_vq)
+{
+    if (virtq_enable_irq(p_vq)) {
+        return;
+    }
+    virtq_disable_irq(p_vq);
+    if (nullptr != p_vq->poll_event) {
+        p_vq->poll_event->give();
+    }
+}
+
 void virtio_dev::handle_vq_irq(void *ctx)
 {
     virtq *p_vq = reinterpret_cast<virtq *>(ctx);
-    while (p_vq->used_idx != p_vq->used_ring_hdr->idx) {
-        const int desc_id = p_vq->used_ring[p_vq->used_idx % p_vq->size].id;
-        volatile virtio_descriptor *p_desc = &p_vq->desc_table[desc_id];
-        if (nullptr != p_vq->irq_handler) {
-            p_vq->irq_handler(p_vq->irq_handler_ctx, p_vq->desc_ctx[desc_id],
-                    reinterpret_cast<void *>(p_desc->addr), p_desc->len);
+    p_vq->stats.irqs++;
+    if (nullptr != p_vq->poll_event) {
+        // Used buffers are processed by the poll context, which enables interrupts once the ring is empty
+        virtq_disable_irq(p_vq);
+        p_vq->poll_event->give();
+        return;
+    }
+    do {
+        virtq_process_used(p_vq, SIZE_MAX);
+    } while (!virtq_enable_irq(p_vq));
+}
+
+void virtio_dev::virtq_disable_irq(virtq *p_vq)
+{
+    // With EVENT_IDX the flag is ignored by the device, used_event is simply not moved forward,
+    // so at most one more interrupt comes
+    if (p_vq->packed) {
+        p_vq->driver_event->flags = VIRTQ_PACKED_EVENT_FLAG_DISABLE;
+    } else {
+        p_vq->avail_ring_hdr->flags = p_vq->avail_ring_hdr->flags | VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+bool virtio_dev::virtq_enable_irq(virtq *p_vq)
+{
+    // Ask for the next interrupt after irq_batch completions. The threshold never exceeds
+    // 3/4 of buffers in flight, so the interrupt comes even if no more buffers are added.
+    // Split ring used_event counts buffers, packed ring event offset counts descriptors.
+    const uint16_t in_flight = p_vq->packed ? p_vq->size - p_vq->num_free_descriptors : p_vq->num_in_flight;
+    const uint16_t threshold = std::max(std::min<uint16_t>(p_vq->irq_batch, in_flight * 3 / 4), (uint16_t)1);
+    if (p_vq->packed) {
+        if (p_vq->event_idx) {
+            uint16_t event_pos = p_vq->next_used + threshold - 1;
+            bool event_wrap = p_vq->used_wrap;
+            if (event_pos >= p_vq->size) {
+                event_pos -= p_vq->size;
+                event_wrap = !event_wrap;
+            }
+            p_vq->driver_event->off_wrap = event_pos | (event_wrap << VIRTQ_PACKED_EVENT_WRAP_SHIFT);
+        }
+        p_vq->driver_event->flags = p_vq->event_idx ? VIRTQ_PACKED_EVENT_FLAG_DESC : VIRTQ_PACKED_EVENT_FLAG_ENABLE;
+    } else {
+        if (p_vq->event_idx) {
+            *p_vq->used_event = p_vq->used_idx + threshold - 1;
+        }
+        p_vq->avail_ring_hdr->flags = p_vq->avail_ring_hdr->flags & ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+    // Used ring has to be re-read after the event is visible to catch completions in between
+    __sync_synchronize();
+    return !virtq_has_used(p_vq);
+}
+
+bool virtio_dev::virtq_has_used(virtq *p_vq)
+{
+    if (!p_vq->packed) {
+        return p_vq->used_idx != p_vq->used_ring_hdr->idx;
+    }
+    // Device marks descriptor used by setting both AVAIL and USED flags to its wrap counter
+    const uint16_t flags = p_vq->packed_ring[p_vq->next_used].flags;
+    const bool avail = 0 != (flags & VIRTQ_DESC_F_AVAIL);
+    const bool used = 0 != (flags & VIRTQ_DESC_F_USED);
+    return avail == used && used == p_vq->used_wrap;
+}
+
+size_t virtio_dev::virtq_process_used(virtq *p_vq, size_t budget)
+{
+    if (p_vq->packed) {
+        return virtq_process_used_packed(p_vq, budget);
+    }
+    size_t num_completed = 0;
+    while (num_completed < budget && virtq_has_used(p_vq)) {
+        const int head = p_vq->used_ring[p_vq->used_idx % p_vq->size].id;
+        const size_t len = p_vq->used_ring[p_vq->used_idx % p_vq->size].len;
+        volatile virtio_descriptor *p_desc = &p_vq->desc_table[head];
+        // Handler gets the first segment of the chain
+        volatile virtio_descriptor *p_first = p_desc;
+        virtio_descriptor *p_table = nullptr;
+        if (p_desc->flags & VIRTQ_DESC_F_INDIRECT) {
+            p_table = reinterpret_cast<virtio_descriptor *>(p_desc->addr);
+            p_first = p_table;
+        }
+        void *data = reinterpret_cast<void *>(p_first->addr);
+        void *data_ctx = p_vq->desc_ctx[head];
+        otrix::free(p_table);
+
+        // Descriptors are released before the handler runs, so it can reuse the buffer right away.
+        // In poll mode this runs in thread context, concurrently with submissions.
+        auto flags = arch_irq_save();
+        int last = head;
+        int num_descriptors = 1;
+        while (p_vq->desc_table[last].flags & VIRTQ_DESC_F_NEXT) {
+            last = p_vq->desc_table[last].next;
+            num_descriptors++;
         }
-        p_desc->next = p_vq->free_list;
-        p_vq->free_list = desc_id;
+        p_vq->desc_table[last].next = p_vq->free_list;
+        p_vq->free_list = head;
         p_vq->used_idx++;
-        p_vq->num_free_descriptors++;
+        p_vq->num_in_flight--;
+        p_vq->num_free_descriptors += num_descriptors;
+        p_vq->stats.completions++;
+        arch_irq_restore(flags);
+
+        if (nullptr != p_vq->irq_handler) {
+            p_vq->irq_handler(p_vq->irq_handler_ctx, data_ctx, data, len);
+        }
+        num_completed++;
+    }
+    return num_completed;
+}
+
+size_t virtio_dev::virtq_process_used_packed(virtq *p_vq, size_t budget)
+{
+    // Complete buffer and skip its descriptors in the ring
+    auto complete = [p_vq] (uint16_t id, size_t len) {
+        virtq_packed_buf &buf = p_vq->packed_bufs[id];
+        void *data = buf.addr;
+        void *data_ctx = p_vq->desc_ctx[id];
+        otrix::free(buf.indirect);
+
+        auto flags = arch_irq_save();
+        buf.indirect = nullptr;
+        const uint16_t num_descriptors = buf.num_descriptors;
+        if (!p_vq->in_order) {
+            buf.next = p_vq->free_id;
+            p_vq->free_id = id;
+        }
+        p_vq->num_free_descriptors += num_descriptors;
+        p_vq->stats.completions++;
+
+        p_vq->next_used += num_descriptors;
+        if (p_vq->next_used >= p_vq->size) {
+            p_vq->next_used -= p_vq->size;
+            p_vq->used_wrap = !p_vq->used_wrap;
+        }
+        arch_irq_restore(flags);
+
+        if (nullptr != p_vq->irq_handler) {
+            p_vq->irq_handler(p_vq->irq_handler_ctx, data_ctx, data, len);
+        }
+    };
+
+    size_t num_completed = 0;
+    while (num_completed < budget && virtq_has_used(p_vq)) {
+        const uint16_t id = p_vq->packed_ring[p_vq->next_used].id;
+        const size_t len = p_vq->packed_ring[p_vq->next_used].len;
+        if (id >= p_vq->size) {
+            break;
+        }
+        if (p_vq->in_order) {
+            // Device may write only the last used descriptor of a batch,
+            // all buffers before it are used as well. Their written length isn't reported,
+            // so they are completed with the posted one.
+            uint16_t pos;
+            do {
+                pos = p_vq->next_used;
+                complete(pos, pos == id ? len : p_vq->packed_bufs[pos].len);
+                num_completed++;
+            } while (pos != id);
+        } else {
+            complete(id, len);
+            num_completed++;
+        }
     }
+    return num_completed;
 }
 
 } // namespace otrix::dev
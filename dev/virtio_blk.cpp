@@ -1,6 +1,11 @@
 #include "dev/virtio_blk.hpp"
+
+#include <algorithm>
+
 #include "otrix/immediate_console.hpp"
 #include "arch/asm.h"
+#include "kernel/semaphore.hpp"
+#include "kernel/kbench.hpp"
 
 namespace otrix::dev
 {
@@ -17,13 +22,39 @@ enum virtio_blk_features
     VIRTIO_BLK_F_CONFIG_WCR = 11,
 };
 
+enum virtio_blk_request_type
+{
+    VIRTIO_BLK_T_IN = 0,
+    VIRTIO_BLK_T_OUT = 1,
+    VIRTIO_BLK_T_FLUSH = 4,
+};
+
+enum virtio_blk_request_status
+{
+    VIRTIO_BLK_S_OK = 0,
+    VIRTIO_BLK_S_IOERR = 1,
+    VIRTIO_BLK_S_UNSUPP = 2,
+};
+
 struct virtio_blk_req_hdr {
     uint32_t type;
     uint32_t reserved;
-    uint32_t sector;
+    uint64_t sector;
+} __attribute__((packed));
+
+// Request is submitted as a chain of header, data and status
+struct virtio_blk_request {
+    virtio_blk_req_hdr hdr;
+    volatile uint8_t status;
+    semaphore *p_done; // Shared by requests of a batch
 };
 
-virtio_blk::virtio_blk(pci_dev *p_dev): virtio_dev(p_dev)
+tunable<size_t> virtio_blk::max_request_size_("virtio_blk.max_request_size", MAX_REQUEST_SIZE, SECTOR_SIZE, 4 * 1024 * 1024);
+
+// Device used by benchmarks
+static virtio_blk *kbench_dev;
+
+virtio_blk::virtio_blk(pci_dev *p_dev): virtio_dev(p_dev), request_q_(nullptr)
 {
     begin_init();
 
@@ -34,19 +65,23 @@ virtio_blk::virtio_blk(pci_dev *p_dev): virtio_dev(p_dev)
 
     kerror_t ret = virtq_create(0, &request_q_, request_completion, this);
     if (E_OK != ret) {
-        immediate_console::print("Failed to create TX queue\n");
+        immediate_console::print("Failed to create request queue\n");
     }
     init_finished();
+    kbench_dev = this;
 }
 
 virtio_blk::~virtio_blk()
 {
+    if (this == kbench_dev) {
+        kbench_dev = nullptr;
+    }
     if (nullptr != request_q_) {
         virtq_destroy(request_q_);
     }
 }
 
-uint32_t virtio_blk::negotiate_features(uint32_t device_features)
+uint64_t virtio_blk::negotiate_features(uint64_t device_features)
 {
     device_features = virtio_dev::negotiate_features(device_features);
     const uint32_t supported_features =
@@ -56,7 +91,7 @@ uint32_t virtio_blk::negotiate_features(uint32_t device_features)
         (1 << VIRTIO_BLK_F_GEOMETRY) |
         (1 << VIRTIO_BLK_F_FLUSH);
     if ((supported_features & device_features) != supported_features) {
-        immediate_console::print("Failed to negotiate required features: %08x, %08x\n", supported_features, device_features);
+        immediate_console::print("Failed to negotiate required features: %08x, %016lx\n", supported_features, device_features);
     }
     return (device_features & 0xFF000000) | (device_features & supported_features);
 }
@@ -64,9 +99,98 @@ uint32_t virtio_blk::negotiate_features(uint32_t device_features)
 void virtio_blk::print_info()
 {
     virtio_dev::print_info();
+    immediate_console::print("Capacity: %lu bytes\n", capacity() * SECTOR_SIZE);
+    print_vq_stats(request_q_);
+}
+
+uint64_t virtio_blk::capacity()
+{
     const uint32_t cap_low = read_reg(capacity1);
     const uint32_t cap_high = read_reg(capacity2);
-    immediate_console::print("Capacity: %d bytes\n", (cap_low | (uint64_t)cap_high << 32) * 512);
+    return cap_low | (uint64_t)cap_high << 32;
+}
+
+kerror_t virtio_blk::read(uint64_t sector, void *p_buf, size_t size)
+{
+    return submit_request(VIRTIO_BLK_T_IN, sector, p_buf, size);
+}
+
+kerror_t virtio_blk::write(uint64_t sector, const void *p_buf, size_t size)
+{
+    return submit_request(VIRTIO_BLK_T_OUT, sector, const_cast<void *>(p_buf), size);
+}
+
+kerror_t virtio_blk::flush()
+{
+    return submit_request(VIRTIO_BLK_T_FLUSH, 0, nullptr, 0);
+}
+
+kerror_t virtio_blk::submit_request(uint32_t type, uint64_t sector, void *p_buf, size_t size)
+{
+    if (nullptr == request_q_) {
+        return E_NODEV;
+    }
+    if (size % SECTOR_SIZE != 0 || (0 != size && nullptr == p_buf)) {
+        return E_INVAL;
+    }
+
+    // Large transfers are split into requests which are submitted with a single notification
+    const size_t max_size = max_request_size_ / SECTOR_SIZE * SECTOR_SIZE;
+    uint8_t *p_data = reinterpret_cast<uint8_t *>(p_buf);
+    do {
+        virtio_blk_request reqs[MAX_BATCH_REQUESTS];
+        semaphore done(MAX_BATCH_REQUESTS, 0);
+        virtq_batch batch;
+        // Header, data and status descriptors per request
+        virtq_batch_begin(request_q_, &batch, MAX_BATCH_REQUESTS * 3);
+        size_t num_requests = 0;
+        do {
+            const size_t chunk_size = std::min(size, max_size);
+            virtio_blk_request &req = reqs[num_requests];
+            req.hdr.type = type;
+            req.hdr.reserved = 0;
+            req.hdr.sector = sector;
+            req.status = 0xff;
+            req.p_done = &done;
+
+            // Header is read by the device, data is written for reads, status is always written
+            virtq_iovec iov[3];
+            size_t num_segments = 0;
+            iov[num_segments++] = { &req.hdr, sizeof(req.hdr) };
+            if (0 != chunk_size) {
+                iov[num_segments++] = { p_data, (uint32_t)chunk_size };
+            }
+            iov[num_segments++] = { const_cast<uint8_t *>(&req.status), sizeof(req.status) };
+            const size_t num_readable = (VIRTIO_BLK_T_OUT == type && 0 != chunk_size) ? 2 : 1;
+            if (E_OK != virtq_batch_add(&batch, iov, num_readable, num_segments - num_readable, &req)) {
+                break;
+            }
+            num_requests++;
+            sector += chunk_size / SECTOR_SIZE;
+            p_data += chunk_size;
+            size -= chunk_size;
+        } while (0 != size && num_requests < MAX_BATCH_REQUESTS);
+        virtq_batch_publish(&batch);
+        if (0 == num_requests) {
+            return E_NOMEM;
+        }
+
+        for (size_t i = 0; i < num_requests; i++) {
+            done.take();
+        }
+        for (size_t i = 0; i < num_requests; i++) {
+            switch (reqs[i].status) {
+            case VIRTIO_BLK_S_OK:
+                break;
+            case VIRTIO_BLK_S_UNSUPP:
+                return E_NOIMPL;
+            default:
+                return E_NODEV;
+            }
+        }
+    } while (0 != size);
+
+    return E_OK;
 }
 
 uint32_t virtio_blk::read_reg(uint16_t reg)
@@ -78,7 +202,7 @@ uint32_t virtio_blk::read_reg(uint16_t reg)
     case seg_max:
     case geometry:
     case blk_size:
-        return arch_io_read32(pci_dev_->bar(0) + reg);
+        return config_read32(reg - device_config);
     default:
         return virtio_dev::read_reg(reg);
     }
@@ -93,7 +217,7 @@ void virtio_blk::write_reg(uint16_t reg, uint32_t value)
     case seg_max:
     case geometry:
     case blk_size:
-        arch_io_write32(pci_dev_->bar(0) + reg, value);
+        config_write32(reg - device_config, value);
         break;
     default:
         virtio_dev::write_reg(reg, value);
@@ -103,7 +227,29 @@ void virtio_blk::write_reg(uint16_t reg, uint32_t value)
 
 void virtio_blk::handle_request_completion(void *data_ctx, void *data, size_t size)
 {
-    // TODO
+    (void)data;
+    (void)size;
+    virtio_blk_request *p_req = reinterpret_cast<virtio_blk_request *>(data_ctx);
+    p_req->p_done->give();
 }
 
 } // otrix::dev
+
+// Synchronous 4 KiB read, split and packed rings are compared with virtio.packed=0/1
+KBENCH(virtio_blk_read_4k)
+{
+    using namespace otrix::dev;
+    virtio_blk *dev = kbench_dev;
+    if (nullptr == dev) {
+        return;
+    }
+
+    alignas(4096) static uint8_t buf[4096];
+    while (s.run()) {
+        if (E_OK != dev->read(0, buf, sizeof(buf))) {
+            s.discard();
+            break;
+        }
+    }
+    dev->print_vq_stats(dev->request_q_);
+}
@@ -50,11 +50,11 @@ size_t virtio_console::write(const char *data, size_t size)
     return size;
 }
 
-uint32_t virtio_console::negotiate_features(uint32_t device_features)
+uint64_t virtio_console::negotiate_features(uint64_t device_features)
 {
     const uint32_t supported_features = (1 << VIRTIO_CONSOLE_F_MULTIPORT) | (1 << VIRTIO_CONSOLE_F_EMERG_WRITE);
     if ((supported_features & device_features) != supported_features) {
-        immediate_console::print("Failed to negotiate required features: %08x, %08x\n", supported_features, device_features);
+        immediate_console::print("Failed to negotiate required features: %08x, %016lx\n", supported_features, device_features);
     }
     return (device_features & 0xFF000000) | (device_features & supported_features);
 }
@@ -64,10 +64,10 @@ uint32_t virtio_console::read_reg(uint16_t reg)
     switch (reg) {
     case console_cols:
     case console_rows:
-        return arch_io_read16(pci_dev_->bar(0) + reg);
+        return config_read16(reg - device_config);
     case console_max_nr_ports:
     case console_emerg_write:
-        return arch_io_read32(pci_dev_->bar(0) + reg);
+        return config_read32(reg - device_config);
     default:
         return virtio_dev::read_reg(reg);
     }
@@ -78,10 +78,10 @@ void virtio_console::write_reg(uint16_t reg, uint32_t value)
     switch (reg) {
     case console_cols:
     case console_rows:
-        return arch_io_write16(pci_dev_->bar(0) + reg, value);
+        return config_write16(reg - device_config, value);
     case console_max_nr_ports:
     case console_emerg_write:
-        return arch_io_write32(pci_dev_->bar(0) + reg, value);
+        return config_write32(reg - device_config, value);
     default:
         return virtio_dev::write_reg(reg, value);
     }
@@ -1,15 +1,45 @@
 #include "dev/virtio_net.hpp"
 #include "otrix/immediate_console.hpp"
 #include "arch/asm.h"
+#include "arch/clock.hpp"
 #include "kernel/alloc.hpp"
 #include "kernel/kthread.hpp"
 #include "common/utils.h"
 #include "net/ethernet.hpp"
 #include "net/sockbuf.hpp"
+#include "net/ipv4.hpp"
+#include "net/tcp.hpp"
+#include "net/packet_filter.hpp"
+#include "kernel/kbench.hpp"
 
 #define VIRTIO_NET_S_LINK_UP  1
 #define VIRTIO_NET_S_ANNOUNCE 2
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+#define VIRTIO_NET_HDR_GSO_NONE  0
+#define VIRTIO_NET_HDR_GSO_TCPV4 1
+#define VIRTIO_NET_HDR_GSO_ECN   0x80
+
+#define VIRTIO_NET_OK  0
+#define VIRTIO_NET_ERR 1
+
+#define VIRTIO_NET_CTRL_RX 0
+#define VIRTIO_NET_CTRL_RX_PROMISC 0
+#define VIRTIO_NET_CTRL_RX_ALLMULTI 1
+
+#define VIRTIO_NET_CTRL_MAC 1
+#define VIRTIO_NET_CTRL_MAC_TABLE_SET 0
+#define VIRTIO_NET_CTRL_MAC_ADDR_SET 1
+
+#define VIRTIO_NET_CTRL_VLAN 2
+#define VIRTIO_NET_CTRL_VLAN_ADD 0
+#define VIRTIO_NET_CTRL_VLAN_DEL 1
+
+#define VIRTIO_NET_CTRL_MQ 4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
 namespace otrix::dev
 {
 
@@ -45,28 +75,154 @@ struct virtio_net_hdr
     uint16_t gso_size;
     uint16_t csum_start;
     uint16_t csum_offset;
+    uint16_t num_buffers; // Present only with VIRTIO_NET_F_MRG_RXBUF or VIRTIO_F_VERSION_1
+} __attribute__((packed));
+
+static constexpr size_t VIRTIO_NET_HDR_LEGACY_SIZE = offsetof(virtio_net_hdr, num_buffers);
+
+struct virtio_net_ctrl_hdr
+{
+    uint8_t cls;
+    uint8_t cmd;
+} __attribute__((packed));
+
+// Control command is submitted as a chain of header, command data and ack
+struct virtio_net_ctrl_command
+{
+    virtio_net_ctrl_hdr hdr;
+    volatile uint8_t ack;
+    volatile bool done;
+};
+
+// Large frame split by software GSO, released once all its segments are transmitted
+struct virtio_net_gso_frame
+{
+    net::sockbuf *skb;
+    size_t refs;
+};
+
+// MAC filter table, command data is the unicast table followed by the multicast one
+struct virtio_net_ctrl_mac
+{
+    uint32_t entries;
+    uint8_t macs[][6];
 } __attribute__((packed));
 
 using otrix::immediate_console;
 
-virtio_net::virtio_net(pci_dev *p_dev): virtio_dev(p_dev), rx_packet_queue_(RX_QUEUE_SIZE, sizeof(net::sockbuf *)),
-                                        rx_thread_(64 * 1024, [] (void *ctx) { ((virtio_net *)ctx)->rx_thread(); }, "virtio_net-RX", 3, this),
-                                        num_rx_buffers_(0)
+tunable<size_t> virtio_net::rx_queue_size_("virtio_net.rx_queue_size", RX_QUEUE_SIZE, 1, 256);
+tunable<size_t> virtio_net::rx_thread_stack_size_("virtio_net.rx_stack_size", RX_THREAD_STACK_SIZE, 4096, 1024 * 1024);
+tunable<uint16_t> virtio_net::tx_irq_batch_("virtio_net.tx_irq_batch", TX_IRQ_BATCH, 1, 256);
+tunable<size_t> virtio_net::rx_budget_("virtio_net.rx_budget", RX_BUDGET, 1, 1024);
+tunable<int> virtio_net::rx_thread_priority_("virtio_net.rx_priority", RX_THREAD_PRIORITY, 0, scheduler::NUM_PRIORITIES - 1);
+tunable<bool> virtio_net::csum_offload_("virtio_net.csum_offload", true);
+tunable<bool> virtio_net::tso_("virtio_net.tso", true);
+tunable<bool> virtio_net::lro_("virtio_net.lro", true);
+tunable<bool> virtio_net::rx_filter_("virtio_net.rx_filter", true);
+tunable<size_t> virtio_net::tx_backlog_size_("virtio_net.tx_backlog_size", TX_BACKLOG_SIZE, 0, 4096);
+tunable<size_t> virtio_net::tx_reclaim_budget_("virtio_net.tx_reclaim_budget", TX_RECLAIM_BUDGET, 1, 1024);
+tunable<size_t> virtio_net::max_queue_pairs_("virtio_net.max_queue_pairs", MAX_QUEUE_PAIRS, 1, MAX_QUEUE_PAIRS);
+
+static const char *const rx_thread_names[] = { "virtio_net-RX0", "virtio_net-RX1", "virtio_net-RX2", "virtio_net-RX3" };
+
+// Device used by benchmarks
+static virtio_net *kbench_dev;
+
+virtio_net::rx_queue::rx_queue(virtio_net *p_dev, size_t index): p_dev(p_dev), index(index), vq(nullptr),
+                                thread(rx_thread_stack_size_ / sizeof(uint64_t),
+                                       [] (void *ctx) { rx_queue *p_rxq = (rx_queue *)ctx; p_rxq->p_dev->rx_thread(p_rxq); },
+                                       rx_thread_names[index], rx_thread_priority_, this),
+                                num_buffers(0), p_pool(nullptr), p_free_buffers(nullptr), num_free_buffers(0),
+                                pool_size(0), pool_recycled(0), pool_exhausted(0), pool_copied(0),
+                                p_merge(nullptr), merge_size(0), merge_remaining(0),
+                                gro([] (net::sockbuf *skb, void *ctx) { ((rx_queue *)ctx)->p_dev->deliver_rx(skb); }, this),
+                                processing(false), deferred(false)
+{}
+
+virtio_net::tx_queue::tx_queue(): p_dev(nullptr), vq(nullptr), p_backlog(nullptr), backlog_len(0),
+                                  p_completed(nullptr), num_completed(0), num_blocked(0),
+                                  backlogged(0), blocked(0), reclaimed(0)
+{}
+
+virtio_net::virtio_net(pci_dev *p_dev): virtio_dev(p_dev), tx_q_(), rx_q_(), num_queue_pairs_(1), ctrl_q_(nullptr), ctrl_timed_out_(false),
+                                        net_hdr_size_(VIRTIO_NET_HDR_LEGACY_SIZE), tx_tso_frames_(0),
+                                        tx_gso_frames_(0), tx_gso_segments_(0), rx_buffer_size_(MTU + sizeof(virtio_net_hdr)),
+                                        rx_ring_size_(rx_queue_size_),
+                                        rx_merged_packets_(0), rx_merge_drops_(0), rx_filter_on_device_(false),
+                                        rx_filter_drops_(0), num_busy_pollers_(0), rx_busy_polls_(0),
+                                        rx_busy_poll_frames_(0)
 {
+    static_assert(sizeof(rx_thread_names) / sizeof(rx_thread_names[0]) == MAX_QUEUE_PAIRS);
+
     begin_init();
+    if (modern() || (features() & (1ull << VIRTIO_NET_F_MRG_RXBUF))) {
+        net_hdr_size_ = sizeof(virtio_net_hdr);
+    }
+    if (features() & (1ull << VIRTIO_NET_F_MRG_RXBUF)) {
+        // Packets larger than a page are spread over several buffers
+        rx_buffer_size_ = RX_PAGE_SIZE - RX_HEADROOM;
+    }
+    if (features() & (1ull << VIRTIO_NET_F_GUEST_TSO4)) {
+        // Device waits for enough buffers to hold a whole coalesced segment, which would never come
+        // from a smaller ring
+        const size_t lro_frame_size = sizeof(virtio_net_hdr) + sizeof(net::ethernet_hdr) + UINT16_MAX;
+        rx_ring_size_ = std::max<size_t>(rx_ring_size_, (lro_frame_size + rx_buffer_size_ - 1) / rx_buffer_size_);
+    }
 
-    kerror_t ret = virtq_create(1, &tx_q_, tx_completion_event, this);
-    if (E_OK != ret) {
-        immediate_console::print("Failed to create TX queue\n");
+    // Queue pairs are followed by the control queue
+    uint16_t ctrl_q_index = 2;
+    if (features() & (1ull << VIRTIO_NET_F_MQ)) {
+        const uint16_t max_pairs = read_reg(max_virtqueue_pairs);
+        ctrl_q_index = 2 * max_pairs;
+        // Each queue gets own MSI-X vector, one more is taken by the control queue
+        const size_t msix_pairs = (std::max<size_t>(pci_dev_->msix_vectors(), 1) - 1) / 2;
+        num_queue_pairs_ = std::max<size_t>(std::min<size_t>({ max_pairs, max_queue_pairs_, msix_pairs }), 1);
+    }
+    if (features() & (1ull << VIRTIO_NET_F_CTRL_VQ)) {
+        if (E_OK == virtq_create(ctrl_q_index, &ctrl_q_, ctrl_completion_event, this)) {
+            virtq_set_poll_event(ctrl_q_, &ctrl_poll_event_);
+        } else {
+            immediate_console::print("Failed to create control queue\n");
+        }
     }
 
-    ret = virtq_create(0, &rx_q_, rx_handler, this);
-    if (E_OK != ret) {
-        immediate_console::print("Failed to create RX queue\n");
+    for (size_t i = 0; i < num_queue_pairs_; i++) {
+        tx_q_[i].p_dev = this;
+        kerror_t ret = virtq_create(2 * i + 1, &tx_q_[i].vq, tx_completion_event, &tx_q_[i]);
+        if (E_OK != ret) {
+            immediate_console::print("Failed to create TX queue %lu\n", i);
+        } else {
+            // TX buffers always complete, so their reclamation can be delayed.
+            // RX keeps an interrupt per packet.
+            virtq_set_irq_batch(tx_q_[i].vq, tx_irq_batch_);
+        }
+
+        rx_q_[i] = new rx_queue(this, i);
+        ret = init_rx_pool(rx_q_[i]);
+        if (E_OK != ret) {
+            immediate_console::print("Failed to allocate RX buffer pool %lu\n", i);
+            continue;
+        }
+        ret = virtq_create(2 * i, &rx_q_[i]->vq, rx_handler, rx_q_[i]);
+        if (E_OK != ret) {
+            immediate_console::print("Failed to create RX queue %lu\n", i);
+        } else {
+            // Received packets are processed by the queue's rx_thread()
+            virtq_set_poll_event(rx_q_[i]->vq, &rx_q_[i]->poll_event);
+        }
     }
 
     init_finished();
 
+    if (num_queue_pairs_ > 1) {
+        const uint16_t num_pairs = num_queue_pairs_;
+        if (E_OK != send_ctrl_command(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &num_pairs, sizeof(num_pairs))) {
+            // Device keeps using only the first pair
+            immediate_console::print("Failed to set %lu queue pairs\n", num_queue_pairs_);
+            num_queue_pairs_ = 1;
+        }
+    }
+
     addr_[0] = read_reg(mac_0);
     addr_[1] = read_reg(mac_1);
     addr_[2] = read_reg(mac_2);
@@ -74,16 +230,43 @@ virtio_net::virtio_net(pci_dev *p_dev): virtio_dev(p_dev), rx_packet_queue_(RX_Q
     addr_[4] = read_reg(mac_4);
     addr_[5] = read_reg(mac_5);
 
-    scheduler::get().add_thread(&rx_thread_);
+    // Frames for other hosts are dropped by the device, otherwise by handle_rx()
+    rx_filter_on_device_ = E_OK == program_rx_filter();
+
+    for (size_t i = 0; i < num_queue_pairs_; i++) {
+        if (nullptr != rx_q_[i]->vq) {
+            scheduler::get().add_thread(&rx_q_[i]->thread);
+        }
+    }
+    kbench_dev = this;
 }
 
 virtio_net::~virtio_net()
 {
-    if (nullptr != tx_q_) {
-        virtq_destroy(tx_q_);
+    if (this == kbench_dev) {
+        kbench_dev = nullptr;
     }
-    if (nullptr != rx_q_) {
-        virtq_destroy(rx_q_);
+    for (size_t i = 0; i < MAX_QUEUE_PAIRS; i++) {
+        if (nullptr != tx_q_[i].vq) {
+            virtq_destroy(tx_q_[i].vq);
+        }
+        reclaim_tx(&tx_q_[i], SIZE_MAX);
+        while (nullptr != tx_q_[i].p_backlog) {
+            net::sockbuf *skb = container_of(tx_q_[i].p_backlog, net::sockbuf::node_t, list_node)->p_skb;
+            tx_q_[i].p_backlog = intrusive_list_delete(tx_q_[i].p_backlog, tx_q_[i].p_backlog);
+            delete skb;
+        }
+        if (nullptr != rx_q_[i]) {
+            if (nullptr != rx_q_[i]->vq) {
+                virtq_destroy(rx_q_[i]->vq);
+            }
+            otrix::free(rx_q_[i]->p_pool);
+            delete[] rx_q_[i]->p_free_buffers;
+            delete rx_q_[i];
+        }
+    }
+    if (nullptr != ctrl_q_) {
+        virtq_destroy(ctrl_q_);
     }
 }
 
@@ -92,8 +275,29 @@ void virtio_net::print_info()
     virtio_dev::print_info();
     uint8_t mac[6];
     get_mac(&mac);
-    immediate_console::print("Virtio dev mac: %02x:%02x:%02x:%02x:%02x:%02x, status %04x\n",
-            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], read_reg(net_status));
+    immediate_console::print("Virtio dev mac: %02x:%02x:%02x:%02x:%02x:%02x, status %04x, queue pairs %lu, offloads %x\n",
+            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], read_reg(net_status), num_queue_pairs_, offloads());
+    for (size_t i = 0; i < num_queue_pairs_; i++) {
+        print_vq_stats(tx_q_[i].vq);
+        immediate_console::print("TX backlog: %lu queued, %lu now, %lu blocked senders, %lu reclaimed\n",
+                tx_q_[i].backlogged, tx_q_[i].backlog_len, tx_q_[i].blocked, tx_q_[i].reclaimed);
+        print_vq_stats(rx_q_[i]->vq);
+        immediate_console::print("RX pool: %lu/%lu free, %lu recycled, %lu exhausted, %lu copied\n",
+                rx_q_[i]->num_free_buffers, rx_q_[i]->pool_size, rx_q_[i]->pool_recycled, rx_q_[i]->pool_exhausted,
+                rx_q_[i]->pool_copied);
+        immediate_console::print("GRO: %lu segments coalesced into %lu\n",
+                rx_q_[i]->gro.num_coalesced_segments(), rx_q_[i]->gro.num_coalesced());
+    }
+    immediate_console::print("TSO frames %lu, GSO frames %lu, GSO segments %lu\n",
+            tx_tso_frames_, tx_gso_frames_, tx_gso_segments_);
+    immediate_console::print("RX buffers %lu x %lu bytes, merged packets %lu, merge drops %lu\n",
+            rx_ring_size_, rx_buffer_size_, rx_merged_packets_, rx_merge_drops_);
+    immediate_console::print("RX filter on %s, %lu frames dropped in software\n",
+            rx_filter_on_device_ ? "device" : "driver", rx_filter_drops_);
+    if (!packet_filter_.empty()) {
+        packet_filter_.print_stats();
+    }
+    immediate_console::print("RX busy polls %lu, %lu frames\n", rx_busy_polls_, rx_busy_poll_frames_);
 }
 
 void virtio_net::get_mac(net::mac_t *mac)
@@ -101,10 +305,41 @@ void virtio_net::get_mac(net::mac_t *mac)
     memcpy(mac, addr_, sizeof(addr_));
 }
 
+// Finish partial checksum for a device without VIRTIO_NET_F_CSUM
+static void complete_csum(net::sockbuf *data)
+{
+    uint8_t *p_l4_hdr = data->header(data->csum_header());
+    uint16_t *p_csum = reinterpret_cast<uint16_t *>(p_l4_hdr + data->csum_offset());
+    // Headers end where the payload starts or, for zero-copy payload, at the end of the header buffer
+    const size_t headers_len = (uint8_t *)data->data() + data->headers_size() - p_l4_hdr;
+    const uint16_t headers_sum = ~net::ip_checksum(p_l4_hdr, headers_len);
+    *p_csum = net::ip_checksum(data->payload(), data->payload_size(), headers_sum);
+}
+
+// Packets of a flow are kept on one TX queue, so they aren't reordered
+static uint32_t flow_hash(const net::sockbuf *data)
+{
+    using namespace net;
+    const ip_hdr *p_ip_hdr = reinterpret_cast<const ip_hdr *>(data->header(sockbuf_header_t::ip));
+    if (nullptr == p_ip_hdr) {
+        return 0;
+    }
+    uint32_t hash = p_ip_hdr->saddr ^ p_ip_hdr->daddr ^ p_ip_hdr->proto;
+    const tcp_header *p_tcp_hdr = reinterpret_cast<const tcp_header *>(data->header(sockbuf_header_t::tcp));
+    if (nullptr != p_tcp_hdr) {
+        hash ^= (uint32_t)p_tcp_hdr->source_port << 16 | p_tcp_hdr->dest_port;
+    }
+    // Mix all bits into the low ones used for queue selection
+    hash ^= hash >> 16;
+    hash *= 0x7feb352d;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68b;
+    hash ^= hash >> 16;
+    return hash;
+}
+
 kerror_t virtio_net::write(net::sockbuf *data, const net::mac_t &dest, net::ethertype type, uint64_t timeout_ms)
 {
-    // TODO: add timeout for virtq_send_buffer
-    (void)timeout_ms;
     using namespace net;
     ethernet_hdr *e_hdr = reinterpret_cast<ethernet_hdr *>(data->add_header(sizeof(ethernet_hdr),
                     sockbuf_header_t::ethernet));
@@ -115,17 +350,311 @@ kerror_t virtio_net::write(net::sockbuf *data, const net::mac_t &dest, net::ethe
     } else {
         e_hdr->ethertype = htons(static_cast<uint16_t>(type));
     }
-    virtio_net_hdr *v_hdr = reinterpret_cast<virtio_net_hdr *>(data->add_header(sizeof(virtio_net_hdr),
+    virtio_net_hdr *v_hdr = reinterpret_cast<virtio_net_hdr *>(data->add_header(net_hdr_size_,
                     sockbuf_header_t::virtio));
-    memset(v_hdr, 0, sizeof(*v_hdr));
+    memset(v_hdr, 0, net_hdr_size_);
+    tx_queue *p_txq = &tx_q_[num_queue_pairs_ > 1 ? flow_hash(data) % num_queue_pairs_ : 0];
+    // Frames completed since the previous transmit are freed here rather than in the interrupt
+    reclaim_tx(p_txq, tx_reclaim_budget_);
+    if (0 != data->gso_size() && data->payload_size() > data->gso_size()) {
+        const uint8_t gso_type = tso_type(data);
+        if (VIRTIO_NET_HDR_GSO_NONE == gso_type) {
+            return tx_gso(p_txq, data, timeout_ms);
+        }
+        v_hdr->gso_type = gso_type;
+        v_hdr->gso_size = data->gso_size();
+        v_hdr->hdr_len = data->headers_size() - net_hdr_size_;
+    }
+    if (data->csum_partial()) {
+        if (features() & (1ull << VIRTIO_NET_F_CSUM)) {
+            v_hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            v_hdr->csum_start = data->header(data->csum_header()) - (uint8_t *)e_hdr;
+            v_hdr->csum_offset = data->csum_offset();
+        } else {
+            complete_csum(data);
+        }
+    }
 
-    kerror_t ret = virtq_send_buffer(tx_q_, data->data(), data->size(), false);
-    if (E_OK != ret) {
-        return ret;
+    const bool tso = VIRTIO_NET_HDR_GSO_NONE != v_hdr->gso_type;
+    if (1 != tx_submit(p_txq, &data, 1, timeout_ms)) {
+        return E_NOMEM;
+    }
+    if (tso) {
+        tx_tso_frames_++;
+    }
+    return E_OK;
+}
+
+size_t virtio_net::tx_submit(tx_queue *p_txq, net::sockbuf *const *p_frames, size_t num_frames, uint64_t timeout_ms,
+        bool overcommit)
+{
+    if (nullptr == p_txq->vq) {
+        return 0;
+    }
+    // Wakeups don't restart the timeout
+    const bool infinite = static_cast<uint64_t>(KTHREAD_TIMEOUT_INF) == timeout_ms;
+    const uint64_t tsc_deadline = infinite ? 0 : arch_tsc() + arch::clock::ns_to_tsc(timeout_ms * 1000 * 1000);
+    size_t num_queued = 0;
+    while (num_queued != num_frames) {
+        // Backlogged frames go first, so frames keep their order
+        auto flags = arch_irq_save();
+        tx_drain_backlog(p_txq);
+        if (nullptr == p_txq->p_backlog) {
+            num_queued += tx_burst(p_txq->vq, p_frames + num_queued, num_frames - num_queued);
+        }
+        for (; num_queued != num_frames && (overcommit || p_txq->backlog_len < tx_backlog_size_); num_queued++) {
+            intrusive_list *p_node = &p_frames[num_queued]->node()->list_node;
+            if (nullptr == p_txq->p_backlog) {
+                p_txq->p_backlog = intrusive_list_init(p_node);
+            } else {
+                intrusive_list_push_back(p_txq->p_backlog, p_node);
+            }
+            p_txq->backlog_len++;
+            p_txq->backlogged++;
+        }
+        if (num_queued == num_frames || 0 == timeout_ms) {
+            arch_irq_restore(flags);
+            break;
+        }
+
+        uint64_t wait_ms = timeout_ms;
+        if (!infinite) {
+            const uint64_t now = arch_tsc();
+            wait_ms = now < tsc_deadline ? (arch::clock::tsc_to_ns(tsc_deadline - now) + 999999) / 1000000 : 0;
+            if (0 == wait_ms) {
+                arch_irq_restore(flags);
+                break;
+            }
+        }
+
+        // Backlog is full, wait for the device to complete some frames
+        p_txq->num_blocked++;
+        p_txq->blocked++;
+        arch_irq_restore(flags);
+        const bool woken = p_txq->space_event.take(wait_ms);
+        flags = arch_irq_save();
+        p_txq->num_blocked--;
+        arch_irq_restore(flags);
+        if (!woken) {
+            break;
+        }
+    }
+    return num_queued;
+}
+
+void virtio_net::tx_drain_backlog(tx_queue *p_txq)
+{
+    while (nullptr != p_txq->p_backlog) {
+        net::sockbuf *frames[TX_DRAIN_BURST];
+        size_t num_frames = 0;
+        intrusive_list *p_node = p_txq->p_backlog;
+        do {
+            frames[num_frames++] = container_of(p_node, net::sockbuf::node_t, list_node)->p_skb;
+            p_node = p_node->next;
+        } while (num_frames < TX_DRAIN_BURST && p_node != p_txq->p_backlog);
+
+        const size_t num_sent = tx_burst(p_txq->vq, frames, num_frames);
+        for (size_t i = 0; i < num_sent; i++) {
+            p_txq->p_backlog = intrusive_list_delete(p_txq->p_backlog, &frames[i]->node()->list_node);
+        }
+        p_txq->backlog_len -= num_sent;
+        if (num_sent != num_frames) {
+            break;
+        }
+    }
+}
+
+void virtio_net::reclaim_tx(tx_queue *p_txq, size_t budget)
+{
+    // Completed frames are detached under the lock and freed with interrupts enabled
+    intrusive_list *p_reclaimed = nullptr;
+    auto flags = arch_irq_save();
+    for (size_t i = 0; i < budget && nullptr != p_txq->p_completed; i++) {
+        intrusive_list *p_node = p_txq->p_completed;
+        p_txq->p_completed = intrusive_list_delete(p_txq->p_completed, p_node);
+        p_txq->num_completed--;
+        if (nullptr == p_reclaimed) {
+            p_reclaimed = intrusive_list_init(p_node);
+        } else {
+            intrusive_list_push_back(p_reclaimed, p_node);
+        }
+    }
+    arch_irq_restore(flags);
+
+    while (nullptr != p_reclaimed) {
+        net::sockbuf *skb = container_of(p_reclaimed, net::sockbuf::node_t, list_node)->p_skb;
+        p_reclaimed = intrusive_list_delete(p_reclaimed, p_reclaimed);
+        delete skb;
+        p_txq->reclaimed++;
+    }
+}
+
+uint8_t virtio_net::tso_type(const net::sockbuf *data) const
+{
+    using namespace net;
+    const tcp_header *p_tcp_hdr = reinterpret_cast<const tcp_header *>(data->header(sockbuf_header_t::tcp));
+    if (nullptr == p_tcp_hdr || !(features() & (1ull << VIRTIO_NET_F_HOST_TSO4))) {
+        return VIRTIO_NET_HDR_GSO_NONE;
+    }
+    // CWR must be kept on the first segment only, which the device does with VIRTIO_NET_F_HOST_ECN
+    if (p_tcp_hdr->flags & TCP_FLAG_CONG_WND_REDUCED) {
+        if (!(features() & (1ull << VIRTIO_NET_F_HOST_ECN))) {
+            return VIRTIO_NET_HDR_GSO_NONE;
+        }
+        return VIRTIO_NET_HDR_GSO_TCPV4 | VIRTIO_NET_HDR_GSO_ECN;
+    }
+    return VIRTIO_NET_HDR_GSO_TCPV4;
+}
+
+static void gso_frame_release(virtio_net_gso_frame *p_frame)
+{
+    auto flags = arch_irq_save();
+    const bool last = 0 == --p_frame->refs;
+    arch_irq_restore(flags);
+    if (last) {
+        delete p_frame->skb;
+        delete p_frame;
+    }
+}
+
+kerror_t virtio_net::tx_gso(tx_queue *p_txq, net::sockbuf *data, uint64_t timeout_ms)
+{
+    using namespace net;
+    const uint8_t *p_eth_hdr = data->header(sockbuf_header_t::ethernet);
+    const ip_hdr *p_ip_hdr = reinterpret_cast<const ip_hdr *>(data->header(sockbuf_header_t::ip));
+    const tcp_header *p_tcp_hdr = reinterpret_cast<const tcp_header *>(data->header(sockbuf_header_t::tcp));
+    if (nullptr == p_ip_hdr || nullptr == p_tcp_hdr) {
+        return E_INVAL;
+    }
+    const size_t eth_len = (const uint8_t *)p_ip_hdr - p_eth_hdr;
+    const size_t ip_len = (const uint8_t *)p_tcp_hdr - (const uint8_t *)p_ip_hdr;
+    const size_t tcp_len = (p_tcp_hdr->header_len >> 4) * sizeof(uint32_t);
+    const size_t mss = data->gso_size();
+    const bool device_csum = features() & (1ull << VIRTIO_NET_F_CSUM);
+
+    // Segments reference the payload of the frame, which holds one reference itself until all are queued
+    virtio_net_gso_frame *p_frame = new virtio_net_gso_frame{data, 1};
+    auto payload_free_func = [] (void *, size_t, void *ctx) {
+        gso_frame_release(reinterpret_cast<virtio_net_gso_frame *>(ctx));
+    };
+
+    // All segments are built before any is queued, so the unit is transmitted whole or not at all.
+    // The caller has already assigned sequence numbers to the whole payload.
+    const size_t num_segments = (data->payload_size() + mss - 1) / mss;
+    sockbuf **segments = (sockbuf **)otrix::alloc(num_segments * sizeof(sockbuf *));
+    if (nullptr == segments) {
+        delete p_frame;
+        return E_NOMEM;
+    }
+    size_t offset = 0;
+    size_t num_built = 0;
+    for (; num_built < num_segments; num_built++) {
+        const size_t seg_size = std::min(mss, data->payload_size() - offset);
+        const bool first = 0 == offset;
+        const bool last = offset + seg_size == data->payload_size();
+        auto flags = arch_irq_save();
+        p_frame->refs++;
+        arch_irq_restore(flags);
+        sockbuf *seg = new sockbuf(net_hdr_size_ + eth_len + ip_len + tcp_len, data->payload() + offset, seg_size,
+                payload_free_func, p_frame);
+        if (nullptr == seg) {
+            gso_frame_release(p_frame);
+            break;
+        } else if (nullptr == seg->data()) {
+            // Drops the reference to the frame
+            delete seg;
+            break;
+        }
+
+        tcp_header *p_seg_tcp = reinterpret_cast<tcp_header *>(seg->add_header(tcp_len, sockbuf_header_t::tcp));
+        memcpy(p_seg_tcp, p_tcp_hdr, tcp_len);
+        p_seg_tcp->seq = htonl(ntohl(p_tcp_hdr->seq) + offset);
+        if (!last) {
+            p_seg_tcp->flags &= ~(TCP_FLAG_PSH | TCP_FLAG_FIN);
+        }
+        if (!first) {
+            p_seg_tcp->flags &= ~TCP_FLAG_CONG_WND_REDUCED;
+        }
+        ip_hdr *p_seg_ip = reinterpret_cast<ip_hdr *>(seg->add_header(ip_len, sockbuf_header_t::ip));
+        memcpy(p_seg_ip, p_ip_hdr, ip_len);
+        p_seg_ip->len = htons(ip_len + tcp_len + seg_size);
+        p_seg_ip->id = htons(ntohs(p_ip_hdr->id) + num_built);
+        p_seg_ip->csum = 0;
+        p_seg_ip->csum = ip_checksum(reinterpret_cast<const uint8_t *>(p_seg_ip), ip_len);
+        uint8_t *p_seg_eth = seg->add_header(eth_len, sockbuf_header_t::ethernet);
+        memcpy(p_seg_eth, p_eth_hdr, eth_len);
+        virtio_net_hdr *v_hdr = reinterpret_cast<virtio_net_hdr *>(seg->add_header(net_hdr_size_,
+                        sockbuf_header_t::virtio));
+        memset(v_hdr, 0, net_hdr_size_);
+
+        // Pseudo header of the frame is replaced with the one of the segment
+        p_seg_tcp->csum = ip_csum_fold(tcp_pseudo_header_sum(p_ip_hdr->saddr, p_ip_hdr->daddr, tcp_len + seg_size));
+        seg->set_csum_partial(sockbuf_header_t::tcp, offsetof(tcp_header, csum));
+        if (device_csum) {
+            v_hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            v_hdr->csum_start = eth_len + ip_len;
+            v_hdr->csum_offset = offsetof(tcp_header, csum);
+        } else {
+            complete_csum(seg);
+        }
+
+        segments[num_built] = seg;
+        offset += seg_size;
     }
+
+    size_t num_queued = 0;
+    if (num_built == num_segments) {
+        num_queued = tx_submit(p_txq, segments, num_segments, timeout_ms);
+        if (0 != num_queued && num_queued != num_segments) {
+            // Part of the unit is queued, the rest goes over the backlog limit rather than being lost
+            num_queued += tx_submit(p_txq, segments + num_queued, num_segments - num_queued, timeout_ms, true);
+        }
+    }
+    for (size_t i = num_queued; i < num_built; i++) {
+        delete segments[i];
+    }
+    otrix::free(segments);
+
+    if (0 == num_queued) {
+        // Nothing references the payload, the frame stays with the caller
+        delete p_frame;
+        return E_NOMEM;
+    }
+    tx_gso_frames_++;
+    tx_gso_segments_ += num_queued;
+    gso_frame_release(p_frame);
     return E_OK;
 }
 
+size_t virtio_net::tx_burst(virtq *p_vq, net::sockbuf *const *p_frames, size_t num_frames)
+{
+    if (nullptr == p_vq) {
+        return 0;
+    }
+    virtq_batch batch;
+    virtq_batch_begin(p_vq, &batch, num_frames * 2);
+    size_t num_sent = 0;
+    for (; num_sent < num_frames; num_sent++) {
+        net::sockbuf *data = p_frames[num_sent];
+        // Headers and zero-copy payload go as separate segments, the socket buffer
+        // is released on TX completion
+        virtq_iovec iov[2];
+        size_t num_segments = 1;
+        if (data->linear()) {
+            iov[0] = { data->data(), (uint32_t)data->size() };
+        } else {
+            iov[0] = { data->data(), (uint32_t)data->headers_size() };
+            iov[1] = { data->payload(), (uint32_t)data->payload_size() };
+            num_segments = 0 != data->payload_size() ? 2 : 1;
+        }
+        if (E_OK != virtq_batch_add(&batch, iov, num_segments, 0, data)) {
+            break;
+        }
+    }
+    virtq_batch_publish(&batch);
+    return num_sent;
+}
+
 kerror_t virtio_net::subscribe_to_rx(net::ethertype type, net::l3_handler_t p_handler, void *ctx)
 {
     auto flags = arch_irq_save();
@@ -142,18 +671,180 @@ kerror_t virtio_net::subscribe_to_rx(net::ethertype type, net::l3_handler_t p_ha
     return E_NOMEM;
 }
 
+kerror_t virtio_net::send_ctrl_command(uint8_t cls, uint8_t cmd, const void *p_data, size_t size)
+{
+    if (nullptr == ctrl_q_ || ctrl_timed_out_) {
+        return E_NOIMPL;
+    }
+
+    // Outlives a timed out command, which the device may still complete
+    virtio_net_ctrl_command *p_command = new virtio_net_ctrl_command;
+    if (nullptr == p_command) {
+        return E_NOMEM;
+    }
+    p_command->hdr.cls = cls;
+    p_command->hdr.cmd = cmd;
+    p_command->ack = VIRTIO_NET_ERR;
+    p_command->done = false;
+
+    virtq_iovec iov[3];
+    size_t num_segments = 0;
+    iov[num_segments++] = { &p_command->hdr, sizeof(p_command->hdr) };
+    if (0 != size) {
+        iov[num_segments++] = { const_cast<void *>(p_data), (uint32_t)size };
+    }
+    iov[num_segments++] = { const_cast<uint8_t *>(&p_command->ack), sizeof(p_command->ack) };
+
+    // Commands are rare and the device handles them while processing the notification,
+    // so the completion is polled with interrupts disabled, which also serializes commands
+    auto flags = arch_irq_save();
+    kerror_t ret = virtq_send_chain(ctrl_q_, iov, num_segments - 1, 1, p_command);
+    if (E_OK == ret) {
+        const uint64_t tsc_deadline = arch_tsc() + arch::clock::ns_to_tsc(CTRL_TIMEOUT_MS * 1000 * 1000);
+        while (!p_command->done && arch_tsc() < tsc_deadline) {
+            virtq_poll(ctrl_q_, 1);
+            asm volatile("pause");
+        }
+        if (p_command->done) {
+            ret = VIRTIO_NET_OK == p_command->ack ? E_OK : E_INVAL;
+        } else {
+            // Device is stuck (e.g. needs reset), no more commands are sent
+            ctrl_timed_out_ = true;
+            ret = E_TOUT;
+        }
+    }
+    arch_irq_restore(flags);
+    if (E_TOUT == ret) {
+        immediate_console::print("virtio-net control command %u/%u timed out\n", cls, cmd);
+    } else {
+        delete p_command;
+    }
+    return ret;
+}
+
+kerror_t virtio_net::program_rx_filter()
+{
+    if (!(features() & (1ull << VIRTIO_NET_F_CTRL_RX))) {
+        return E_NOIMPL;
+    }
+    kerror_t ret = set_rx_mode(false, false);
+    if (E_OK != ret) {
+        return ret;
+    }
+    if (features() & (1ull << VIRTIO_NET_F_CTRL_MAC_ADDR)) {
+        ret = send_ctrl_command(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET, addr_, sizeof(addr_));
+        if (E_OK != ret) {
+            return ret;
+        }
+    }
+    // Own address and broadcast are always accepted, no other unicast or multicast addresses are used
+    return set_mac_filter(nullptr, 0, nullptr, 0);
+}
+
+kerror_t virtio_net::set_rx_mode(bool promisc, bool allmulti)
+{
+    if (!(features() & (1ull << VIRTIO_NET_F_CTRL_RX))) {
+        return E_NOIMPL;
+    }
+    const uint8_t promisc_on = promisc;
+    const uint8_t allmulti_on = allmulti;
+    kerror_t ret = send_ctrl_command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &promisc_on, sizeof(promisc_on));
+    if (E_OK == ret) {
+        ret = send_ctrl_command(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &allmulti_on, sizeof(allmulti_on));
+    }
+    return ret;
+}
+
+kerror_t virtio_net::set_mac_filter(const net::mac_t *p_unicast, size_t num_unicast,
+        const net::mac_t *p_multicast, size_t num_multicast)
+{
+    if (!(features() & (1ull << VIRTIO_NET_F_CTRL_RX))) {
+        return E_NOIMPL;
+    }
+    if (num_unicast > MAX_MAC_FILTERS || num_multicast > MAX_MAC_FILTERS) {
+        return E_INVAL;
+    }
+    uint8_t data[2 * (sizeof(virtio_net_ctrl_mac) + MAX_MAC_FILTERS * sizeof(net::mac_t))];
+    virtio_net_ctrl_mac *p_table = reinterpret_cast<virtio_net_ctrl_mac *>(data);
+    p_table->entries = num_unicast;
+    if (0 != num_unicast) {
+        memcpy(p_table->macs, p_unicast, num_unicast * sizeof(net::mac_t));
+    }
+    p_table = reinterpret_cast<virtio_net_ctrl_mac *>(p_table->macs[num_unicast]);
+    p_table->entries = num_multicast;
+    if (0 != num_multicast) {
+        memcpy(p_table->macs, p_multicast, num_multicast * sizeof(net::mac_t));
+    }
+    const size_t size = (uint8_t *)p_table->macs[num_multicast] - data;
+    return send_ctrl_command(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET, data, size);
+}
+
+kerror_t virtio_net::set_vlan_filter(uint16_t vid, bool accept)
+{
+    if (!(features() & (1ull << VIRTIO_NET_F_CTRL_VLAN))) {
+        return E_NOIMPL;
+    }
+    return send_ctrl_command(VIRTIO_NET_CTRL_VLAN, accept ? VIRTIO_NET_CTRL_VLAN_ADD : VIRTIO_NET_CTRL_VLAN_DEL,
+            &vid, sizeof(vid));
+}
+
 size_t virtio_net::headers_size() const
 {
-    return sizeof(virtio_net_hdr) + sizeof(net::ethernet_hdr);
+    return net_hdr_size_ + sizeof(net::ethernet_hdr);
 }
 
-uint32_t virtio_net::negotiate_features(uint32_t device_features)
+uint32_t virtio_net::offloads() const
+{
+    uint32_t offloads = 0;
+    if (features() & (1ull << VIRTIO_NET_F_CSUM)) {
+        offloads |= net::LINKIF_OFFLOAD_TX_CSUM;
+    }
+    if (features() & (1ull << VIRTIO_NET_F_GUEST_CSUM)) {
+        offloads |= net::LINKIF_OFFLOAD_RX_CSUM;
+    }
+    // Segmented in software without VIRTIO_NET_F_HOST_TSO4
+    offloads |= net::LINKIF_OFFLOAD_GSO;
+    if (features() & (1ull << VIRTIO_NET_F_HOST_TSO4)) {
+        offloads |= net::LINKIF_OFFLOAD_TSO4;
+    }
+    return offloads;
+}
+
+uint64_t virtio_net::negotiate_features(uint64_t device_features)
 {
     const uint32_t supported_features = (1 << VIRTIO_NET_F_MAC) | (1 << VIRTIO_NET_F_STATUS);
     if ((supported_features & device_features) != supported_features) {
-        immediate_console::print("Failed to negotiate required features: %08x, %08x\n", supported_features, device_features);
+        immediate_console::print("Failed to negotiate required features: %08x, %016lx\n", supported_features, device_features);
+    }
+    uint32_t optional_features = 1 << VIRTIO_NET_F_CTRL_VQ;
+    if (csum_offload_) {
+        optional_features |= (1 << VIRTIO_NET_F_CSUM) | (1 << VIRTIO_NET_F_GUEST_CSUM);
+        // TSO depends on checksum offload, ECN on TSO
+        if (tso_ && (device_features & (1 << VIRTIO_NET_F_CSUM))) {
+            optional_features |= 1 << VIRTIO_NET_F_HOST_TSO4;
+            if (device_features & (1 << VIRTIO_NET_F_HOST_TSO4)) {
+                optional_features |= 1 << VIRTIO_NET_F_HOST_ECN;
+            }
+        }
+    }
+    if (lro_) {
+        optional_features |= 1 << VIRTIO_NET_F_MRG_RXBUF;
+        // Coalesced segments don't fit into a page and carry a partial checksum
+        if (csum_offload_ && (device_features & (1 << VIRTIO_NET_F_MRG_RXBUF)) &&
+            (device_features & (1 << VIRTIO_NET_F_GUEST_CSUM)))
+        {
+            optional_features |= 1 << VIRTIO_NET_F_GUEST_TSO4;
+        }
+    }
+    // Multiple queues and RX filters are configured over the control queue
+    if (device_features & (1 << VIRTIO_NET_F_CTRL_VQ)) {
+        optional_features |= 1 << VIRTIO_NET_F_MQ;
+        if (rx_filter_) {
+            optional_features |= (1 << VIRTIO_NET_F_CTRL_RX) | (1 << VIRTIO_NET_F_CTRL_MAC_ADDR) |
+                                 (1 << VIRTIO_NET_F_CTRL_VLAN);
+        }
     }
-    return (device_features & 0xFF000000) | (device_features & supported_features);
+    return (device_features & 0xFF000000) | (device_features & (supported_features | optional_features));
 }
 
 uint32_t virtio_net::read_reg(uint16_t reg)
@@ -165,10 +856,10 @@ uint32_t virtio_net::read_reg(uint16_t reg)
     case mac_3:
     case mac_4:
     case mac_5:
-        return arch_io_read8(pci_dev_->bar(0) + reg);
+        return config_read8(reg - device_config);
     case net_status:
     case max_virtqueue_pairs:
-        return arch_io_read16(pci_dev_->bar(0) + reg);
+        return config_read16(reg - device_config);
     default:
         return virtio_dev::read_reg(reg);
     }
@@ -183,11 +874,11 @@ void virtio_net::write_reg(uint16_t reg, uint32_t value)
     case mac_3:
     case mac_4:
     case mac_5:
-        arch_io_write8(pci_dev_->bar(0) + reg, value);
+        config_write8(reg - device_config, value);
         break;
     case net_status:
     case max_virtqueue_pairs:
-        arch_io_write16(pci_dev_->bar(0) + reg, value);
+        config_write16(reg - device_config, value);
         break;
     default:
         virtio_dev::write_reg(reg, value);
@@ -199,89 +890,449 @@ void virtio_net::tx_completion_event(void *ctx, void *data_ctx, void *data, size
 {
     (void)data;
     (void)size;
-    (void)ctx;
+    tx_queue *p_txq = (tx_queue *)ctx;
+    virtio_net *p_dev = p_txq->p_dev;
     net::sockbuf *owner = (net::sockbuf *)data_ctx;
-    delete owner;
+    rx_queue *p_rxq = p_dev->rx_q_[p_txq - p_dev->tx_q_];
+    if (nullptr != owner && nullptr != p_rxq && p_dev->is_rx_buffer(p_rxq, owner->data())) {
+        // Frame bounced by tx_bounce() from its RX buffer. The buffer goes back right away,
+        // RX may have stopped for lack of buffers and then nothing else would reclaim it.
+        // Socket buffer lives in the buffer headroom, so nothing is freed here.
+        delete owner;
+    } else if (nullptr != owner) {
+        // Freed by reclaim_tx() on the next transmit, outside of the interrupt
+        intrusive_list *p_node = &owner->node()->list_node;
+        if (nullptr == p_txq->p_completed) {
+            p_txq->p_completed = intrusive_list_init(p_node);
+        } else {
+            intrusive_list_push_back(p_txq->p_completed, p_node);
+        }
+        p_txq->num_completed++;
+    }
+    // Descriptors of the frame are already free
+    p_dev->tx_drain_backlog(p_txq);
+    if (0 != p_txq->num_blocked) {
+        p_txq->space_event.give();
+    }
+}
+
+void virtio_net::ctrl_completion_event(void *ctx, void *data_ctx, void *data, size_t size)
+{
+    (void)ctx;
+    (void)data;
+    (void)size;
+    reinterpret_cast<virtio_net_ctrl_command *>(data_ctx)->done = true;
+}
+
+kerror_t virtio_net::init_rx_pool(rx_queue *p_rxq)
+{
+    static_assert(net::sockbuf::ALLOC_TAG_SIZE + sizeof(net::sockbuf) <= RX_HEADROOM);
+
+    // Buffers in flight through the stack are covered by as many spare ones as the queue holds
+    const size_t pool_size = rx_ring_size_ * RX_POOL_FACTOR;
+    p_rxq->p_pool = (uint8_t *)otrix::alloc((pool_size + 1) * RX_PAGE_SIZE);
+    p_rxq->p_free_buffers = new uint8_t *[pool_size];
+    if (nullptr == p_rxq->p_pool || nullptr == p_rxq->p_free_buffers) {
+        return E_NOMEM;
+    }
+    // Every buffer takes one page, starting with the headroom
+    uint8_t *p_page = (uint8_t *)(((uintptr_t)p_rxq->p_pool + RX_PAGE_SIZE - 1) & ~(uintptr_t)(RX_PAGE_SIZE - 1));
+    for (size_t i = 0; i < pool_size; i++) {
+        p_rxq->p_free_buffers[i] = p_page + RX_HEADROOM;
+        p_page += RX_PAGE_SIZE;
+    }
+    p_rxq->pool_size = pool_size;
+    p_rxq->num_free_buffers = pool_size;
+    return E_OK;
+}
+
+bool virtio_net::is_rx_buffer(const rx_queue *p_rxq, const void *p_data) const
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(p_data);
+    return nullptr != p_rxq->p_pool && p >= p_rxq->p_pool && p < p_rxq->p_pool + (p_rxq->pool_size + 1) * RX_PAGE_SIZE;
+}
+
+void virtio_net::recycle_rx_buffer(rx_queue *p_rxq, void *buf)
+{
+    // Straight back to the ring while it is short of buffers, the pool keeps the rest
+    auto flags = arch_irq_save();
+    const bool to_ring = p_rxq->num_buffers < rx_ring_size_;
+    if (to_ring) {
+        p_rxq->num_buffers++;
+    }
+    arch_irq_restore(flags);
+    if (to_ring && E_OK == virtq_send_buffer(p_rxq->vq, buf, rx_buffer_size_, true)) {
+        p_rxq->pool_recycled++;
+        return;
+    }
+    flags = arch_irq_save();
+    if (to_ring) {
+        p_rxq->num_buffers--;
+    }
+    p_rxq->p_free_buffers[p_rxq->num_free_buffers++] = (uint8_t *)buf;
+    arch_irq_restore(flags);
 }
 
 void virtio_net::rx_handler(void *ctx, void *data_ctx, void *data, size_t size)
 {
     (void)data_ctx;
-    virtio_net *p_this = (virtio_net *)ctx;
-    if (p_this->rx_packet_queue_.full()) {
+    rx_queue *p_rxq = (rx_queue *)ctx;
+    virtio_net *p_dev = p_rxq->p_dev;
+    const auto skb_free_func = [] (void *buf, size_t size, void *ctx) {
+        (void)size;
+        // Return buffer to the rx queue it came from
+        rx_queue *p_rxq = (rx_queue *)ctx;
+        p_rxq->p_dev->recycle_rx_buffer(p_rxq, buf);
+    };
+    // Called by virtq_poll() in rx_thread()
+    auto flags = arch_irq_save();
+    p_rxq->num_buffers--;
+    arch_irq_restore(flags);
+    // Length written by the device, so socket buffers and the filter see the frame and nothing after it
+    size = std::min(size, p_dev->rx_buffer_size_);
+
+    if (0 != p_rxq->merge_remaining) {
+        // Continuation of a packet spread over several buffers, dropped if its copy wasn't allocated
+        if (nullptr != p_rxq->p_merge) {
+            memcpy(p_rxq->p_merge + p_rxq->merge_size, data, size);
+            p_rxq->merge_size += size;
+        }
+        p_dev->recycle_rx_buffer(p_rxq, data);
+        if (0 == --p_rxq->merge_remaining && nullptr != p_rxq->p_merge) {
+            net::sockbuf *skb = new net::sockbuf(p_rxq->p_merge, p_rxq->merge_size, nullptr, nullptr);
+            p_rxq->p_merge = nullptr;
+            p_dev->rx_merged_packets_++;
+            if (!p_dev->filter_rx(p_rxq, skb)) {
+                p_dev->handle_rx(p_rxq, skb);
+            }
+        }
         return;
     }
-    const auto skb_free_func = [] (void *buf, size_t size, void *ctx) {
-        // Return buffer to the rx queue
-        virtio_net *p_this = (virtio_net *)ctx;
-        auto flags = arch_irq_save();
-        const bool free_needed = p_this->num_rx_buffers_ > RX_QUEUE_SIZE;
-        if (free_needed) {
-            otrix::free(buf);
+
+    const virtio_net_hdr *v_hdr = (const virtio_net_hdr *)data;
+    const uint16_t num_buffers = (p_dev->features() & (1ull << VIRTIO_NET_F_MRG_RXBUF)) ? v_hdr->num_buffers : 1;
+    if (num_buffers > 1) {
+        // Stack parses packets linearly, so the buffers are copied into one and go back to the ring
+        // while the rest of the packet arrives
+        p_rxq->p_merge = (uint8_t *)otrix::alloc(num_buffers * p_dev->rx_buffer_size_);
+        p_rxq->merge_remaining = num_buffers - 1;
+        p_rxq->merge_size = 0;
+        if (nullptr != p_rxq->p_merge) {
+            memcpy(p_rxq->p_merge, data, size);
+            p_rxq->merge_size = size;
+        } else {
+            p_dev->rx_merge_drops_++;
         }
-        arch_irq_restore(flags);
-        if (!free_needed) {
-            p_this->virtq_send_buffer(p_this->rx_q_, buf, size, true);
-            p_this->num_rx_buffers_++;
+        p_dev->recycle_rx_buffer(p_rxq, data);
+        return;
+    }
+
+    // Single buffer packet is passed up as zero-copy socket buffer placed in the buffer headroom.
+    // Pages pinned by the stack (e.g. in socket receive queues) are not available to the ring, so once
+    // most spare pages are pinned frames are copied and the page goes straight back.
+    net::sockbuf *skb = nullptr;
+    if (p_rxq->num_free_buffers < p_dev->rx_ring_size_ / 2) {
+        uint8_t *p_copy = (uint8_t *)otrix::alloc(size);
+        if (nullptr != p_copy) {
+            memcpy(p_copy, data, size);
+            p_dev->recycle_rx_buffer(p_rxq, data);
+            p_rxq->pool_copied++;
+            skb = new net::sockbuf(p_copy, size, nullptr, nullptr);
+            if (nullptr == skb) {
+                otrix::free(p_copy);
+                return;
+            }
         }
-    };
-    // Create zero-copy socket buffer
-    // TODO: get rid of memory allocation in IRQ handler
-    p_this->num_rx_buffers_--;
-    net::sockbuf *skb = new net::sockbuf((uint8_t *)data, size, skb_free_func, p_this);
+    }
     if (nullptr == skb) {
+        skb = new ((uint8_t *)data - RX_HEADROOM) net::sockbuf((uint8_t *)data, size, skb_free_func, p_rxq);
+    }
+    if (!p_dev->filter_rx(p_rxq, skb)) {
+        p_dev->handle_rx(p_rxq, skb);
+    }
+}
+
+bool virtio_net::filter_rx(rx_queue *p_rxq, net::sockbuf *skb)
+{
+    if (packet_filter_.empty() || skb->size() <= net_hdr_size_) {
+        return false;
+    }
+    uint8_t *p_buf = reinterpret_cast<uint8_t *>(skb->data());
+    switch (packet_filter_.run(p_buf + net_hdr_size_, skb->size() - net_hdr_size_)) {
+    case net::filter_action::drop:
+        delete skb;
+        return true;
+    case net::filter_action::tx:
+        tx_bounce(p_rxq, skb);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void virtio_net::tx_bounce(rx_queue *p_rxq, net::sockbuf *skb)
+{
+    // RX and TX headers share the layout, so the received frame goes out as is, with the length
+    // the device wrote. Frames coalesced by the host, or with a partial checksum the device
+    // won't complete, are dropped.
+    virtio_net_hdr *v_hdr = reinterpret_cast<virtio_net_hdr *>(skb->data());
+    const bool needs_csum = v_hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    if (VIRTIO_NET_HDR_GSO_NONE != v_hdr->gso_type || (needs_csum && !(features() & (1ull << VIRTIO_NET_F_CSUM)))) {
+        delete skb;
         return;
     }
-    if (!p_this->rx_packet_queue_.write(&skb)) {
-        // Most likely impossible, because interrupt nesting is disabled
+    v_hdr->flags = needs_csum ? VIRTIO_NET_HDR_F_NEEDS_CSUM : 0;
+    v_hdr->hdr_len = 0;
+    v_hdr->gso_size = 0;
+    if (sizeof(virtio_net_hdr) == net_hdr_size_) {
+        v_hdr->num_buffers = 0;
+    }
+
+    // Queue of the same pair, its completion returns the RX buffer
+    tx_queue *p_txq = &tx_q_[p_rxq->index];
+    reclaim_tx(p_txq, tx_reclaim_budget_);
+    if (1 != tx_submit(p_txq, &skb, 1, 0)) {
         delete skb;
     }
 }
 
-void virtio_net::rx_thread()
+void virtio_net::handle_rx(rx_queue *p_rxq, net::sockbuf *skb)
+{
+    using namespace net;
+    skb->add_parsed_header(net_hdr_size_, sockbuf_header_t::virtio);
+    skb->add_parsed_header(sizeof(ethernet_hdr), sockbuf_header_t::ethernet);
+    // Partial checksum comes from the host itself and is as good as a verified one for local delivery
+    const virtio_net_hdr *v_hdr = (const virtio_net_hdr *)skb->header(sockbuf_header_t::virtio);
+    if (v_hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        skb->set_csum_valid(true);
+    }
+    const ethernet_hdr *e_hdr = (const ethernet_hdr *)skb->header(sockbuf_header_t::ethernet);
+    const mac_t broadcast_mac = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    if (!rx_filter_on_device_ && 0 != memcmp(e_hdr->dmac, broadcast_mac, sizeof(e_hdr->dmac)) &&
+        0 != memcmp(e_hdr->dmac, addr_, sizeof(e_hdr->dmac)))
+    {
+        rx_filter_drops_++;
+        delete skb;
+        return;
+    }
+    p_rxq->gro.receive(skb);
+}
+
+void virtio_net::deliver_rx(net::sockbuf *skb)
 {
     using namespace net;
+    const ethernet_hdr *e_hdr = (const ethernet_hdr *)skb->header(sockbuf_header_t::ethernet);
+    for (const auto handler : rx_handlers_) {
+        if (std::get<0>(handler) == (ethertype)htons(e_hdr->ethertype)) {
+            std::get<1>(handler)(skb, std::get<2>(handler));
+        }
+    }
+
+    delete skb;
+}
+
+void virtio_net::rx_thread(rx_queue *p_rxq)
+{
     immediate_console::print("virtio-net rx thread started\n");
 
-    for (int i = 0; i < 16; i++) {
-        void *buf = otrix::alloc(MTU + sizeof(virtio_net_hdr));
-        // TODO: destroy thread and free buffers in virtio_net desctructor
-        virtq_send_buffer(rx_q_, buf, MTU + sizeof(virtio_net_hdr), true);
+    // TODO: destroy thread and free buffers in virtio_net desctructor
+    refill_rx(p_rxq);
+    while (1) {
+        p_rxq->poll_event.take();
         auto flags = arch_irq_save();
-        num_rx_buffers_++;
+        if (0 != num_busy_pollers_) {
+            // Busy pollers process the queue meanwhile, the last one to leave gives the event back
+            p_rxq->deferred = true;
+            arch_irq_restore(flags);
+            continue;
+        }
+        p_rxq->processing = true;
         arch_irq_restore(flags);
+
+        // Packets are processed in budgets with RX interrupts disabled,
+        // other threads get a chance to run between budgets
+        while (!virtq_poll(p_rxq->vq, rx_budget_)) {
+            // Segments held by GRO don't wait for the next batch
+            p_rxq->gro.flush();
+            refill_rx(p_rxq);
+            scheduler::get().schedule();
+        }
+        p_rxq->gro.flush();
+        // Allocate additional buffers to keep RX populated
+        refill_rx(p_rxq);
+        p_rxq->processing = false;
     }
-    while (1) {
-        sockbuf *skb = nullptr;
-        rx_packet_queue_.read(&skb, -1);
-        skb->add_parsed_header(sizeof(virtio_net_hdr), sockbuf_header_t::virtio);
-        skb->add_parsed_header(sizeof(ethernet_hdr), sockbuf_header_t::ethernet);
-        const ethernet_hdr *e_hdr = (const ethernet_hdr *)skb->header(sockbuf_header_t::ethernet);
-        const mac_t broadcast_mac = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
-        if (0 != memcmp(e_hdr->dmac, broadcast_mac, sizeof(e_hdr->dmac)) &&
-            0 != memcmp(e_hdr->dmac, addr_, sizeof(e_hdr->dmac)))
-        {
-            delete skb;
+}
+
+bool virtio_net::busy_poll_begin()
+{
+    auto flags = arch_irq_save();
+    num_busy_pollers_++;
+    arch_irq_restore(flags);
+    return true;
+}
+
+size_t virtio_net::busy_poll(size_t budget)
+{
+    size_t num_frames = 0;
+    for (size_t i = 0; i < num_queue_pairs_; i++) {
+        rx_queue *p_rxq = rx_q_[i];
+        auto flags = arch_irq_save();
+        if (nullptr == p_rxq || nullptr == p_rxq->vq || p_rxq->processing) {
+            // Queue failed to initialize or is being processed by another thread
+            arch_irq_restore(flags);
             continue;
         }
+        p_rxq->processing = true;
+        arch_irq_restore(flags);
 
-        for (const auto handler : rx_handlers_) {
-            if (std::get<0>(handler) == (ethertype)htons(e_hdr->ethertype)) {
-                std::get<1>(handler)(skb, std::get<2>(handler));
-            }
+        // rx_handler() runs here, so the whole stack up to the socket runs in the calling thread
+        const size_t num_used = virtq_busy_poll(p_rxq->vq, budget);
+        if (0 != num_used) {
+            p_rxq->gro.flush();
+            refill_rx(p_rxq);
+            num_frames += num_used;
         }
+        p_rxq->processing = false;
+    }
+    rx_busy_polls_++;
+    rx_busy_poll_frames_ += num_frames;
+    return num_frames;
+}
 
-        delete skb;
+void virtio_net::busy_poll_end()
+{
+    auto flags = arch_irq_save();
+    if (0 == --num_busy_pollers_) {
+        for (size_t i = 0; i < num_queue_pairs_; i++) {
+            rx_queue *p_rxq = rx_q_[i];
+            if (nullptr == p_rxq || nullptr == p_rxq->vq) {
+                continue;
+            }
+            if (p_rxq->deferred) {
+                // rx_thread() re-enables the interrupts once it finds the queue empty
+                p_rxq->deferred = false;
+                p_rxq->poll_event.give();
+            } else if (!p_rxq->processing) {
+                // Queues held by rx_thread() get their interrupts back the same way
+                virtq_busy_poll_end(p_rxq->vq);
+            }
+        }
+    }
+    arch_irq_restore(flags);
+}
 
-        // Allocate additional buffers to keep RX populated
+void virtio_net::refill_rx(rx_queue *p_rxq)
+{
+    // All missing buffers are made available with a single index update and notification
+    virtq_batch batch;
+    virtq_batch_begin(p_rxq->vq, &batch, rx_ring_size_);
+    while (p_rxq->num_buffers < rx_ring_size_) {
         auto flags = arch_irq_save();
-        while (num_rx_buffers_ < RX_QUEUE_SIZE) {
-            void *buf = otrix::alloc(MTU + sizeof(virtio_net_hdr));
-            virtq_send_buffer(rx_q_, buf, MTU + sizeof(virtio_net_hdr), true);
-            num_rx_buffers_++;
+        if (0 == p_rxq->num_free_buffers) {
+            // The rest of the pool is held by the stack
+            p_rxq->pool_exhausted++;
+            arch_irq_restore(flags);
+            break;
         }
+        uint8_t *buf = p_rxq->p_free_buffers[--p_rxq->num_free_buffers];
         arch_irq_restore(flags);
+        const virtq_iovec iov = { buf, (uint32_t)rx_buffer_size_ };
+        if (E_OK != virtq_batch_add(&batch, &iov, 0, 1)) {
+            flags = arch_irq_save();
+            p_rxq->p_free_buffers[p_rxq->num_free_buffers++] = buf;
+            arch_irq_restore(flags);
+            break;
+        }
+        p_rxq->num_buffers++;
     }
+    virtq_batch_publish(&batch);
 }
 
 } // namespace otrix::dev
+
+// Minimal frame to self with a local experimental ethertype
+static uint8_t kbench_frame[sizeof(otrix::dev::virtio_net_hdr) + sizeof(otrix::net::ethernet_hdr) + 46];
+
+static size_t kbench_prepare_frame(otrix::dev::virtio_net *dev)
+{
+    const size_t headers_size = dev->headers_size();
+    auto *e_hdr = reinterpret_cast<otrix::net::ethernet_hdr *>(kbench_frame + headers_size - sizeof(otrix::net::ethernet_hdr));
+    dev->get_mac(&e_hdr->dmac);
+    dev->get_mac(&e_hdr->smac);
+    e_hdr->ethertype = htons(0x88b5);
+    return headers_size + 46;
+}
+
+KBENCH(virtq_send_buffer)
+{
+    using namespace otrix::dev;
+    virtio_net *dev = kbench_dev;
+    if (nullptr == dev) {
+        return;
+    }
+
+    const size_t frame_size = kbench_prepare_frame(dev);
+    while (s.run()) {
+        if (E_OK != dev->virtq_send_buffer(dev->tx_q_[0].vq, kbench_frame, frame_size, false)) {
+            // TX queue is full, let the device drain it
+            s.discard();
+            otrix::scheduler::get().sleep(1);
+        }
+    }
+    dev->print_vq_stats(dev->tx_q_[0].vq);
+}
+
+// Frames are submitted in bursts with one notification decision per burst
+KBENCH(virtq_send_burst)
+{
+    using namespace otrix::dev;
+    virtio_net *dev = kbench_dev;
+    if (nullptr == dev) {
+        return;
+    }
+
+    constexpr size_t BURST_SIZE = 16;
+    const size_t frame_size = kbench_prepare_frame(dev);
+    while (s.run()) {
+        virtio_net::virtq_batch batch;
+        if (dev->virtq_batch_begin(dev->tx_q_[0].vq, &batch, BURST_SIZE) < BURST_SIZE) {
+            dev->virtq_batch_publish(&batch);
+            s.discard();
+            otrix::scheduler::get().sleep(1);
+            continue;
+        }
+        const virtio_net::virtq_iovec iov = { kbench_frame, (uint32_t)frame_size };
+        for (size_t i = 0; i < BURST_SIZE; i++) {
+            dev->virtq_batch_add(&batch, &iov, 1, 0);
+        }
+        dev->virtq_batch_publish(&batch);
+    }
+    dev->print_vq_stats(dev->tx_q_[0].vq);
+}
+
+// Round trip through the device: submit a frame and spin until its completion interrupt.
+// Split and packed rings are compared by booting with virtio.packed=0 and virtio.packed=1.
+KBENCH(virtq_tx_completion)
+{
+    using namespace otrix::dev;
+    virtio_net *dev = kbench_dev;
+    if (nullptr == dev) {
+        return;
+    }
+
+    const size_t frame_size = kbench_prepare_frame(dev);
+    volatile uint64_t *p_completions = &dev->tx_q_[0].vq->stats.completions;
+    while (s.run()) {
+        const uint64_t completions = *p_completions;
+        if (E_OK != dev->virtq_send_buffer(dev->tx_q_[0].vq, kbench_frame, frame_size, false)) {
+            s.discard();
+            otrix::scheduler::get().sleep(1);
+            continue;
+        }
+        while (*p_completions == completions) {
+            asm volatile("pause");
+        }
+    }
+    dev->print_vq_stats(dev->tx_q_[0].vq);
+}
@@ -0,0 +1,35 @@
+#include "kernel/boot_info.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include "kernel/cmdline.hpp"
+
+namespace otrix::boot_info
+{
+
+// Large enough for ACPI 2.0+ RSDP
+static constexpr auto RSDP_MAX_SIZE = 36;
+static uint8_t rsdp_buffer[RSDP_MAX_SIZE];
+static bool rsdp_valid;
+
+bool fast_boot()
+{
+    return cmdline::find("fastboot");
+}
+
+void set_acpi_rsdp(const void *rsdp, size_t size)
+{
+    if (size > sizeof(rsdp_buffer)) {
+        size = sizeof(rsdp_buffer);
+    }
+    memset(rsdp_buffer, 0, sizeof(rsdp_buffer));
+    memcpy(rsdp_buffer, rsdp, size);
+    rsdp_valid = true;
+}
+
+const void *acpi_rsdp()
+{
+    return rsdp_valid ? rsdp_buffer : nullptr;
+}
+
+} // namespace otrix::boot_info
@@ -0,0 +1,76 @@
+#include "kernel/boot_trace.hpp"
+
+#include <cstdint>
+#include "arch/asm.h"
+#include "arch/clock.hpp"
+#include "otrix/immediate_console.hpp"
+
+namespace otrix::boot_trace
+{
+
+static constexpr auto MAX_TRACEPOINTS = 32;
+
+struct tracepoint_t
+{
+    const char *phase;
+    uint64_t tsc;
+};
+
+static tracepoint_t tracepoints[MAX_TRACEPOINTS];
+static size_t num_tracepoints;
+static size_t pending_phases;
+
+void mark(const char *phase)
+{
+    const uint64_t tsc = arch_tsc();
+    auto flags = arch_irq_save();
+    if (num_tracepoints < MAX_TRACEPOINTS) {
+        tracepoints[num_tracepoints].phase = phase;
+        tracepoints[num_tracepoints].tsc = tsc;
+        num_tracepoints++;
+    }
+    arch_irq_restore(flags);
+}
+
+void expect(size_t num_phases)
+{
+    auto flags = arch_irq_save();
+    pending_phases += num_phases;
+    arch_irq_restore(flags);
+}
+
+void complete(const char *phase)
+{
+    mark(phase);
+    auto flags = arch_irq_save();
+    const bool done = pending_phases > 0 && 0 == --pending_phases;
+    arch_irq_restore(flags);
+    if (done) {
+        print_summary();
+    }
+}
+
+void print_summary()
+{
+    if (0 == num_tracepoints) {
+        return;
+    }
+
+    // The first tracepoint is the reference
+    const uint64_t tsc_khz = arch::clock::tsc_khz();
+    const uint64_t start = tracepoints[0].tsc;
+    uint64_t prev = start;
+    immediate_console::print("Boot trace (%s):\n", 0 != tsc_khz ? "us" : "cycles");
+    for (size_t i = 1; i < num_tracepoints; i++) {
+        uint64_t delta = tracepoints[i].tsc - prev;
+        uint64_t total = tracepoints[i].tsc - start;
+        if (0 != tsc_khz) {
+            delta = delta * 1000 / tsc_khz;
+            total = total * 1000 / tsc_khz;
+        }
+        immediate_console::print("  %-16s %10lu %10lu\n", tracepoints[i].phase, delta, total);
+        prev = tracepoints[i].tsc;
+    }
+}
+
+} // namespace otrix::boot_trace
@@ -0,0 +1,64 @@
+#include "kernel/cmdline.hpp"
+
+#include <cstring>
+
+namespace otrix::cmdline
+{
+
+static constexpr auto CMDLINE_MAX_SIZE = 512;
+static char cmdline_buffer[CMDLINE_MAX_SIZE];
+
+void init(const char *cmdline)
+{
+    if (nullptr == cmdline) {
+        cmdline_buffer[0] = '\0';
+        return;
+    }
+    strncpy(cmdline_buffer, cmdline, sizeof(cmdline_buffer) - 1);
+    cmdline_buffer[sizeof(cmdline_buffer) - 1] = '\0';
+}
+
+const char *get()
+{
+    return cmdline_buffer;
+}
+
+bool find(const char *name, const char **p_value, size_t *p_value_len)
+{
+    const size_t name_len = strlen(name);
+    const char *p = cmdline_buffer;
+    while ('\0' != *p) {
+        while (' ' == *p) {
+            p++;
+        }
+        const char *token = p;
+        while ('\0' != *p && ' ' != *p) {
+            p++;
+        }
+        const size_t token_len = p - token;
+        if (token_len < name_len || 0 != strncmp(token, name, name_len)) {
+            continue;
+        }
+        if (token_len == name_len) {
+            if (nullptr != p_value) {
+                *p_value = nullptr;
+            }
+            if (nullptr != p_value_len) {
+                *p_value_len = 0;
+            }
+            return true;
+        }
+        if ('=' == token[name_len]) {
+            if (nullptr != p_value) {
+                *p_value = token + name_len + 1;
+            }
+            if (nullptr != p_value_len) {
+                *p_value_len = token_len - name_len - 1;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace otrix::cmdline
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+
+namespace otrix::boot_info
+{
+
+/**
+ * Fast boot mode is enabled with "fastboot" boot option: debug-only work
+ * (e.g. heap poisoning) is skipped and devices are initialized in parallel threads.
+ */
+bool fast_boot();
+
+/**
+ * Store copy of ACPI RSDP provided by the bootloader.
+ */
+void set_acpi_rsdp(const void *rsdp, size_t size);
+
+/**
+ * Retrieve ACPI RSDP provided by the bootloader.
+ *
+ * @retval nullptr The bootloader did not provide RSDP, it has to be searched for in BIOS memory.
+ */
+const void *acpi_rsdp();
+
+} // namespace otrix::boot_info
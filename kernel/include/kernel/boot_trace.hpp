@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+
+namespace otrix::boot_trace
+{
+
+/**
+ * Record TSC timestamp at the end of a boot phase.
+ * Phase duration is measured from the previous tracepoint.
+ *
+ * @param[in] phase Phase name, must be a string literal.
+ */
+void mark(const char *phase);
+
+/**
+ * Declare number of boot phases which complete asynchronously (e.g. in device init threads).
+ * The summary is printed once all of them are completed.
+ */
+void expect(size_t num_phases);
+
+/**
+ * Record completion of an asynchronous phase declared with expect().
+ */
+void complete(const char *phase);
+
+/**
+ * Print all tracepoints with their durations.
+ */
+void print_summary();
+
+} // namespace otrix::boot_trace
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+
+namespace otrix::cmdline
+{
+
+/**
+ * Store the boot command line (e.g. taken from the multiboot2 cmdline tag).
+ * The string is copied, so the source memory can be reused afterwards.
+ */
+void init(const char *cmdline);
+
+/**
+ * Retrieve the whole command line, empty string if none was provided.
+ */
+const char *get();
+
+/**
+ * Find option given either as "name" or "name=value".
+ * Options are separated by spaces.
+ *
+ * @param[in] name Option name.
+ * @param[out] p_value If not nullptr, receives pointer to the value (not NUL-terminated)
+ *                     or nullptr for an option without value.
+ * @param[out] p_value_len If not nullptr, receives length of the value.
+ *
+ * @return True if the option is present.
+ */
+bool find(const char *name, const char **p_value = nullptr, size_t *p_value_len = nullptr);
+
+} // namespace otrix::cmdline
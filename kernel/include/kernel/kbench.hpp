@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "common/list.h"
+
+namespace otrix::kbench
+{
+
+static constexpr size_t DEFAULT_WARMUP = 100;
+static constexpr size_t DEFAULT_REPETITIONS = 1000;
+
+/**
+ * Iteration state passed to a benchmark body.
+ *
+ * Typical usage:
+ *
+ *     KBENCH(foo)
+ *     {
+ *         while (s.run()) {
+ *             foo();
+ *         }
+ *     }
+ *
+ * Every call to run() closes the previous iteration and records its duration
+ * in TSC cycles (minus loop overhead), unless it belongs to the warmup phase
+ * or was discarded.
+ */
+class state
+{
+public:
+    state(uint64_t *samples, size_t warmup, size_t repetitions, uint64_t overhead);
+
+    state(const state &other) = delete;
+    state &operator=(const state &other) = delete;
+
+    /**
+     * Finish previous iteration and start a new one.
+     *
+     * @retval false Enough samples were collected, the benchmark should return.
+     */
+    bool run();
+
+    /**
+     * Do not record current iteration (e.g. resource temporarily unavailable).
+     */
+    void discard()
+    {
+        discard_ = true;
+    }
+
+    /**
+     * Record explicitly measured value for the current iteration instead of its duration
+     * (e.g. when the interesting interval ends in another context).
+     */
+    void record(uint64_t cycles)
+    {
+        recorded_ = cycles;
+        has_recorded_ = true;
+    }
+
+    /**
+     * Exclude the code between pause() and resume() from the current iteration.
+     */
+    void pause();
+    void resume();
+
+    size_t num_samples() const
+    {
+        return num_samples_;
+    }
+
+    const uint64_t *samples() const
+    {
+        return samples_;
+    }
+
+private:
+    uint64_t *samples_;
+    size_t num_samples_;
+    size_t warmup_;
+    size_t repetitions_;
+    size_t iterations_;
+    size_t max_iterations_; // Bound for benchmarks discarding most iterations
+    uint64_t overhead_;
+    uint64_t start_tsc_;
+    uint64_t pause_tsc_;
+    uint64_t paused_;
+    uint64_t recorded_;
+    bool has_recorded_;
+    bool discard_;
+};
+
+using bench_func_t = void (*)(state &s);
+
+/**
+ * Benchmark descriptor, instantiated by KBENCH().
+ * Registration happens during static initialization, so it must not allocate.
+ */
+class registration
+{
+public:
+    registration(const char *name, bench_func_t func);
+
+    registration(const registration &other) = delete;
+    registration &operator=(const registration &other) = delete;
+
+    const char *name() const
+    {
+        return name_;
+    }
+
+    bench_func_t func() const
+    {
+        return func_;
+    }
+
+private:
+    intrusive_list list_node_; // Entry in the list of all benchmarks
+    const char *name_;
+    bench_func_t func_;
+
+    friend void run(const char *filter, size_t filter_len);
+};
+
+/**
+ * Run registered benchmarks and print results to the console.
+ *
+ * @param[in] filter Comma-separated list of benchmark names, nullptr to run all.
+ * @param[in] filter_len Length of filter.
+ */
+void run(const char *filter = nullptr, size_t filter_len = 0);
+
+/**
+ * Start benchmark thread if "kbench" (all benchmarks) or "kbench=name1,name2"
+ * boot option is present. Expected to be called once the kernel is initialized.
+ */
+void start();
+
+/**
+ * Prevent the compiler from optimizing away computation of the value.
+ */
+template<typename T>
+static inline void do_not_optimize(const T &value)
+{
+    asm volatile("" : : "g"(value) : "memory");
+}
+
+} // namespace otrix::kbench
+
+/**
+ * Define and register benchmark. Must be used at global scope,
+ * the body receives otrix::kbench::state &s.
+ *
+ * Note that objects from static libraries are only linked if referenced,
+ * so benchmarks should live in translation units which are linked anyway.
+ */
+#define KBENCH(name) \
+    namespace otrix::kbench { void bench_##name(state &s); } \
+    static otrix::kbench::registration kbench_registration_##name(#name, otrix::kbench::bench_##name); \
+    void otrix::kbench::bench_##name(otrix::kbench::state &s)
@@ -19,6 +19,8 @@ namespace otrix
 
 using kthread_entry = void(*)(void *);
 
+class mutex;
+
 enum kthread_state {
     KTHREAD_STATE_ZOMBIE,  /**< Not present in any of the thread queues **/
     KTHREAD_STATE_ACTIVE,  /**< Current thread **/
@@ -62,10 +64,36 @@ public:
         return &node_;
     }
 
+    /**
+     * Effective priority, which may be raised above base_priority()
+     * while the thread holds a mutex with higher-priority waiters.
+     */
     int priority() const {
         return priority_;
     }
 
+    int base_priority() const {
+        return base_priority_;
+    }
+
+    /**
+     * Mutex the thread is currently waiting for, if any.
+     */
+    mutex *blocked_on() const {
+        return blocked_on_;
+    }
+
+    void set_blocked_on(mutex *m) {
+        blocked_on_ = m;
+    }
+
+    /**
+     * List of priority-inheriting mutexes owned by the thread.
+     */
+    intrusive_list *&owned_mutexes() {
+        return owned_mutexes_;
+    }
+
     arch_context *context() {
         return &context_;
     }
@@ -74,6 +102,17 @@ public:
         return name_;
     }
 
+    struct cpu_stats_t
+    {
+        uint64_t run_tsc;  /**< TSC ticks the thread was running **/
+        uint64_t steal_ns; /**< Time the host did not run the vCPU while the thread was running **/
+        uint64_t switches; /**< Number of times the thread was switched in **/
+    };
+
+    const cpu_stats_t &cpu_stats() const {
+        return cpu_stats_;
+    }
+
 private:
     arch_context context_;
     uint64_t *stack_;
@@ -81,7 +120,13 @@ private:
     kthread_entry entry_;
     node_t node_;
     int priority_;
+    int base_priority_;
+    mutex *blocked_on_;
+    intrusive_list *owned_mutexes_;
     const char *name_;
+    cpu_stats_t cpu_stats_;
+
+    friend class scheduler;
 };
 
 class scheduler
@@ -116,6 +161,12 @@ public:
      */
     kerror_t wake(kthread *thread);
 
+    /**
+     * Change effective priority of the thread,
+     * moving it to the matching runnable or blocked queue.
+     */
+    kerror_t set_priority(kthread *thread, int priority);
+
     /**
      * Retrieve the currently running thread.
      */
@@ -128,6 +179,11 @@ public:
      */
     kerror_t schedule();
 
+    /**
+     * Print CPU statistics of all threads known to the scheduler.
+     */
+    void print_thread_stats();
+
     /**
      * Disable task switching.
      */
@@ -141,16 +197,23 @@ public:
 private:
     scheduler();
 
-    void setup_timer();
+    void enqueue_blocked(kthread *thread);
 
     void handle_timer_irq();
 
+    // Charge time since the previous switch to the outgoing thread
+    void account_switch(kthread *prev, kthread *next);
+
+public:
     static constexpr auto NUM_PRIORITIES = 10;
+
+private:
     intrusive_list *runnable_queues_[NUM_PRIORITIES];
     intrusive_list *blocked_queues_[NUM_PRIORITIES];
     intrusive_list *current_thread_;
     bool need_resched_;
-    uint64_t nearest_tsc_deadline_;
+    uint64_t last_switch_tsc_;
+    uint64_t last_switch_steal_ns_;
 
     kthread idle_thread_;
     int preempt_disable_;
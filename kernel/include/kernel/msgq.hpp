@@ -37,6 +37,10 @@ public:
         return sem_.count() == (int)size_;
     }
 
+    bool empty() const {
+        return sem_.count() == 0;
+    }
+
 private:
     uint8_t *storage_;
     size_t read_p_;
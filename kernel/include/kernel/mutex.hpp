@@ -1,5 +1,6 @@
 #pragma once
 
+#include "common/list.h"
 #include "kernel/waitq.hpp"
 
 namespace otrix
@@ -7,10 +8,17 @@ namespace otrix
 
 class kthread;
 
+enum class mutex_protocol
+{
+    none,    /**< Plain sleeping lock **/
+    inherit, /**< Owner inherits priority of the highest-priority waiter **/
+    ceiling, /**< Owner runs at the ceiling priority while holding the lock **/
+};
+
 class mutex
 {
 public:
-    mutex();
+    mutex(mutex_protocol protocol = mutex_protocol::inherit, int ceiling = 0);
     ~mutex();
 
     mutex(const mutex &other) = delete;
@@ -22,9 +30,64 @@ public:
     bool lock(uint64_t timeout_ms = -1);
     void unlock();
 
+    kthread *owner() const
+    {
+        return owner_;
+    }
+
+    struct stats_t
+    {
+        uint64_t contended;    /**< Number of lock() calls which had to wait **/
+        uint64_t boosts;       /**< Number of times the owner priority was raised **/
+        uint64_t boosted_tsc;  /**< Total TSC ticks owners spent boosted **/
+        uint64_t max_boost_tsc;/**< Longest single boost in TSC ticks **/
+    };
+
+    const stats_t &stats() const
+    {
+        return stats_;
+    }
+
+    /**
+     * Statistics accumulated over all mutexes.
+     */
+    static const stats_t &global_stats()
+    {
+        return global_stats_;
+    }
+
+    static void print_stats();
+
 private:
+    void acquire(kthread *thread);
+    void release(kthread *thread);
+    void boost(kthread *thread, int priority);
+    void inherit_priority(int priority);
+
+    static void update_priority(kthread *thread);
+
+    struct node_t
+    {
+        node_t(mutex *m): p_mutex(m)
+        {
+            intrusive_list_init(&list_node);
+        }
+        intrusive_list list_node; // Entry in the owner's list of held mutexes
+        mutex *p_mutex;
+    };
+
     waitq waiting_queue_;
     kthread *owner_;
+    mutex_protocol protocol_;
+    int ceiling_;
+    node_t node_;
+    uint64_t boost_start_tsc_; // Non-zero while the owner is boosted because of this mutex
+
+    stats_t stats_;
+    static stats_t global_stats_;
+
+    // Bound for transitive priority propagation through chains of mutexes
+    static constexpr auto MAX_INHERITANCE_DEPTH = 8;
 };
 
 } // namespace otrix
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include "common/list.h"
+
+namespace otrix
+{
+
+/**
+ * Parse unsigned integer in decimal or hexadecimal (0x prefix) notation.
+ */
+bool tunable_parse_uint(const char *str, size_t len, uint64_t *p_out);
+
+template<typename T>
+static inline bool tunable_parse(const char *str, size_t len, T *p_out)
+{
+    static_assert(std::is_integral_v<T>, "Tunables of non-integral types require a custom parser");
+    uint64_t value;
+    if (!tunable_parse_uint(str, len, &value) || value > (uint64_t)std::numeric_limits<T>::max()) {
+        return false;
+    }
+    *p_out = static_cast<T>(value);
+    return true;
+}
+
+/**
+ * Boolean option is either given without value ("name") or as "name=0"/"name=1".
+ */
+template<>
+inline bool tunable_parse<bool>(const char *str, size_t len, bool *p_out)
+{
+    if (nullptr == str) {
+        *p_out = true;
+        return true;
+    }
+    uint64_t value;
+    if (!tunable_parse_uint(str, len, &value) || value > 1) {
+        return false;
+    }
+    *p_out = (1 == value);
+    return true;
+}
+
+/**
+ * Registry entry of a value which can be overridden with "name=value" boot option.
+ * Tunables register themselves during static initialization and are parsed
+ * from the command line early in kmain(), so they must be defined at namespace scope.
+ */
+class tunable_base
+{
+public:
+    tunable_base(const tunable_base &other) = delete;
+    tunable_base &operator=(const tunable_base &other) = delete;
+
+    const char *name() const
+    {
+        return name_;
+    }
+
+    /**
+     * Apply boot command line to all registered tunables.
+     */
+    static void init_all();
+
+protected:
+    tunable_base(const char *name);
+    ~tunable_base() = default;
+
+    /**
+     * Parse and validate value, which is nullptr if the option is given without value.
+     *
+     * @retval false Value is malformed or out of range, default is kept.
+     */
+    virtual bool parse(const char *value, size_t len) = 0;
+
+private:
+    struct node_t
+    {
+        intrusive_list list_node; // Entry in the list of all tunables
+        tunable_base *p_tunable;
+    };
+
+    node_t node_;
+    const char *name_;
+};
+
+template<typename T>
+class tunable final: public tunable_base
+{
+public:
+    using parser_t = bool (*)(const char *str, size_t len, T *p_out);
+
+    tunable(const char *name, T default_value,
+            T min = std::numeric_limits<T>::min(), T max = std::numeric_limits<T>::max()):
+        tunable_base(name), value_(default_value), min_(min), max_(max), parser_(tunable_parse<T>)
+    {}
+
+    tunable(const char *name, T default_value, parser_t parser):
+        tunable_base(name), value_(default_value), min_(std::numeric_limits<T>::min()),
+        max_(std::numeric_limits<T>::max()), parser_(parser)
+    {}
+
+    T get() const
+    {
+        return value_;
+    }
+
+    operator T() const
+    {
+        return value_;
+    }
+
+private:
+    bool parse(const char *value, size_t len) override
+    {
+        T parsed;
+        if (!parser_(value, len, &parsed) || parsed < min_ || parsed > max_) {
+            return false;
+        }
+        value_ = parsed;
+        return true;
+    }
+
+    T value_;
+    T min_;
+    T max_;
+    parser_t parser_;
+};
+
+} // namespace otrix
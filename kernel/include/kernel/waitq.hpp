@@ -18,6 +18,20 @@ public:
     void notify_one();
     void notify_all();
 
+    /**
+     * Wake up specific waiting thread.
+     *
+     * @retval false The thread is not waiting on this queue.
+     */
+    bool notify(kthread *thread);
+
+    /**
+     * Retrieve waiting thread with the highest priority.
+     *
+     * @retval nullptr Queue is empty.
+     */
+    kthread *top_waiter() const;
+
     bool empty() const
     {
         return nullptr == wq_;
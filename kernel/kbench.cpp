@@ -0,0 +1,329 @@
+#include "kernel/kbench.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "kernel/alloc.hpp"
+#include "kernel/cmdline.hpp"
+#include "kernel/kthread.hpp"
+#include "kernel/msgq.hpp"
+#include "kernel/mutex.hpp"
+#include "kernel/waitq.hpp"
+#include "arch/asm.h"
+#include "arch/deadline_timer.hpp"
+#include "otrix/immediate_console.hpp"
+
+#define REGISTRATION_PTR(list_ptr) container_of(list_ptr, registration, list_node_)
+
+namespace otrix::kbench
+{
+
+static constexpr auto STACK_SIZE = 64 * 1024 / sizeof(uint64_t);
+static constexpr auto KBENCH_PRIORITY = 1;
+// Iteration bound relative to requested samples for benchmarks which discard iterations
+static constexpr auto MAX_ITERATIONS_FACTOR = 4;
+
+// Zero-initialized before any static constructor runs
+static intrusive_list *registry;
+
+state::state(uint64_t *samples, size_t warmup, size_t repetitions, uint64_t overhead):
+    samples_(samples), num_samples_(0), warmup_(warmup), repetitions_(repetitions), iterations_(0),
+    max_iterations_(warmup + repetitions * MAX_ITERATIONS_FACTOR), overhead_(overhead),
+    start_tsc_(0), pause_tsc_(0), paused_(0), recorded_(0), has_recorded_(false), discard_(false)
+{}
+
+bool state::run()
+{
+    const uint64_t now = arch_tsc();
+    if (discard_) {
+        discard_ = false;
+    } else if (iterations_ > warmup_) {
+        if (has_recorded_) {
+            samples_[num_samples_++] = recorded_;
+        } else {
+            const uint64_t elapsed = now - start_tsc_ - paused_;
+            samples_[num_samples_++] = elapsed > overhead_ ? elapsed - overhead_ : 0;
+        }
+    }
+    has_recorded_ = false;
+
+    if (num_samples_ >= repetitions_ || iterations_ >= max_iterations_) {
+        return false;
+    }
+
+    iterations_++;
+    paused_ = 0;
+    start_tsc_ = arch_tsc();
+    return true;
+}
+
+void state::pause()
+{
+    pause_tsc_ = arch_tsc();
+}
+
+void state::resume()
+{
+    paused_ += arch_tsc() - pause_tsc_;
+}
+
+registration::registration(const char *name, bench_func_t func): name_(name), func_(func)
+{
+    // Keep registration order
+    if (nullptr == registry) {
+        registry = intrusive_list_init(&list_node_);
+    } else {
+        intrusive_list_push_back(registry, &list_node_);
+    }
+}
+
+static bool filter_match(const char *filter, size_t filter_len, const char *name)
+{
+    if (nullptr == filter) {
+        return true;
+    }
+
+    const size_t name_len = strlen(name);
+    const char *end = filter + filter_len;
+    const char *p = filter;
+    while (p < end) {
+        const char *token = p;
+        while (p < end && ',' != *p) {
+            p++;
+        }
+        if ((size_t)(p - token) == name_len && 0 == strncmp(token, name, name_len)) {
+            return true;
+        }
+        p++;
+    }
+    return false;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, size_t pct)
+{
+    return sorted[(count - 1) * pct / 100];
+}
+
+// Cost of the measurement loop itself, subtracted from every sample
+static uint64_t calibrate_overhead(uint64_t *samples)
+{
+    state s(samples, DEFAULT_WARMUP, DEFAULT_REPETITIONS, 0);
+    while (s.run()) {
+    }
+    std::sort(samples, samples + s.num_samples());
+    return percentile(samples, s.num_samples(), 50);
+}
+
+void run(const char *filter, size_t filter_len)
+{
+    uint64_t *samples = new uint64_t[DEFAULT_REPETITIONS];
+    const uint64_t overhead = calibrate_overhead(samples);
+    immediate_console::print("kbench: begin overhead=%lu warmup=%lu repetitions=%lu\n",
+            overhead, DEFAULT_WARMUP, DEFAULT_REPETITIONS);
+
+    intrusive_list *node = registry;
+    while (nullptr != node) {
+        const registration *reg = REGISTRATION_PTR(node);
+        if (filter_match(filter, filter_len, reg->name())) {
+            state s(samples, DEFAULT_WARMUP, DEFAULT_REPETITIONS, overhead);
+            reg->func()(s);
+
+            const size_t count = s.num_samples();
+            if (0 == count) {
+                immediate_console::print("kbench: name=%s samples=0 skipped\n", reg->name());
+            } else {
+                uint64_t sum = 0;
+                for (size_t i = 0; i < count; i++) {
+                    sum += samples[i];
+                }
+                std::sort(samples, samples + count);
+                immediate_console::print("kbench: name=%s samples=%lu unit=cycles min=%lu p50=%lu p90=%lu p99=%lu max=%lu mean=%lu\n",
+                        reg->name(), count, samples[0], percentile(samples, count, 50), percentile(samples, count, 90),
+                        percentile(samples, count, 99), samples[count - 1], sum / count);
+            }
+        }
+        node = node->next;
+        if (node == registry) {
+            break;
+        }
+    }
+
+    immediate_console::print("kbench: end\n");
+    delete[] samples;
+
+    // Counters accumulated by the benchmarks and everything that ran since boot
+    mutex::print_stats();
+    scheduler::get().print_thread_stats();
+    arch::deadline_timer::print_stats();
+}
+
+void start()
+{
+    const char *filter;
+    size_t filter_len;
+    if (!cmdline::find("kbench", &filter, &filter_len)) {
+        return;
+    }
+
+    struct filter_t
+    {
+        const char *str;
+        size_t len;
+    };
+    auto *ctx = new filter_t{filter, filter_len};
+    kthread *thread = new kthread(STACK_SIZE, [] (void *ctx) {
+        auto *filter = reinterpret_cast<filter_t *>(ctx);
+        run(filter->str, filter->len);
+        delete filter;
+        scheduler::get().sleep(KTHREAD_TIMEOUT_INF);
+    }, "kbench", KBENCH_PRIORITY, ctx);
+    scheduler::get().add_thread(thread);
+}
+
+// Partner threads are never destroyed: benchmarks run once per boot
+// and the scheduler has no means to reap a thread.
+static void spawn_partner(kthread_entry entry, void *ctx)
+{
+    const int priority = scheduler::get().get_current_thread()->priority();
+    scheduler::get().add_thread(new kthread(STACK_SIZE, entry, "kbench-partner", priority, ctx));
+}
+
+} // namespace otrix::kbench
+
+using otrix::kbench::do_not_optimize;
+
+KBENCH(kmem_alloc_free_64)
+{
+    while (s.run()) {
+        void *p = otrix::alloc(64);
+        do_not_optimize(p);
+        otrix::free(p);
+    }
+}
+
+KBENCH(kmem_alloc_free_2048)
+{
+    while (s.run()) {
+        void *p = otrix::alloc(2048);
+        do_not_optimize(p);
+        otrix::free(p);
+    }
+}
+
+KBENCH(msgq_round_trip)
+{
+    static constexpr uint64_t STOP = ~0ull;
+    struct ctx_t
+    {
+        otrix::msgq request{1, sizeof(uint64_t)};
+        otrix::msgq reply{1, sizeof(uint64_t)};
+    };
+    auto *ctx = new ctx_t;
+
+    spawn_partner([] (void *p) {
+        auto *ctx = reinterpret_cast<ctx_t *>(p);
+        uint64_t msg = 0;
+        while (ctx->request.read(&msg, KTHREAD_TIMEOUT_INF) && STOP != msg) {
+            ctx->reply.write(&msg);
+        }
+        otrix::scheduler::get().sleep(KTHREAD_TIMEOUT_INF);
+    }, ctx);
+
+    uint64_t msg = 0;
+    while (s.run()) {
+        ctx->request.write(&msg);
+        ctx->reply.read(&msg, KTHREAD_TIMEOUT_INF);
+        msg++;
+    }
+    msg = STOP;
+    ctx->request.write(&msg);
+}
+
+KBENCH(waitq_ping_pong)
+{
+    struct ctx_t
+    {
+        otrix::waitq ping;
+        otrix::waitq pong;
+        bool ping_flag = false;
+        bool pong_flag = false;
+        bool stop = false;
+    };
+    auto *ctx = new ctx_t;
+
+    // Flags are checked with interrupts disabled so that wakeups cannot be lost
+    spawn_partner([] (void *p) {
+        auto *ctx = reinterpret_cast<ctx_t *>(p);
+        auto flags = arch_irq_save();
+        while (true) {
+            while (!ctx->ping_flag) {
+                ctx->ping.wait();
+            }
+            ctx->ping_flag = false;
+            if (ctx->stop) {
+                break;
+            }
+            ctx->pong_flag = true;
+            ctx->pong.notify_one();
+        }
+        arch_irq_restore(flags);
+        otrix::scheduler::get().sleep(KTHREAD_TIMEOUT_INF);
+    }, ctx);
+
+    while (s.run()) {
+        auto flags = arch_irq_save();
+        ctx->ping_flag = true;
+        ctx->ping.notify_one();
+        while (!ctx->pong_flag) {
+            ctx->pong.wait();
+        }
+        ctx->pong_flag = false;
+        arch_irq_restore(flags);
+    }
+
+    auto flags = arch_irq_save();
+    ctx->stop = true;
+    ctx->ping_flag = true;
+    ctx->ping.notify_one();
+    arch_irq_restore(flags);
+}
+
+KBENCH(mutex_uncontended)
+{
+    otrix::mutex m;
+    while (s.run()) {
+        m.lock();
+        m.unlock();
+    }
+}
+
+KBENCH(mutex_contended)
+{
+    struct ctx_t
+    {
+        otrix::mutex m;
+        volatile bool stop = false;
+    };
+    auto *ctx = new ctx_t;
+
+    // The partner grabs the mutex and yields, so every measured lock() has to wait for it
+    spawn_partner([] (void *p) {
+        auto *ctx = reinterpret_cast<ctx_t *>(p);
+        while (!ctx->stop) {
+            ctx->m.lock();
+            otrix::scheduler::get().schedule();
+            ctx->m.unlock();
+        }
+        otrix::scheduler::get().sleep(KTHREAD_TIMEOUT_INF);
+    }, ctx);
+
+    while (s.run()) {
+        ctx->m.lock();
+        ctx->m.unlock();
+        s.pause();
+        otrix::scheduler::get().schedule();
+        s.resume();
+    }
+
+    ctx->stop = true;
+    otrix::scheduler::get().schedule();
+}
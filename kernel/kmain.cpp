@@ -10,8 +10,13 @@
 #include "arch/paging.hpp"
 #include "arch/multiboot2.h"
 #include "kernel/kmem.hpp"
-#include "arch/kvmclock.hpp"
+#include "arch/clock.hpp"
+#include "arch/kvm_pv.hpp"
 #include "kernel/alloc.hpp"
+#include "kernel/cmdline.hpp"
+#include "kernel/boot_info.hpp"
+#include "kernel/boot_trace.hpp"
+#include "kernel/tunable.hpp"
 
 using otrix::immediate_console;
 using otrix::kthread;
@@ -20,31 +25,64 @@ using otrix::arch::local_apic;
 
 static kmem_heap_t root_heap;
 
-static void init_heap()
+static void init_heap(const struct multiboot_tag_basic_meminfo *meminfo)
+{
+    const uint64_t mem_low_size = meminfo->mem_lower;
+    extern uint64_t __binary_end;
+    void *mem_high_start = &__binary_end;
+    const uint64_t mem_high_size_kb = meminfo->mem_upper;
+    immediate_console::print("Low mem size %d kb, Upper mem start %p, size %dkb\n", mem_low_size, mem_high_start, mem_high_size_kb);
+    if (!otrix::boot_info::fast_boot()) {
+        // For debugging
+        memset(mem_high_start, 0xa5, mem_high_size_kb);
+    }
+    kmem_init(&root_heap, mem_high_start, mem_high_size_kb * 1024);
+}
+
+static void parse_multiboot()
 {
     extern uint32_t *__multiboot_addr;
     uint64_t addr = (uint64_t)__multiboot_addr & 0xFFFFFFFF;
+    const struct multiboot_tag_basic_meminfo *meminfo = nullptr;
+    const struct multiboot_tag *acpi_tag = nullptr;
     struct multiboot_tag *tag;
     for (tag = (struct multiboot_tag *) (addr + 8); tag->type != MULTIBOOT_TAG_TYPE_END; tag = (struct multiboot_tag *) ((multiboot_uint8_t *) tag + ((tag->size + 7) & ~7))) {
         switch (tag->type)
             {
-            case MULTIBOOT_TAG_TYPE_BASIC_MEMINFO: {
-                const uint64_t mem_low_size = ((struct multiboot_tag_basic_meminfo *) tag)->mem_lower;
-                extern uint64_t __binary_end;
-                void *mem_high_start = &__binary_end;
-                const uint64_t mem_high_size_kb = ((struct multiboot_tag_basic_meminfo *) tag)->mem_upper;
-                immediate_console::print("Low mem size %d kb, Upper mem start %p, size %dkb\n", mem_low_size, mem_high_start, mem_high_size_kb);
-                // For debugging
-                memset(mem_high_start, 0xa5, mem_high_size_kb);
-                kmem_init(&root_heap, mem_high_start, mem_high_size_kb * 1024);
-                return;
-            }
-            break;
+            case MULTIBOOT_TAG_TYPE_CMDLINE:
+                otrix::cmdline::init(((struct multiboot_tag_string *) tag)->string);
+                break;
+            case MULTIBOOT_TAG_TYPE_BASIC_MEMINFO:
+                meminfo = (struct multiboot_tag_basic_meminfo *) tag;
+                break;
+            case MULTIBOOT_TAG_TYPE_ACPI_OLD:
+                // ACPI 2.0+ RSDP is preferred if both are present
+                if (nullptr == acpi_tag) {
+                    acpi_tag = tag;
+                }
+                break;
+            case MULTIBOOT_TAG_TYPE_ACPI_NEW:
+                acpi_tag = tag;
+                break;
             default:
                 break;
 
             }
     }
+
+    immediate_console::print("Command line: '%s'\n", otrix::cmdline::get());
+    otrix::tunable_base::init_all();
+
+    if (nullptr != acpi_tag) {
+        // Both old and new ACPI tags have the same layout
+        const auto *rsdp_tag = (const struct multiboot_tag_new_acpi *) acpi_tag;
+        otrix::boot_info::set_acpi_rsdp(rsdp_tag->rsdp, rsdp_tag->size - sizeof(*rsdp_tag));
+    }
+
+    // Heap initialization may overwrite multiboot information, so it goes last
+    if (nullptr != meminfo) {
+        init_heap(meminfo);
+    }
 }
 
 namespace otrix {
@@ -77,17 +115,24 @@ extern __attribute__((noreturn)) void otrix_main();
 
 extern "C" __attribute__((noreturn)) void kmain(void)
 {
+    otrix::boot_trace::mark("kmain");
     immediate_console::init();
-    init_heap();
+    otrix::boot_trace::mark("console");
+    parse_multiboot();
+    otrix::boot_trace::mark("heap");
     otrix::arch::init_identity_mapping();
+    otrix::boot_trace::mark("paging");
     otrix::arch::pic_init(32, 40);
     otrix::arch::pic_disable();
     otrix::arch::irq_manager::init();
     local_apic::init(0);
+    otrix::arch::kvm_pv::init();
     local_apic::init_timer(otrix::arch::irq_manager::request_irq(otrix::scheduler::handle_timer_irq, "APIC timer"));
-    if (!otrix::arch::kvmclock::init()) {
-        immediate_console::print("Failed to initialize KVMclock\n");
+    otrix::boot_trace::mark("interrupts");
+    if (!otrix::arch::clock::init()) {
+        immediate_console::print("Failed to initialize clock\n");
     }
+    otrix::boot_trace::mark("clock");
     arch_enable_interrupts();
     otrix::otrix_main();
 }
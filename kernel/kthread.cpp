@@ -3,14 +3,29 @@
 #include <algorithm>
 #include "kernel/alloc.hpp"
 #include "arch/asm.h"
-#include "arch/kvmclock.hpp"
-#include "arch/lapic.hpp"
+#include "arch/clock.hpp"
+#include "arch/kvm_pv.hpp"
+#include "arch/deadline_timer.hpp"
+#include "kernel/tunable.hpp"
+#include "otrix/immediate_console.hpp"
 
 namespace otrix
 {
 
+// Timer interrupts may be delayed by up to this to serve several deadlines at once
+static tunable<uint64_t> timer_slack_us("sched.timer_slack_us", 0, 0, 1000 * 1000);
+
+static uint64_t timer_slack_tsc()
+{
+    if (0 == timer_slack_us) {
+        return 0;
+    }
+    return arch::clock::ns_to_tsc(timer_slack_us * 1000);
+}
+
 kthread::kthread(size_t stack_size, kthread_entry entry, const char *name, int priority, void *ctx):
-    stack_size_(stack_size), entry_(entry), node_(this), priority_(priority), name_(name)
+    stack_size_(stack_size), entry_(entry), node_(this), priority_(priority), base_priority_(priority),
+    blocked_on_(nullptr), owned_mutexes_(nullptr), name_(name), cpu_stats_()
 {
     stack_ = new uint64_t[stack_size];
     arch_context_setup(&context_, stack_,
@@ -18,7 +33,8 @@ kthread::kthread(size_t stack_size, kthread_entry entry, const char *name, int p
 }
 
 kthread::kthread(const char *name, int priority):
-    stack_(nullptr), stack_size_(0), entry_(nullptr), node_(this), priority_(priority), name_(name)
+    stack_(nullptr), stack_size_(0), entry_(nullptr), node_(this), priority_(priority), base_priority_(priority),
+    blocked_on_(nullptr), owned_mutexes_(nullptr), name_(name), cpu_stats_()
 {
     memset(&context_, 0, sizeof(context_));
     intrusive_list_init(&node_.list_node);
@@ -31,7 +47,7 @@ kthread::~kthread()
     delete [] stack_;
 }
 
-scheduler::scheduler(): current_thread_(), need_resched_(false), nearest_tsc_deadline_(-1),
+scheduler::scheduler(): current_thread_(), need_resched_(false), last_switch_tsc_(arch_tsc()), last_switch_steal_ns_(0),
                         idle_thread_("IDLE", 0), preempt_disable_(0)
 {
     for (int i = 0; i < NUM_PRIORITIES; i++) {
@@ -107,6 +123,7 @@ kerror_t scheduler::schedule()
     if (nullptr != current_thread_) {
         // Advance queue to the next thread to be picked next time
         runnable_queues_[prio] = runnable_queues_[prio]->next;
+        account_switch(KTHREAD_PTR(prev_thread), KTHREAD_PTR(current_thread_));
         arch_context_switch(KTHREAD_PTR(prev_thread)->context(),
                 KTHREAD_PTR(current_thread_)->context());
     }
@@ -121,7 +138,7 @@ kerror_t scheduler::sleep(uint64_t block_time_ms)
     if (static_cast<uint64_t>(-1) == block_time_ms) {
         return sleep_until(-1);
     } else {
-        const uint64_t tsc_deadline = arch_tsc() + arch::kvmclock::ns_to_tsc(block_time_ms * 1000 * 1000);
+        const uint64_t tsc_deadline = arch_tsc() + arch::clock::ns_to_tsc(block_time_ms * 1000 * 1000);
         return sleep_until(tsc_deadline);
     }
 }
@@ -132,30 +149,13 @@ kerror_t scheduler::sleep_until(uint64_t tsc_deadline)
 
     kthread *thread = KTHREAD_PTR(current_thread_);
 
-    const int priority = thread->priority();
-
     remove_thread(thread);
     thread->node()->state = KTHREAD_STATE_BLOCKED;
-    if (static_cast<uint64_t>(-1) == tsc_deadline) {
-        thread->node()->tsc_deadline = -1;
-        blocked_queues_[priority] = intrusive_list_push_back(blocked_queues_[priority], &thread->node()->list_node);
-    } else {
-        thread->node()->tsc_deadline = tsc_deadline;
-        nearest_tsc_deadline_ = std::min(nearest_tsc_deadline_, tsc_deadline);
-        if (nullptr != blocked_queues_[priority]) {
-            blocked_queues_[priority] = intrusive_list_insert_sorted(blocked_queues_[priority],
-                    &thread->node()->list_node,
-                    [] (intrusive_list *a, intrusive_list *b)
-                    {
-                        return KTHREAD_NODE_PTR(a)->tsc_deadline > KTHREAD_NODE_PTR(b)->tsc_deadline;
-                    });
-        } else {
-            blocked_queues_[priority] = intrusive_list_push_back(blocked_queues_[priority], &thread->node()->list_node);
-        }
-    }
+    thread->node()->tsc_deadline = tsc_deadline;
+    enqueue_blocked(thread);
 
-    if (nearest_tsc_deadline_ != static_cast<uint64_t>(-1)) {
-        arch::local_apic::start_timer(nearest_tsc_deadline_);
+    if (tsc_deadline != static_cast<uint64_t>(-1)) {
+        arch::deadline_timer::arm(tsc_deadline, timer_slack_tsc());
     }
 
     schedule();
@@ -176,15 +176,107 @@ kerror_t scheduler::wake(kthread *thread)
 
     blocked_queues_[thread->priority()] = intrusive_list_delete(blocked_queues_[thread->priority()], &thread->node()->list_node);
 
+    // The timer may stay armed for the deadline of the woken thread:
+    // reprogramming it to a later deadline costs more than a spurious interrupt
     add_thread(thread);
 
-    setup_timer();
-
     arch_irq_restore(flags);
 
     return E_OK;
 }
 
+kerror_t scheduler::set_priority(kthread *thread, int priority)
+{
+    if (nullptr == thread || priority < 0 || priority >= NUM_PRIORITIES) {
+        return E_INVAL;
+    }
+
+    auto flags = arch_irq_save();
+    const int old_priority = thread->priority();
+    if (old_priority == priority) {
+        arch_irq_restore(flags);
+        return E_OK;
+    }
+
+    intrusive_list *node = &thread->node()->list_node;
+    switch (thread->node()->state) {
+    case KTHREAD_STATE_ACTIVE:
+    case KTHREAD_STATE_RUNNABLE:
+        runnable_queues_[old_priority] = intrusive_list_delete(runnable_queues_[old_priority], node);
+        thread->priority_ = priority;
+        runnable_queues_[priority] = intrusive_list_push_back(runnable_queues_[priority], node);
+        if (KTHREAD_PTR(current_thread_)->priority() < priority || priority < old_priority) {
+            need_resched_ = true;
+        }
+        break;
+    case KTHREAD_STATE_BLOCKED:
+        blocked_queues_[old_priority] = intrusive_list_delete(blocked_queues_[old_priority], node);
+        thread->priority_ = priority;
+        enqueue_blocked(thread);
+        break;
+    default:
+        thread->priority_ = priority;
+        break;
+    }
+
+    arch_irq_restore(flags);
+    return E_OK;
+}
+
+void scheduler::enqueue_blocked(kthread *thread)
+{
+    const int priority = thread->priority();
+    intrusive_list *node = &thread->node()->list_node;
+    if (nullptr == blocked_queues_[priority]) {
+        blocked_queues_[priority] = intrusive_list_push_back(blocked_queues_[priority], node);
+    } else {
+        // Blocked queues are sorted by deadline, infinite sleeps (-1) naturally go last
+        blocked_queues_[priority] = intrusive_list_insert_sorted(blocked_queues_[priority], node,
+                [] (intrusive_list *a, intrusive_list *b)
+                {
+                    return KTHREAD_NODE_PTR(a)->tsc_deadline > KTHREAD_NODE_PTR(b)->tsc_deadline;
+                });
+    }
+}
+
+void scheduler::account_switch(kthread *prev, kthread *next)
+{
+    const uint64_t now = arch_tsc();
+    const uint64_t steal_ns = arch::kvm_pv::steal_time_ns();
+    prev->cpu_stats_.run_tsc += now - last_switch_tsc_;
+    prev->cpu_stats_.steal_ns += steal_ns - last_switch_steal_ns_;
+    last_switch_tsc_ = now;
+    last_switch_steal_ns_ = steal_ns;
+    if (prev != next) {
+        next->cpu_stats_.switches++;
+    }
+}
+
+void scheduler::print_thread_stats()
+{
+    const auto print_queue = [] (intrusive_list *head) {
+        intrusive_list *node = head;
+        while (nullptr != node) {
+            const kthread *thread = KTHREAD_PTR(node);
+            const kthread::cpu_stats_t &stats = thread->cpu_stats();
+            immediate_console::print("  %-16s prio %d run %lu ticks, steal %lu ns, switches %lu\n",
+                    thread->name(), thread->priority(), stats.run_tsc, stats.steal_ns, stats.switches);
+            node = node->next;
+            if (node == head) {
+                break;
+            }
+        }
+    };
+
+    auto flags = arch_irq_save();
+    immediate_console::print("Threads:\n");
+    for (int p = NUM_PRIORITIES - 1; p >= 0; p--) {
+        print_queue(runnable_queues_[p]);
+        print_queue(blocked_queues_[p]);
+    }
+    arch_irq_restore(flags);
+}
+
 void scheduler::preempt_disable()
 {
     auto flags = arch_irq_save();
@@ -212,21 +304,23 @@ void scheduler::handle_timer_irq(void *p_ctx)
 
 void scheduler::handle_timer_irq()
 {
-    nearest_tsc_deadline_ = static_cast<uint64_t>(-1);
+    arch::deadline_timer::expired();
 
+    uint64_t nearest_tsc_deadline = static_cast<uint64_t>(-1);
+    const uint64_t now = arch_tsc();
     for (int p = NUM_PRIORITIES - 1; p >= 0; p--) {
-        while (nullptr != blocked_queues_[p] && KTHREAD_NODE_PTR(blocked_queues_[p])->tsc_deadline < arch_tsc()) {
+        while (nullptr != blocked_queues_[p] && KTHREAD_NODE_PTR(blocked_queues_[p])->tsc_deadline < now) {
             auto thread = KTHREAD_PTR(blocked_queues_[p]);
             wake(thread);
         }
         if (nullptr != blocked_queues_[p]) {
-            nearest_tsc_deadline_ = std::min(KTHREAD_NODE_PTR(blocked_queues_[p])->tsc_deadline,
-                    nearest_tsc_deadline_);
+            nearest_tsc_deadline = std::min(KTHREAD_NODE_PTR(blocked_queues_[p])->tsc_deadline,
+                    nearest_tsc_deadline);
         }
     }
 
-    if (nearest_tsc_deadline_ != static_cast<uint64_t>(-1)) {
-        arch::local_apic::start_timer(nearest_tsc_deadline_);
+    if (nearest_tsc_deadline != static_cast<uint64_t>(-1)) {
+        arch::deadline_timer::arm(nearest_tsc_deadline, timer_slack_tsc());
     }
 
     if (need_resched_) {
@@ -234,22 +328,4 @@ void scheduler::handle_timer_irq()
     }
 }
 
-void scheduler::setup_timer()
-{
-    nearest_tsc_deadline_ = static_cast<uint64_t>(-1);
-
-    for (int p = NUM_PRIORITIES - 1; p >= 0; p--) {
-        if (nullptr != get().blocked_queues_[p]) {
-            get().nearest_tsc_deadline_ =
-                std::min(KTHREAD_NODE_PTR(get().blocked_queues_[p])->tsc_deadline,
-                        get().nearest_tsc_deadline_);
-        }
-    }
-
-    if (get().nearest_tsc_deadline_ != static_cast<uint64_t>(-1)) {
-        arch::local_apic::start_timer(get().nearest_tsc_deadline_);
-    }
-
-}
-
 } // namespace otrix
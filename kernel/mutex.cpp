@@ -1,11 +1,19 @@
 #include "kernel/mutex.hpp"
+
+#include <algorithm>
 #include "kernel/kthread.hpp"
 #include "arch/asm.h"
+#include "otrix/immediate_console.hpp"
+
+#define MUTEX_NODE_PTR(list_ptr) container_of(list_ptr, node_t, list_node)
 
 namespace otrix
 {
 
-mutex::mutex(): owner_(nullptr)
+mutex::stats_t mutex::global_stats_;
+
+mutex::mutex(mutex_protocol protocol, int ceiling): owner_(nullptr), protocol_(protocol), ceiling_(ceiling),
+                                                   node_(this), boost_start_tsc_(0), stats_()
 {}
 
 mutex::~mutex()
@@ -16,35 +24,162 @@ mutex::~mutex()
 bool mutex::lock(uint64_t timeout_ms)
 {
     auto flags = arch_irq_save();
+    kthread *current = scheduler::get().get_current_thread();
 
     if (nullptr == owner_) {
-        owner_ = scheduler::get().get_current_thread();
+        acquire(current);
         arch_irq_restore(flags);
         return true;
     }
-    arch_irq_restore(flags);
-    if (timeout_ms > 0) {
-        if (waiting_queue_.wait(timeout_ms)) {
-            owner_ = scheduler::get().get_current_thread();
-            return true;
+
+    if (0 == timeout_ms) {
+        arch_irq_restore(flags);
+        return false;
+    }
+
+    stats_.contended++;
+    global_stats_.contended++;
+
+    current->set_blocked_on(this);
+    if (mutex_protocol::inherit == protocol_) {
+        inherit_priority(current->priority());
+    }
+
+    // Ownership is handed over by unlock() before the waiter is woken up
+    const bool acquired = waiting_queue_.wait(timeout_ms);
+    current->set_blocked_on(nullptr);
+    if (acquired && mutex_protocol::inherit == protocol_) {
+        // Remaining waiters (if any) are now blocked on this thread
+        kthread *top = waiting_queue_.top_waiter();
+        if (nullptr != top) {
+            boost(current, top->priority());
         }
+    } else if (!acquired && nullptr != owner_) {
+        // The owner may have been boosted on behalf of this thread
+        update_priority(owner_);
     }
-    return false;
+    arch_irq_restore(flags);
+    return acquired;
 }
 
 void mutex::unlock()
 {
     auto flags = arch_irq_save();
-    if (scheduler::get().get_current_thread() == owner_) {
-        if (!waiting_queue_.empty()) {
-            waiting_queue_.notify_one();
-        } else {
-            owner_ = nullptr;
-        }
-    } else {
+    kthread *current = scheduler::get().get_current_thread();
+    if (current != owner_) {
         // TODO: assert to enforce mutex ownership semantics
+        arch_irq_restore(flags);
+        return;
+    }
+
+    release(current);
+
+    kthread *next = waiting_queue_.top_waiter();
+    if (nullptr != next) {
+        acquire(next);
+        waiting_queue_.notify(next);
     }
     arch_irq_restore(flags);
 }
 
+void mutex::print_stats()
+{
+    immediate_console::print("mutex: contended %lu, boosts %lu, boosted %lu ticks, max boost %lu ticks\n",
+            global_stats_.contended, global_stats_.boosts,
+            global_stats_.boosted_tsc, global_stats_.max_boost_tsc);
+}
+
+void mutex::acquire(kthread *thread)
+{
+    owner_ = thread;
+    if (mutex_protocol::none == protocol_) {
+        return;
+    }
+
+    thread->owned_mutexes() = intrusive_list_push_back(thread->owned_mutexes(), &node_.list_node);
+    if (mutex_protocol::ceiling == protocol_) {
+        boost(thread, ceiling_);
+    }
+}
+
+void mutex::release(kthread *thread)
+{
+    owner_ = nullptr;
+    if (mutex_protocol::none == protocol_) {
+        return;
+    }
+
+    thread->owned_mutexes() = intrusive_list_delete(thread->owned_mutexes(), &node_.list_node);
+    intrusive_list_init(&node_.list_node);
+
+    if (0 != boost_start_tsc_) {
+        const uint64_t boosted_tsc = arch_tsc() - boost_start_tsc_;
+        boost_start_tsc_ = 0;
+        stats_.boosted_tsc += boosted_tsc;
+        global_stats_.boosted_tsc += boosted_tsc;
+        if (boosted_tsc > stats_.max_boost_tsc) {
+            stats_.max_boost_tsc = boosted_tsc;
+        }
+        if (boosted_tsc > global_stats_.max_boost_tsc) {
+            global_stats_.max_boost_tsc = boosted_tsc;
+        }
+    }
+
+    if (thread->priority() != thread->base_priority()) {
+        update_priority(thread);
+    }
+}
+
+void mutex::boost(kthread *thread, int priority)
+{
+    if (thread->priority() >= priority) {
+        return;
+    }
+    if (0 == boost_start_tsc_) {
+        boost_start_tsc_ = arch_tsc();
+    }
+    stats_.boosts++;
+    global_stats_.boosts++;
+    scheduler::get().set_priority(thread, priority);
+}
+
+void mutex::inherit_priority(int priority)
+{
+    // Walk the chain of owners: if the owner is itself blocked on another mutex,
+    // its owner has to be boosted as well to make progress.
+    mutex *m = this;
+    for (int depth = 0; nullptr != m && depth < MAX_INHERITANCE_DEPTH; depth++) {
+        kthread *owner = m->owner_;
+        if (nullptr == owner || mutex_protocol::inherit != m->protocol_ || owner->priority() >= priority) {
+            break;
+        }
+        m->boost(owner, priority);
+        m = owner->blocked_on();
+    }
+}
+
+void mutex::update_priority(kthread *thread)
+{
+    // Effective priority is the maximum of the base priority,
+    // ceilings and the top waiters of all mutexes still held by the thread
+    int priority = thread->base_priority();
+    intrusive_list *head = thread->owned_mutexes();
+    if (nullptr != head) {
+        intrusive_list *node = head;
+        do {
+            const mutex *m = MUTEX_NODE_PTR(node)->p_mutex;
+            if (mutex_protocol::ceiling == m->protocol_) {
+                priority = std::max(priority, m->ceiling_);
+            } else {
+                const kthread *top = m->waiting_queue_.top_waiter();
+                if (nullptr != top) {
+                    priority = std::max(priority, top->priority());
+                }
+            }
+            node = node->next;
+        } while (node != head);
+    }
+    scheduler::get().set_priority(thread, priority);
+}
+
 } // namespace otrix
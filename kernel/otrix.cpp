@@ -1,6 +1,10 @@
 #include "net/net_task.hpp"
 #include "kernel/kthread.hpp"
 #include "dev/virtio_blk.hpp"
+#include "kernel/kbench.hpp"
+#include "kernel/boot_info.hpp"
+#include "kernel/boot_trace.hpp"
+#include "dev/acpi.hpp"
 
 namespace otrix
 {
@@ -9,6 +13,9 @@ enum pci_devices_t {
     PCI_DEVICE_VIRTIO_NET,
     PCI_DEVICE_VIRTIO_CONSOLE,
     PCI_DEVICE_VIRTIO_BLK,
+    // Modern-only devices (disable-legacy=on) have separate IDs
+    PCI_DEVICE_VIRTIO_NET_MODERN,
+    PCI_DEVICE_VIRTIO_BLK_MODERN,
 };
 
 static otrix::dev::pci_dev::descriptor_t pci_dev_list[] = {
@@ -27,16 +34,74 @@ static otrix::dev::pci_dev::descriptor_t pci_dev_list[] = {
         .vendor_id = 0x1af4,
         .p_dev = nullptr,
     },
+    [PCI_DEVICE_VIRTIO_NET_MODERN] = {
+        .device_id = 0x1041,
+        .vendor_id = 0x1af4,
+        .p_dev = nullptr,
+    },
+    [PCI_DEVICE_VIRTIO_BLK_MODERN] = {
+        .device_id = 0x1042,
+        .vendor_id = 0x1af4,
+        .p_dev = nullptr,
+    },
 };
 
+static dev::pci_dev *find_pci_dev(pci_devices_t transitional, pci_devices_t modern)
+{
+    if (nullptr != pci_dev_list[transitional].p_dev) {
+        return pci_dev_list[transitional].p_dev;
+    }
+    return pci_dev_list[modern].p_dev;
+}
+
+static constexpr auto INIT_STACK_SIZE = 64 * 1024 / sizeof(uint64_t);
+static constexpr auto INIT_PRIORITY = 2;
+
+static dev::virtio_blk *blk_dev;
+
+static void init_blk(dev::pci_dev *p_dev)
+{
+    blk_dev = new dev::virtio_blk(p_dev);
+    if (!boot_info::fast_boot()) {
+        blk_dev->print_info();
+    }
+}
+
+static void start_init_thread(const char *name, kthread_entry entry, void *ctx)
+{
+    scheduler::get().add_thread(new kthread(INIT_STACK_SIZE, entry, name, INIT_PRIORITY, ctx));
+}
+
 void otrix_main()
 {
     otrix::dev::pci_dev::find_devices(pci_dev_list, sizeof(pci_dev_list) / sizeof(pci_dev_list[0]));
+    boot_trace::mark("pci");
+
+    // Network stack is always initialized in its own thread
+    if (boot_info::fast_boot()) {
+        // Init threads run once the idle loop yields and report completion to boot_trace
+        boot_trace::expect(3);
+        start_init_thread("acpi_init", [] (void *) {
+            acpi_init();
+            boot_trace::complete("acpi");
+            scheduler::get().sleep(KTHREAD_TIMEOUT_INF);
+        }, nullptr);
+        start_init_thread("blk_init", [] (void *ctx) {
+            init_blk(reinterpret_cast<dev::pci_dev *>(ctx));
+            boot_trace::complete("virtio_blk");
+            scheduler::get().sleep(KTHREAD_TIMEOUT_INF);
+        }, find_pci_dev(PCI_DEVICE_VIRTIO_BLK, PCI_DEVICE_VIRTIO_BLK_MODERN));
+    } else {
+        boot_trace::expect(1);
+        acpi_init();
+        boot_trace::mark("acpi");
+        init_blk(find_pci_dev(PCI_DEVICE_VIRTIO_BLK, PCI_DEVICE_VIRTIO_BLK_MODERN));
+        boot_trace::mark("virtio_blk");
+    }
 
-    dev::virtio_blk blk(pci_dev_list[PCI_DEVICE_VIRTIO_BLK].p_dev);
-    blk.print_info();
+    otrix::net::net_task_start(find_pci_dev(PCI_DEVICE_VIRTIO_NET, PCI_DEVICE_VIRTIO_NET_MODERN));
 
-    otrix::net::net_task_start(pci_dev_list[PCI_DEVICE_VIRTIO_NET].p_dev);
+    kbench::start();
 
     while (1) {
         scheduler::get().schedule();
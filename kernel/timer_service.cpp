@@ -1,28 +1,32 @@
 #include "kernel/timer_service.hpp"
 #include "kernel/kthread.hpp"
-#include "arch/kvmclock.hpp"
+#include "arch/clock.hpp"
 #include "arch/asm.h"
+#include "kernel/tunable.hpp"
 
 #define TASK_PTR(list_ptr) container_of(list_ptr, task_desc_t, list_node)
 
 namespace otrix
 {
 
-static constexpr auto STACK_SIZE = 64 * 1024 / sizeof(uint64_t);
+static constexpr auto STACK_SIZE = 64 * 1024;
 static constexpr auto TASK_POOL_SIZE = 32;
 
+static tunable<size_t> stack_size("timer_service.stack_size", STACK_SIZE, 4096, 1024 * 1024);
+static tunable<size_t> task_pool_size("timer_service.task_pool_size", TASK_POOL_SIZE, 1, 1024);
+
 timer_service::timer_service(int priority, void *shared_ctx): pending_tasks_(nullptr),
                                             task_pool_(nullptr),
                                             task_pool_ptr_(nullptr),
                                             shared_ctx_(shared_ctx),
-                                            service_thread_(new kthread(STACK_SIZE, [] (void *ctx) {
+                                            service_thread_(new kthread(stack_size / sizeof(uint64_t), [] (void *ctx) {
                                                                 timer_service *p_this = (timer_service *)ctx;
                                                                 p_this->run();
                                                             }, "timer_service", priority, this))
 {
-    task_pool_ptr_ = new task_desc_t[TASK_POOL_SIZE];
+    task_pool_ptr_ = new task_desc_t[task_pool_size];
     task_pool_ = nullptr;
-    for (size_t i = 0; i < TASK_POOL_SIZE; i++) {
+    for (size_t i = 0; i < task_pool_size; i++) {
         intrusive_list_init(&task_pool_ptr_[i].list_node);
         task_pool_ = intrusive_list_push_back(task_pool_, &task_pool_ptr_[i].list_node);
     }
@@ -31,7 +35,7 @@ timer_service::timer_service(int priority, void *shared_ctx): pending_tasks_(nul
 timer_service::~timer_service()
 {
     delete service_thread_;
-    for (size_t i = 0; i < TASK_POOL_SIZE; i++) {
+    for (size_t i = 0; i < task_pool_size; i++) {
         intrusive_list_unlink_node(&task_pool_ptr_[i].list_node);
     }
     delete [] task_pool_ptr_;
@@ -49,7 +53,7 @@ timer_task_t *timer_service::add_task(timer_cb_t cb, void *ctx, uint64_t timeout
     task_desc_t *p_desc = container_of(task, task_desc_t, list_node);
     p_desc->p_cb = cb;
     p_desc->p_ctx = ctx;
-    p_desc->deadline_tsc = arch_tsc() + arch::kvmclock::ns_to_tsc(timeout_ms * 1000 * 1000);
+    p_desc->deadline_tsc = arch_tsc() + arch::clock::ns_to_tsc(timeout_ms * 1000 * 1000);
 
     pending_tasks_ = intrusive_list_insert_sorted(pending_tasks_, task,
             [] (intrusive_list *a, intrusive_list *b)
@@ -0,0 +1,80 @@
+#include "kernel/tunable.hpp"
+
+#include "kernel/cmdline.hpp"
+#include "otrix/immediate_console.hpp"
+
+#define TUNABLE_NODE_PTR(list_ptr) container_of(list_ptr, node_t, list_node)
+
+namespace otrix
+{
+
+// Zero-initialized before any static constructor runs
+static intrusive_list *registry;
+
+bool tunable_parse_uint(const char *str, size_t len, uint64_t *p_out)
+{
+    if (nullptr == str || 0 == len) {
+        return false;
+    }
+
+    uint64_t base = 10;
+    if (len > 2 && '0' == str[0] && ('x' == str[1] || 'X' == str[1])) {
+        base = 16;
+        str += 2;
+        len -= 2;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < len; i++) {
+        const char c = str[i];
+        uint64_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (16 == base && c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (16 == base && c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        if (value > (std::numeric_limits<uint64_t>::max() - digit) / base) {
+            return false;
+        }
+        value = value * base + digit;
+    }
+    *p_out = value;
+    return true;
+}
+
+tunable_base::tunable_base(const char *name): name_(name)
+{
+    node_.p_tunable = this;
+    if (nullptr == registry) {
+        registry = intrusive_list_init(&node_.list_node);
+    } else {
+        intrusive_list_push_back(registry, &node_.list_node);
+    }
+}
+
+void tunable_base::init_all()
+{
+    intrusive_list *node = registry;
+    while (nullptr != node) {
+        tunable_base *p_tunable = TUNABLE_NODE_PTR(node)->p_tunable;
+        const char *value;
+        size_t len;
+        if (cmdline::find(p_tunable->name(), &value, &len)) {
+            if (p_tunable->parse(value, len)) {
+                immediate_console::print("Tunable %s=%.*s\n", p_tunable->name(), (int)len, value != nullptr ? value : "");
+            } else {
+                immediate_console::print("Invalid value of tunable %s, using default\n", p_tunable->name());
+            }
+        }
+        node = node->next;
+        if (node == registry) {
+            break;
+        }
+    }
+}
+
+} // namespace otrix
@@ -25,6 +25,10 @@ bool waitq::wait(uint64_t timeout_ms)
     ctx.thread = thread;
     wq_ = intrusive_list_push_back(wq_, &ctx.list_node);
     scheduler::get().sleep(timeout_ms);
+    if (!ctx.wakeup_successful) {
+        // Timed out, the context is going out of scope
+        wq_ = intrusive_list_delete(wq_, &ctx.list_node);
+    }
     arch_irq_restore(flags);
 
     return ctx.wakeup_successful;
@@ -48,6 +52,46 @@ void waitq::notify_one()
     scheduler::get().schedule();
 }
 
+bool waitq::notify(kthread *thread)
+{
+    auto flags = arch_irq_save();
+    intrusive_list *node = wq_;
+    if (nullptr != node) {
+        do {
+            waitq_item *ctx = container_of(node, waitq_item, list_node);
+            if (ctx->thread == thread) {
+                wq_ = intrusive_list_delete(wq_, &ctx->list_node);
+                ctx->wakeup_successful = true;
+                scheduler::get().wake(thread);
+                arch_irq_restore(flags);
+                scheduler::get().schedule();
+                return true;
+            }
+            node = node->next;
+        } while (node != wq_);
+    }
+    arch_irq_restore(flags);
+    return false;
+}
+
+kthread *waitq::top_waiter() const
+{
+    kthread *ret = nullptr;
+    auto flags = arch_irq_save();
+    intrusive_list *node = wq_;
+    if (nullptr != node) {
+        do {
+            kthread *thread = container_of(node, waitq_item, list_node)->thread;
+            if (nullptr == ret || thread->priority() > ret->priority()) {
+                ret = thread;
+            }
+            node = node->next;
+        } while (node != wq_);
+    }
+    arch_irq_restore(flags);
+    return ret;
+}
+
 void waitq::notify_all()
 {
     auto flags = arch_irq_save();
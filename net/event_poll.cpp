@@ -0,0 +1,218 @@
+#include "net/event_poll.hpp"
+#include "net/socket.hpp"
+#include "kernel/kthread.hpp"
+#include "arch/asm.h"
+#include "arch/clock.hpp"
+
+#define SOCKET_ENTRY_PTR(list_ptr) container_of(list_ptr, entry_t, socket_node)
+#define POLL_ENTRY_PTR(list_ptr) container_of(list_ptr, entry_t, poll_node)
+#define READY_ENTRY_PTR(list_ptr) container_of(list_ptr, entry_t, ready_node)
+
+namespace otrix::net
+{
+
+// Append to the list keeping head in place, so that the list is FIFO
+static void list_append(intrusive_list *&head, intrusive_list *node)
+{
+    if (nullptr == head) {
+        head = intrusive_list_init(node);
+    } else {
+        intrusive_list_push_back(head, node);
+    }
+}
+
+event_poll::event_poll(): entries_(nullptr), ready_list_(nullptr)
+{
+
+}
+
+event_poll::~event_poll()
+{
+    auto flags = arch_irq_save();
+    while (nullptr != entries_) {
+        destroy(POLL_ENTRY_PTR(entries_));
+    }
+    arch_irq_restore(flags);
+    ready_waitq_.notify_all();
+}
+
+kerror_t event_poll::add(socket *sock, uint32_t events, void *ctx, bool edge_triggered)
+{
+    if (nullptr == sock) {
+        return E_INVAL;
+    }
+
+    entry_t *entry = new entry_t;
+    if (nullptr == entry) {
+        return E_NOMEM;
+    }
+    entry->poller = this;
+    entry->sock = sock;
+    entry->events = events;
+    entry->ctx = ctx;
+    entry->edge_triggered = edge_triggered;
+    entry->ready = false;
+
+    auto flags = arch_irq_save();
+    if (nullptr != find(sock)) {
+        arch_irq_restore(flags);
+        delete entry;
+        return E_ADDRINUSE;
+    }
+    list_append(entries_, &entry->poll_node);
+    list_append(sock->poll_entries_, &entry->socket_node);
+    // Report the events which are already pending
+    if (0 != (sock->poll_events() & (events | POLL_ERR | POLL_HUP))) {
+        make_ready(entry);
+    }
+    arch_irq_restore(flags);
+
+    return E_OK;
+}
+
+kerror_t event_poll::modify(socket *sock, uint32_t events, void *ctx)
+{
+    auto flags = arch_irq_save();
+    entry_t *entry = find(sock);
+    if (nullptr == entry) {
+        arch_irq_restore(flags);
+        return E_INVAL;
+    }
+    entry->events = events;
+    entry->ctx = ctx;
+    if (0 != (sock->poll_events() & (events | POLL_ERR | POLL_HUP))) {
+        make_ready(entry);
+    }
+    arch_irq_restore(flags);
+    return E_OK;
+}
+
+kerror_t event_poll::remove(socket *sock)
+{
+    auto flags = arch_irq_save();
+    entry_t *entry = find(sock);
+    if (nullptr == entry) {
+        arch_irq_restore(flags);
+        return E_INVAL;
+    }
+    destroy(entry);
+    arch_irq_restore(flags);
+    return E_OK;
+}
+
+size_t event_poll::wait(poll_event *p_events, size_t max_events, uint64_t timeout_ms)
+{
+    if (nullptr == p_events || 0 == max_events) {
+        return 0;
+    }
+
+    // Entries found stale don't restart the timeout
+    const bool infinite = static_cast<uint64_t>(KTHREAD_TIMEOUT_INF) == timeout_ms;
+    const uint64_t tsc_deadline = infinite ? 0 : arch_tsc() + arch::clock::ns_to_tsc(timeout_ms * 1000 * 1000);
+
+    auto flags = arch_irq_save();
+    size_t num_events = 0;
+    while (0 == num_events) {
+        if (nullptr == ready_list_) {
+            uint64_t wait_ms = timeout_ms;
+            if (!infinite) {
+                const uint64_t now = arch_tsc();
+                wait_ms = now < tsc_deadline ? (arch::clock::tsc_to_ns(tsc_deadline - now) + 999999) / 1000000 : 0;
+            }
+            if (0 == wait_ms || !ready_waitq_.wait(wait_ms)) {
+                break;
+            }
+            continue;
+        }
+
+        intrusive_list *requeue = nullptr;
+        while (nullptr != ready_list_ && num_events < max_events) {
+            entry_t *entry = READY_ENTRY_PTR(ready_list_);
+            ready_list_ = intrusive_list_delete(ready_list_, &entry->ready_node);
+            entry->ready = false;
+
+            // Report the current state, the entry may have become stale since it was signalled
+            const uint32_t events = entry->sock->poll_events() & (entry->events | POLL_ERR | POLL_HUP);
+            if (0 == events) {
+                continue;
+            }
+            p_events[num_events].events = events;
+            p_events[num_events].ctx = entry->ctx;
+            num_events++;
+
+            if (!entry->edge_triggered) {
+                // Level-triggered: keep reporting until the socket is drained
+                list_append(requeue, &entry->ready_node);
+            }
+        }
+
+        while (nullptr != requeue) {
+            entry_t *entry = READY_ENTRY_PTR(requeue);
+            requeue = intrusive_list_delete(requeue, &entry->ready_node);
+            entry->ready = true;
+            list_append(ready_list_, &entry->ready_node);
+        }
+    }
+    arch_irq_restore(flags);
+
+    return num_events;
+}
+
+event_poll::entry_t *event_poll::find(socket *sock)
+{
+    intrusive_list *head = sock->poll_entries_;
+    if (nullptr == head) {
+        return nullptr;
+    }
+    intrusive_list *node = head;
+    do {
+        entry_t *entry = SOCKET_ENTRY_PTR(node);
+        if (this == entry->poller) {
+            return entry;
+        }
+        node = node->next;
+    } while (node != head);
+    return nullptr;
+}
+
+void event_poll::make_ready(entry_t *entry)
+{
+    if (entry->ready) {
+        return;
+    }
+    entry->ready = true;
+    list_append(ready_list_, &entry->ready_node);
+    ready_waitq_.notify_one();
+}
+
+void event_poll::destroy(entry_t *entry)
+{
+    if (entry->ready) {
+        ready_list_ = intrusive_list_delete(ready_list_, &entry->ready_node);
+    }
+    entries_ = intrusive_list_delete(entries_, &entry->poll_node);
+    entry->sock->poll_entries_ = intrusive_list_delete(entry->sock->poll_entries_, &entry->socket_node);
+    delete entry;
+}
+
+void event_poll::signal(intrusive_list *socket_entries, uint32_t events)
+{
+    if (nullptr == socket_entries) {
+        return;
+    }
+    // Defer switching to the woken up pollers until the list is walked
+    scheduler::get().preempt_disable();
+    auto flags = arch_irq_save();
+    intrusive_list *node = socket_entries;
+    do {
+        entry_t *entry = SOCKET_ENTRY_PTR(node);
+        if (0 != (events & (entry->events | POLL_ERR | POLL_HUP))) {
+            entry->poller->make_ready(entry);
+        }
+        node = node->next;
+    } while (node != socket_entries);
+    arch_irq_restore(flags);
+    scheduler::get().preempt_enable();
+}
+
+} // namespace otrix::net
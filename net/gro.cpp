@@ -0,0 +1,231 @@
+#include "net/gro.hpp"
+#include "net/sockbuf.hpp"
+#include "net/ethernet.hpp"
+#include "net/ipv4.hpp"
+#include "net/tcp.hpp"
+#include "kernel/alloc.hpp"
+#include "common/utils.h"
+
+namespace otrix::net
+{
+
+static constexpr uint16_t IP_FLAG_MF_OFFSET_MASK = 0x3fff;
+static constexpr uint8_t VERSION_IHL_IPV4 = (4 << 4) | (sizeof(ip_hdr) / sizeof(uint32_t));
+
+tunable<bool> gro::enabled_("net.gro", true);
+
+// TCP segment over IPv4 without IP options, located in a linear frame
+struct gro_segment
+{
+    const ip_hdr *p_ip;
+    const tcp_header *p_tcp;
+    size_t tcp_header_size;
+    size_t payload_size; // TCP payload, without link padding
+    uint32_t ports;
+};
+
+static bool parse_segment(const sockbuf *skb, gro_segment *p_seg)
+{
+    const ethernet_hdr *p_eth = reinterpret_cast<const ethernet_hdr *>(skb->header(sockbuf_header_t::ethernet));
+    if (nullptr == p_eth || ethertype::ipv4 != (ethertype)ntohs(p_eth->ethertype) ||
+        skb->payload_size() < sizeof(ip_hdr))
+    {
+        return false;
+    }
+    const ip_hdr *p_ip = reinterpret_cast<const ip_hdr *>(skb->payload());
+    const size_t ip_len = ntohs(p_ip->len);
+    if (VERSION_IHL_IPV4 != p_ip->version_ihl || (uint8_t)ipproto_t::tcp != p_ip->proto ||
+        ip_len > skb->payload_size() || ip_len < sizeof(ip_hdr) + sizeof(tcp_header))
+    {
+        return false;
+    }
+    const tcp_header *p_tcp = reinterpret_cast<const tcp_header *>(skb->payload() + sizeof(ip_hdr));
+    const size_t tcp_header_size = (p_tcp->header_len >> 4) * sizeof(uint32_t);
+    if (tcp_header_size < sizeof(tcp_header) || sizeof(ip_hdr) + tcp_header_size > ip_len) {
+        return false;
+    }
+    p_seg->p_ip = p_ip;
+    p_seg->p_tcp = p_tcp;
+    p_seg->tcp_header_size = tcp_header_size;
+    p_seg->payload_size = ip_len - sizeof(ip_hdr) - tcp_header_size;
+    p_seg->ports = (uint32_t)p_tcp->source_port << 16 | p_tcp->dest_port;
+    return true;
+}
+
+// Only plain data segments are coalesced, anything else changes the connection state
+static bool can_coalesce(const sockbuf *skb, const gro_segment &seg)
+{
+    if (0 == seg.payload_size || 0 != (ntohs(seg.p_ip->flags_offset) & IP_FLAG_MF_OFFSET_MASK)) {
+        return false;
+    }
+    if (TCP_FLAG_ACK != (seg.p_tcp->flags & ~TCP_FLAG_PSH)) {
+        return false;
+    }
+    if (skb->csum_valid()) {
+        return true;
+    }
+    // Coalesced segment is marked as verified, so each segment is checked here instead of in TCP
+    const size_t tcp_length = seg.tcp_header_size + seg.payload_size;
+    const uint32_t initial_csum = tcp_pseudo_header_sum(seg.p_ip->saddr, seg.p_ip->daddr, tcp_length);
+    return 0 == ip_checksum(reinterpret_cast<const uint8_t *>(seg.p_tcp), tcp_length, initial_csum);
+}
+
+gro::gro(deliver_func_t p_deliver, void *ctx): p_deliver_(p_deliver), deliver_ctx_(ctx), num_flows_(0),
+                                               num_coalesced_(0), num_coalesced_segments_(0)
+{
+}
+
+gro::~gro()
+{
+    flush();
+}
+
+gro::flow *gro::find_flow(uint32_t saddr, uint32_t daddr, uint32_t ports)
+{
+    for (size_t i = 0; i < num_flows_; i++) {
+        flow *p_flow = &flows_[i];
+        if (p_flow->saddr == saddr && p_flow->daddr == daddr && p_flow->ports == ports) {
+            return p_flow;
+        }
+    }
+    return nullptr;
+}
+
+void gro::receive(sockbuf *skb)
+{
+    gro_segment seg;
+    if (!parse_segment(skb, &seg)) {
+        p_deliver_(skb, deliver_ctx_);
+        return;
+    }
+
+    flow *p_flow = find_flow(seg.p_ip->saddr, seg.p_ip->daddr, seg.ports);
+    if (!enabled_ || !can_coalesce(skb, seg)) {
+        if (nullptr != p_flow) {
+            flush_flow(p_flow);
+        }
+        p_deliver_(skb, deliver_ctx_);
+        return;
+    }
+
+    if (nullptr != p_flow) {
+        const sockbuf *p_first = container_of(p_flow->p_held, sockbuf::node_t, list_node)->p_skb;
+        const tcp_header *p_first_tcp = reinterpret_cast<const tcp_header *>(p_first->payload() + sizeof(ip_hdr));
+        // Coalesced segment must fit into the 16-bit IP total length
+        const size_t max_payload_size = UINT16_MAX - sizeof(ip_hdr) - seg.tcp_header_size;
+        if (ntohl(seg.p_tcp->seq) != p_flow->next_seq || p_first_tcp->header_len != seg.p_tcp->header_len ||
+            p_flow->payload_size + seg.payload_size > max_payload_size)
+        {
+            flush_flow(p_flow);
+            p_flow = nullptr;
+        }
+    }
+    if (nullptr == p_flow) {
+        if (MAX_FLOWS == num_flows_) {
+            flush_flow(&flows_[0]);
+        }
+        p_flow = &flows_[num_flows_++];
+        p_flow->saddr = seg.p_ip->saddr;
+        p_flow->daddr = seg.p_ip->daddr;
+        p_flow->ports = seg.ports;
+        p_flow->payload_size = 0;
+        p_flow->num_segments = 0;
+        p_flow->p_held = nullptr;
+    }
+
+    if (nullptr == p_flow->p_held) {
+        p_flow->p_held = intrusive_list_init(&skb->node()->list_node);
+    } else {
+        intrusive_list_push_back(p_flow->p_held, &skb->node()->list_node);
+    }
+    p_flow->next_seq = ntohl(seg.p_tcp->seq) + seg.payload_size;
+    p_flow->payload_size += seg.payload_size;
+    p_flow->num_segments++;
+
+    // Sender wants the data delivered now
+    if (seg.p_tcp->flags & TCP_FLAG_PSH) {
+        flush_flow(p_flow);
+    }
+}
+
+void gro::flush()
+{
+    while (0 != num_flows_) {
+        flush_flow(&flows_[0]);
+    }
+}
+
+sockbuf *gro::coalesce(flow *p_flow)
+{
+    const sockbuf *p_first = container_of(p_flow->p_held, sockbuf::node_t, list_node)->p_skb;
+    const sockbuf *p_last = container_of(intrusive_list_get_tail(p_flow->p_held), sockbuf::node_t, list_node)->p_skb;
+    const uint8_t *p_eth = p_first->header(sockbuf_header_t::ethernet);
+    const size_t eth_size = p_first->payload() - p_eth;
+    const tcp_header *p_first_tcp = reinterpret_cast<const tcp_header *>(p_first->payload() + sizeof(ip_hdr));
+    const tcp_header *p_last_tcp = reinterpret_cast<const tcp_header *>(p_last->payload() + sizeof(ip_hdr));
+    const size_t tcp_header_size = (p_first_tcp->header_len >> 4) * sizeof(uint32_t);
+    const size_t headers_size = eth_size + sizeof(ip_hdr) + tcp_header_size;
+
+    uint8_t *p_buf = (uint8_t *)otrix::alloc(headers_size + p_flow->payload_size);
+    if (nullptr == p_buf) {
+        return nullptr;
+    }
+    // Link and IP headers come from the first segment, TCP header with the latest ACK and window from the last one
+    memcpy(p_buf, p_eth, eth_size + sizeof(ip_hdr));
+    tcp_header *p_tcp = reinterpret_cast<tcp_header *>(p_buf + eth_size + sizeof(ip_hdr));
+    memcpy(p_tcp, p_last_tcp, tcp_header_size);
+    p_tcp->seq = p_first_tcp->seq;
+
+    uint8_t *p_payload = p_buf + headers_size;
+    intrusive_list *p_node = p_flow->p_held;
+    do {
+        const sockbuf *skb = container_of(p_node, sockbuf::node_t, list_node)->p_skb;
+        const ip_hdr *p_seg_ip = reinterpret_cast<const ip_hdr *>(skb->payload());
+        const size_t payload_size = ntohs(p_seg_ip->len) - sizeof(ip_hdr) - tcp_header_size;
+        memcpy(p_payload, skb->payload() + sizeof(ip_hdr) + tcp_header_size, payload_size);
+        p_payload += payload_size;
+        p_node = p_node->next;
+    } while (p_node != p_flow->p_held);
+
+    ip_hdr *p_ip = reinterpret_cast<ip_hdr *>(p_buf + eth_size);
+    p_ip->len = htons(sizeof(ip_hdr) + tcp_header_size + p_flow->payload_size);
+    p_ip->csum = 0;
+    p_ip->csum = ip_checksum(reinterpret_cast<const uint8_t *>(p_ip), sizeof(ip_hdr));
+
+    sockbuf *skb = new sockbuf(p_buf, headers_size + p_flow->payload_size, nullptr, nullptr);
+    skb->add_parsed_header(eth_size, sockbuf_header_t::ethernet);
+    // TCP checksum of the coalesced segment is not recomputed, every segment was verified
+    skb->set_csum_valid(true);
+    return skb;
+}
+
+void gro::flush_flow(flow *p_flow)
+{
+    sockbuf *p_coalesced = p_flow->num_segments > 1 ? coalesce(p_flow) : nullptr;
+    if (nullptr != p_coalesced) {
+        num_coalesced_++;
+        num_coalesced_segments_ += p_flow->num_segments;
+    }
+    while (nullptr != p_flow->p_held) {
+        sockbuf *skb = container_of(p_flow->p_held, sockbuf::node_t, list_node)->p_skb;
+        p_flow->p_held = intrusive_list_delete(p_flow->p_held, p_flow->p_held);
+        if (nullptr != p_coalesced) {
+            delete skb;
+        } else {
+            // Single segment, or coalescing ran out of memory
+            p_deliver_(skb, deliver_ctx_);
+        }
+    }
+    if (nullptr != p_coalesced) {
+        p_deliver_(p_coalesced, deliver_ctx_);
+    }
+
+    // Keep the remaining flows ordered by age
+    const size_t index = p_flow - flows_;
+    for (size_t i = index + 1; i < num_flows_; i++) {
+        flows_[i - 1] = flows_[i];
+    }
+    num_flows_--;
+}
+
+} // namespace otrix::net
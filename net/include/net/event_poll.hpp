@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "common/error.h"
+#include "common/list.h"
+#include "kernel/waitq.hpp"
+
+namespace otrix::net
+{
+
+class socket;
+
+struct poll_event
+{
+    uint32_t events; /**< Mask of poll_event_flags **/
+    void *ctx;       /**< Context passed to event_poll::add() **/
+};
+
+/**
+ * Readiness multiplexer for sockets (similar to epoll).
+ *
+ * Sockets report state changes to every event_poll they are registered in,
+ * which puts them to the ready list. wait() returns ready sockets in a batch.
+ * Level-triggered registrations stay in the ready list for as long as
+ * the socket remains ready, edge-triggered ones are reported once per state change.
+ */
+class event_poll
+{
+public:
+    event_poll();
+    ~event_poll();
+
+    event_poll(const event_poll &other) = delete;
+    event_poll(event_poll &&other) = delete;
+
+    event_poll &operator=(const event_poll &other) = delete;
+    event_poll &operator=(event_poll &&other) = delete;
+
+    /**
+     * Start watching the socket.
+     *
+     * @param[in] sock Socket to watch.
+     * @param[in] events Mask of poll_event_flags of interest.
+     * @param[in] ctx Context reported in poll_event for this socket.
+     * @param[in] edge_triggered Report readiness only once per state change.
+     * @retval E_ADDRINUSE The socket is already registered.
+     */
+    kerror_t add(socket *sock, uint32_t events, void *ctx, bool edge_triggered = false);
+
+    /**
+     * Change events of interest and context of already registered socket.
+     */
+    kerror_t modify(socket *sock, uint32_t events, void *ctx);
+
+    kerror_t remove(socket *sock);
+
+    /**
+     * Wait for at least one socket to become ready.
+     *
+     * @param[out] p_events Array to fill with ready sockets.
+     * @param[in] max_events Size of p_events.
+     * @param[in] timeout_ms Time to wait if no socket is ready, 0 to poll.
+     *
+     * @return Number of filled entries, 0 on timeout.
+     */
+    size_t wait(poll_event *p_events, size_t max_events, uint64_t timeout_ms = -1);
+
+private:
+
+    struct entry_t
+    {
+        intrusive_list socket_node; // Entry in socket::poll_entries_
+        intrusive_list poll_node;   // Entry in entries_
+        intrusive_list ready_node;  // Entry in ready_list_
+        event_poll *poller;
+        socket *sock;
+        uint32_t events;
+        void *ctx;
+        bool edge_triggered;
+        bool ready;
+    };
+
+    entry_t *find(socket *sock);
+    void make_ready(entry_t *entry);
+    void destroy(entry_t *entry);
+
+    // Called by socket::notify_pollers()
+    static void signal(intrusive_list *socket_entries, uint32_t events);
+
+    intrusive_list *entries_;
+    intrusive_list *ready_list_;
+    waitq ready_waitq_;
+
+    friend class socket;
+};
+
+} // namespace otrix::net
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "common/list.h"
+#include "kernel/tunable.hpp"
+
+namespace otrix::net
+{
+
+class sockbuf;
+
+/**
+ * Generic receive offload.
+ *
+ * In-order TCP segments of a flow received within one batch are held and
+ * delivered as a single coalesced segment, so the IPv4 and TCP layers process
+ * them once. Held segments are delivered on flush(), which is called at the
+ * end of a receive batch, when a segment carries PSH, or when the flow stops
+ * being contiguous.
+ */
+class gro
+{
+public:
+    /**
+     * Called with every received or coalesced frame, takes ownership of it.
+     */
+    typedef void (*deliver_func_t)(sockbuf *skb, void *ctx);
+
+    gro(deliver_func_t p_deliver, void *ctx);
+    ~gro();
+
+    /**
+     * Take received frame with the ethernet header parsed.
+     * Frames which can't be coalesced are delivered right away, after the segments held for their flow.
+     */
+    void receive(sockbuf *skb);
+
+    /**
+     * Deliver all held segments.
+     */
+    void flush();
+
+    size_t num_coalesced() const
+    {
+        return num_coalesced_;
+    }
+
+    size_t num_coalesced_segments() const
+    {
+        return num_coalesced_segments_;
+    }
+
+private:
+    struct flow
+    {
+        uint32_t saddr;
+        uint32_t daddr;
+        uint32_t ports;
+        uint32_t next_seq; // Host order, expected sequence number of the next segment
+        size_t payload_size;
+        size_t num_segments;
+        intrusive_list *p_held; // Oldest first
+    };
+
+    flow *find_flow(uint32_t saddr, uint32_t daddr, uint32_t ports);
+    void flush_flow(flow *p_flow);
+    sockbuf *coalesce(flow *p_flow);
+
+    deliver_func_t p_deliver_;
+    void *deliver_ctx_;
+
+    static constexpr auto MAX_FLOWS = 8;
+    flow flows_[MAX_FLOWS]; // Ordered by age, the oldest is flushed when a new flow doesn't fit
+    size_t num_flows_;
+
+    size_t num_coalesced_;
+    size_t num_coalesced_segments_;
+
+    static tunable<bool> enabled_;
+};
+
+} // namespace otrix::net
@@ -40,6 +40,15 @@ static inline ipv4_t make_ipv4(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
     return a << 24 | b << 16 | c << 8 | d;
 }
 
+/**
+ * Fold 32-bit one's complement sum into 16 bits.
+ */
+static inline uint16_t ip_csum_fold(uint32_t csum)
+{
+    csum = (csum & 0xffff) + (csum >> 16);
+    return (csum & 0xffff) + (csum >> 16);
+}
+
 static inline uint16_t ip_checksum(const uint8_t *p_data, size_t data_size, uint32_t initial_sum = 0)
 {
     uint32_t csum = initial_sum;
@@ -53,9 +62,15 @@ static inline uint16_t ip_checksum(const uint8_t *p_data, size_t data_size, uint
         csum += *reinterpret_cast<const uint8_t *>(hdr_start);
     }
 
-    return ~((csum & 0xffff) + ((csum & 0xffff0000) >> 16));
+    return ~ip_csum_fold(csum);
 }
 
+/**
+ * Parse address in dotted-decimal notation (e.g. "20.0.0.2").
+ * Signature matches tunable parser, so the address can be given as a boot option.
+ */
+bool parse_ipv4(const char *str, size_t len, ipv4_t *p_out);
+
 typedef void (*l3_handler_t)(sockbuf *data, void *ctx);
 
 /**
@@ -70,6 +85,16 @@ public:
 
     size_t headers_size() const;
 
+    /**
+     * Offloads of the underlying link, bitmask of linkif_offload.
+     */
+    uint32_t offloads() const;
+
+    linkif *link() const
+    {
+        return link_;
+    }
+
     ipv4_t get_addr() const
     {
         return addr_;
@@ -8,9 +8,22 @@ namespace otrix::net
 {
 
 class sockbuf;
+class packet_filter;
 
 typedef void (*l3_handler_t)(sockbuf *data, void *ctx);
 
+/**
+ * Work the link can do on behalf of upper layers.
+ */
+enum linkif_offload : uint32_t
+{
+    LINKIF_OFFLOAD_TX_CSUM = 1 << 0, // L4 checksum of sockbufs marked with sockbuf::set_csum_partial()
+    LINKIF_OFFLOAD_RX_CSUM = 1 << 1, // Verified packets are marked with sockbuf::set_csum_valid()
+    LINKIF_OFFLOAD_GSO     = 1 << 2, // TCP units marked with sockbuf::set_gso_size() are split by the link,
+                                     // their checksum is left partial
+    LINKIF_OFFLOAD_TSO4    = 1 << 3, // GSO is done by the device for IPv4
+};
+
 /**
  * Represents link layer
  */
@@ -23,6 +36,48 @@ public:
     virtual kerror_t subscribe_to_rx(ethertype type, l3_handler_t p_handler, void *ctx) = 0;
 
     virtual size_t headers_size() const = 0;
+
+    /**
+     * Supported offloads, bitmask of linkif_offload.
+     */
+    virtual uint32_t offloads() const
+    {
+        return 0;
+    }
+
+    /**
+     * Filter run on received frames before they reach the stack, nullptr if the link has none.
+     */
+    virtual packet_filter *rx_packet_filter()
+    {
+        return nullptr;
+    }
+
+    /**
+     * Start processing received frames in the calling thread, see busy_poll().
+     * @return false if the link doesn't support busy polling.
+     */
+    virtual bool busy_poll_begin()
+    {
+        return false;
+    }
+
+    /**
+     * Process up to @c budget received frames per queue in the calling thread, including
+     * the L3 handlers. Receive interrupts stay off until busy_poll_end().
+     * @return Number of frames processed.
+     */
+    virtual size_t busy_poll(size_t /*budget*/)
+    {
+        return 0;
+    }
+
+    /**
+     * Return receive processing to the link once the last busy poller is done.
+     */
+    virtual void busy_poll_end()
+    {
+    }
 };
 
 } // namespace otrix::net
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "common/error.h"
+#include "net/ethernet.hpp"
+#include "net/ipv4.hpp"
+
+namespace otrix::net
+{
+
+enum class filter_action: uint8_t
+{
+    pass, // Hand the frame to the stack
+    drop, // Recycle the frame without any processing
+    tx,   // Send the frame back out of the link it came from, as left by the rule
+    next, // Rule doesn't apply, evaluate the next one (callable rules only)
+};
+
+/**
+ * Filter callable, may modify the frame before returning filter_action::tx.
+ */
+typedef filter_action (*filter_func_t)(uint8_t *p_frame, size_t size, void *ctx);
+
+/**
+ * Table rule, all fields in host order. Zero fields match anything.
+ */
+struct filter_rule
+{
+    ethertype type;
+    ipproto_t proto;
+    ipv4_t src_addr;
+    uint8_t src_prefix_len;
+    ipv4_t dst_addr;
+    uint8_t dst_prefix_len;
+    uint16_t dst_port_min; // TCP or UDP destination port range
+    uint16_t dst_port_max;
+    uint8_t tcp_flags_mask; // Matches when (flags & tcp_flags_mask) == tcp_flags
+    uint8_t tcp_flags;
+    filter_action action;
+};
+
+/**
+ * Early receive filter run by the link on raw ethernet frames, before socket buffers are created.
+ *
+ * Rules are evaluated in the order they were added, the first matching one decides.
+ * Table rules are compiled into network order masks when added, so a frame is parsed
+ * once and matched with plain compares. Frames matching no rule pass.
+ */
+class packet_filter
+{
+public:
+    packet_filter();
+
+    /**
+     * @retval E_NOMEM Rule table is full.
+     * @retval E_INVAL Prefix length is out of range.
+     */
+    kerror_t add_rule(const filter_rule &rule);
+
+    /**
+     * Add callable rule, its filter_action::next result continues evaluation.
+     * @retval E_NOMEM Rule table is full.
+     */
+    kerror_t add_rule(filter_func_t p_func, void *ctx);
+
+    void clear();
+
+    filter_action run(uint8_t *p_frame, size_t size);
+
+    bool empty() const
+    {
+        return 0 == num_rules_;
+    }
+
+    size_t hits(size_t rule_index) const
+    {
+        return rule_index < num_rules_ ? rules_[rule_index].hits : 0;
+    }
+
+    void print_stats() const;
+
+private:
+    struct compiled_rule
+    {
+        filter_func_t p_func; // Callable rule if not null
+        void *ctx;
+        uint16_t type; // Network order
+        uint8_t proto;
+        uint32_t src_mask; // Network order
+        uint32_t src_addr;
+        uint32_t dst_mask;
+        uint32_t dst_addr;
+        uint16_t dst_port_min;
+        uint16_t dst_port_max;
+        uint8_t tcp_flags_mask;
+        uint8_t tcp_flags;
+        filter_action action;
+        size_t hits;
+    };
+
+    static constexpr auto MAX_RULES = 32;
+    compiled_rule rules_[MAX_RULES];
+    size_t num_rules_;
+
+    size_t num_frames_;
+    size_t num_dropped_;
+    size_t num_tx_;
+};
+
+} // namespace otrix::net
@@ -30,7 +30,9 @@ public:
     typedef void (*free_func_t)(void *buf, size_t size, void *ctx);
 
     sockbuf(size_t headers_size, const uint8_t *payload, size_t payload_size):
-        buffer_size_(headers_size + payload_size), payload_size_(payload_size), free_func_(nullptr), node_(this)
+        buffer_size_(headers_size + payload_size), payload_size_(payload_size), free_func_(nullptr),
+        payload_free_func_(nullptr), payload_free_func_ctx_(nullptr), linear_(true), csum_header_(sockbuf_header_t::max),
+        csum_offset_(0), csum_valid_(false), gso_size_(0), node_(this)
     {
         start_ = (uint8_t *)otrix::alloc(headers_size + payload_size);
         if (nullptr != start_) {
@@ -48,13 +50,31 @@ public:
     // Zero-copy interface
     sockbuf(uint8_t *data, size_t data_size, free_func_t free_func, void *free_func_ctx):
         start_(data), buffer_size_(data_size), payload_(data), head_(data), payload_size_(data_size), free_func_(free_func),
-        free_func_ctx_(free_func_ctx), node_(this)
+        free_func_ctx_(free_func_ctx), payload_free_func_(nullptr), payload_free_func_ctx_(nullptr), linear_(true),
+        csum_header_(sockbuf_header_t::max), csum_offset_(0), csum_valid_(false), gso_size_(0), node_(this)
     {
         for (auto &hdr : headers_) {
             hdr = nullptr;
         }
     }
 
+    // Zero-copy transmit interface: only headers are allocated, payload is referenced
+    // and released with payload_free_func once the socket buffer is destroyed
+    sockbuf(size_t headers_size, uint8_t *payload, size_t payload_size,
+            free_func_t payload_free_func, void *payload_free_func_ctx):
+        buffer_size_(headers_size), payload_(payload), head_(nullptr), payload_size_(payload_size), free_func_(nullptr),
+        payload_free_func_(payload_free_func), payload_free_func_ctx_(payload_free_func_ctx), linear_(false),
+        csum_header_(sockbuf_header_t::max), csum_offset_(0), csum_valid_(false), gso_size_(0), node_(this)
+    {
+        start_ = (uint8_t *)otrix::alloc(headers_size);
+        if (nullptr != start_) {
+            head_ = start_ + headers_size;
+            for (auto &hdr : headers_) {
+                hdr = nullptr;
+            }
+        }
+    }
+
     sockbuf& operator=(const sockbuf &other) = default;
 
     sockbuf(sockbuf &&other): node_(this)
@@ -70,10 +90,60 @@ public:
         other.payload_size_ = 0;
         other.free_func_ = nullptr;
         other.free_func_ctx_ = nullptr;
+        other.payload_free_func_ = nullptr;
+        other.payload_free_func_ctx_ = nullptr;
+        other.linear_ = true;
+    }
+
+    /**
+     * Socket buffers are preceded by an allocation tag, so the ones constructed in caller-provided
+     * storage (e.g. headroom of a receive buffer) are deleted like heap ones without freeing memory.
+     */
+    static constexpr size_t ALLOC_TAG_SIZE = 16;
+
+    static void *operator new(size_t size) noexcept
+    {
+        uint8_t *p_tag = (uint8_t *)otrix::alloc(ALLOC_TAG_SIZE + size);
+        if (nullptr == p_tag) {
+            return nullptr;
+        }
+        *reinterpret_cast<uint64_t *>(p_tag) = ALLOC_TAG_HEAP;
+        return p_tag + ALLOC_TAG_SIZE;
+    }
+
+    /**
+     * Construct socket buffer in @c p_storage, which must hold ALLOC_TAG_SIZE + sizeof(sockbuf) bytes
+     * and outlive the socket buffer.
+     */
+    static void *operator new(size_t size, void *p_storage) noexcept
+    {
+        (void)size;
+        *reinterpret_cast<uint64_t *>(p_storage) = ALLOC_TAG_EMBEDDED;
+        return (uint8_t *)p_storage + ALLOC_TAG_SIZE;
+    }
+
+    static void operator delete(void *ptr)
+    {
+        if (nullptr == ptr) {
+            return;
+        }
+        uint8_t *p_tag = (uint8_t *)ptr - ALLOC_TAG_SIZE;
+        if (ALLOC_TAG_HEAP == *reinterpret_cast<uint64_t *>(p_tag)) {
+            otrix::free(p_tag);
+        }
+    }
+
+    static void operator delete(void *ptr, void *p_storage)
+    {
+        (void)ptr;
+        (void)p_storage;
     }
 
     ~sockbuf()
     {
+        if (nullptr != payload_free_func_) {
+            payload_free_func_(payload_, payload_size_, payload_free_func_ctx_);
+        }
         if (nullptr != free_func_) {
             free_func_(start_, buffer_size_, free_func_ctx_);
         } else if (nullptr != start_) {
@@ -93,7 +163,24 @@ public:
 
     size_t size() const
     {
-        return (payload_ - head_) + payload_size_;
+        return headers_size() + payload_size_;
+    }
+
+    /**
+     * Check if headers and payload are in one contiguous buffer starting at data().
+     * Otherwise data() holds headers_size() bytes and the payload is referenced separately.
+     */
+    bool linear() const
+    {
+        return linear_;
+    }
+
+    size_t headers_size() const
+    {
+        if (linear()) {
+            return payload_ - head_;
+        }
+        return (start_ + buffer_size_) - head_;
     }
 
     uint8_t *add_header(size_t header_size, sockbuf_header_t type)
@@ -155,6 +242,59 @@ public:
         return payload_size_;
     }
 
+    /**
+     * Leave the checksum of @c header to the link (see LINKIF_OFFLOAD_TX_CSUM).
+     * Checksum field at @c csum_offset from the header holds the folded pseudo-header sum,
+     * the link adds the header and everything after it.
+     */
+    void set_csum_partial(sockbuf_header_t header, uint16_t csum_offset)
+    {
+        csum_header_ = header;
+        csum_offset_ = csum_offset;
+    }
+
+    bool csum_partial() const
+    {
+        return sockbuf_header_t::max != csum_header_;
+    }
+
+    sockbuf_header_t csum_header() const
+    {
+        return csum_header_;
+    }
+
+    uint16_t csum_offset() const
+    {
+        return csum_offset_;
+    }
+
+    /**
+     * Mark checksum of the received packet as verified by the link (see LINKIF_OFFLOAD_RX_CSUM).
+     */
+    void set_csum_valid(bool valid)
+    {
+        csum_valid_ = valid;
+    }
+
+    bool csum_valid() const
+    {
+        return csum_valid_;
+    }
+
+    /**
+     * Mark payload as a TCP unit to be split into segments of @c segment_size bytes by the link
+     * (see LINKIF_OFFLOAD_GSO), 0 for a single segment.
+     */
+    void set_gso_size(uint16_t segment_size)
+    {
+        gso_size_ = segment_size;
+    }
+
+    uint16_t gso_size() const
+    {
+        return gso_size_;
+    }
+
     struct node_t {
         node_t(sockbuf *skb): p_skb(skb)
         {}
@@ -171,6 +311,9 @@ public:
     }
 
 private:
+    static constexpr uint64_t ALLOC_TAG_HEAP = 0;
+    static constexpr uint64_t ALLOC_TAG_EMBEDDED = 1;
+
     uint8_t *start_;
     size_t buffer_size_;
     uint8_t *headers_[(int)sockbuf_header_t::max];
@@ -179,6 +322,13 @@ private:
     size_t payload_size_;
     free_func_t free_func_;
     void *free_func_ctx_;
+    free_func_t payload_free_func_;
+    void *payload_free_func_ctx_;
+    bool linear_; // Payload is in the buffer right after the headers
+    sockbuf_header_t csum_header_; // Header with partial checksum, max if the checksum is complete
+    uint16_t csum_offset_;
+    bool csum_valid_;
+    uint16_t gso_size_;
     node_t node_;
 };
 
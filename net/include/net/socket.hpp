@@ -2,7 +2,10 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <algorithm>
 #include "common/error.h"
+#include "common/list.h"
+#include "kernel/tunable.hpp"
 
 #include "net/ipv4.hpp"
 
@@ -19,10 +22,21 @@ enum socket_type
     sock_stream,
 };
 
+enum poll_event_flags: uint32_t
+{
+    POLL_IN  = 1 << 0, /**< Data can be received or connection can be accepted **/
+    POLL_OUT = 1 << 1, /**< Data can be sent without blocking **/
+    POLL_ERR = 1 << 2, /**< Error condition, always reported **/
+    POLL_HUP = 1 << 3, /**< Remote end closed the connection, always reported **/
+};
+
+class event_poll;
+
 class socket
 {
 public:
-    virtual ~socket() {}
+    socket();
+    virtual ~socket();
 
     virtual size_t send(const void *data, size_t data_size) = 0;
     virtual size_t recv(void *data, size_t data_size) = 0;
@@ -32,6 +46,51 @@ public:
     virtual socket *accept(uint64_t timeout_ms = -1) = 0;
     virtual kerror_t shutdown(bool read, bool write) = 0;
 
+    /**
+     * Retrieve current readiness of the socket as a mask of poll_event_flags.
+     */
+    virtual uint32_t poll_events() const = 0;
+
+    /**
+     * In non-blocking mode recv() and send() return immediately
+     * with the amount of data which could be transferred without waiting.
+     */
+    void set_nonblocking(bool nonblocking)
+    {
+        nonblocking_ = nonblocking;
+    }
+
+    /**
+     * Busy poll the link for up to @c timeout_us before recv() blocks, so data arriving
+     * within that time is received without the interrupt and thread wake-ups. 0 disables it.
+     */
+    void set_busy_poll(uint64_t timeout_us)
+    {
+        busy_poll_us_ = std::min<uint64_t>(timeout_us, MAX_BUSY_POLL_US);
+    }
+
+    struct busy_poll_stats_t
+    {
+        uint64_t polls;      /**< Busy polls started by recv() **/
+        uint64_t successes;  /**< Busy polls which ended with data or a closed connection **/
+        uint64_t wasted_tsc; /**< TSC ticks spent in busy polls which timed out **/
+    };
+
+    const busy_poll_stats_t &busy_poll_stats() const
+    {
+        return busy_poll_stats_;
+    }
+
+    /**
+     * Statistics accumulated over all sockets.
+     */
+    static const busy_poll_stats_t &global_busy_poll_stats()
+    {
+        return global_busy_poll_stats_;
+    }
+
+    static void print_busy_poll_stats();
+
     ipv4_t get_remote_addr() const
     {
         return remote_addr_;
@@ -43,8 +102,31 @@ public:
     }
 
 protected:
+    /**
+     * Inform event_poll instances watching this socket about new events.
+     */
+    void notify_pollers(uint32_t events);
+
+    /**
+     * Account busy poll which started at @c start_tsc and has just ended.
+     */
+    void account_busy_poll(uint64_t start_tsc, bool success);
+
     ipv4_t remote_addr_;
     uint16_t remote_port_;
+    bool nonblocking_;
+    uint64_t busy_poll_us_;
+
+private:
+    intrusive_list *poll_entries_; // event_poll registrations of this socket
+
+    // Receive interrupts of the link are off while a socket busy polls
+    static constexpr uint64_t MAX_BUSY_POLL_US = 500;
+    busy_poll_stats_t busy_poll_stats_;
+    static busy_poll_stats_t global_busy_poll_stats_;
+    static tunable<uint64_t> default_busy_poll_us_;
+
+    friend class event_poll;
 };
 
 } // namespace otrix::net
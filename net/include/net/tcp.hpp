@@ -2,7 +2,9 @@
 
 #include "common/hash_map.hpp"
 #include "common/error.h"
+#include "common/utils.h"
 #include "net/ipv4.hpp"
+#include "kernel/tunable.hpp"
 #include <functional>
 
 namespace otrix::net
@@ -32,6 +34,35 @@ struct tcp_header
     uint16_t urp;
 } __attribute__((packed));
 
+struct ipv4_pseudo_header
+{
+    uint32_t source_addr;
+    uint32_t dest_addr;
+    uint8_t zero;
+    uint8_t proto;
+    uint16_t tcp_length;
+} __attribute__((packed));
+
+/**
+ * One's complement sum of the pseudo header, not folded.
+ */
+static inline uint32_t tcp_pseudo_header_sum(ipv4_t source_network_order, ipv4_t dest_network_order, size_t tcp_length)
+{
+    ipv4_pseudo_header pseudo_ip;
+    pseudo_ip.source_addr = source_network_order;
+    pseudo_ip.dest_addr = dest_network_order;
+    pseudo_ip.zero = 0;
+    pseudo_ip.proto = (uint8_t)ipproto_t::tcp;
+    pseudo_ip.tcp_length = htons(tcp_length);
+    const uint16_t *ptr = (const uint16_t *)&pseudo_ip;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < sizeof(pseudo_ip) / sizeof(uint16_t); i++) {
+        sum += *ptr;
+        ptr++;
+    }
+    return sum;
+}
+
 
 class socket;
 class tcp_socket;
@@ -81,17 +112,31 @@ public:
 
     size_t headers_size() const;
 
+    /**
+     * Offloads of the underlying link, bitmask of linkif_offload.
+     */
+    uint32_t offloads() const;
+
+    linkif *link() const;
+
 private:
 
     void process_packet(sockbuf *data);
 
+    /**
+     * Set checksum of outgoing segment, or leave it to the link if it offloads checksums.
+     */
+    void fill_checksum(sockbuf *buf, ipv4_t dest_address_network_order);
+
     ipv4 *ip_layer_;
 
     static constexpr auto TCP_LISTEN_TABLE_SIZE = 257;
+    static tunable<size_t> listen_table_size_;
     // uint16_t -> tcp_socket*
     hash_map<socket_id> listen_sockets_; /**< Map of listening sockets identified by host port only **/
 
     static constexpr auto TCP_CONNECTED_TABLE_SIZE = 257;
+    static tunable<size_t> connected_table_size_;
     // connected_socket_id -> tcp_socket*
     hash_map<socket_id> connected_sockets_; /**< Rest of the sockets identified by more fields **/
 };
@@ -45,6 +45,7 @@ public:
     kerror_t listen(size_t backlog_size) override;
     socket *accept(uint64_t timeout_ms = -1) override;
     kerror_t shutdown(bool read, bool write) override;
+    uint32_t poll_events() const override;
 
     struct node_t {
         node_t(tcp_socket *sock): p_socket(sock)
@@ -84,6 +85,11 @@ private:
 
     uint32_t generate_isn();
 
+    /**
+     * Poll the link until data or FIN arrives, for up to busy_poll_us_.
+     */
+    void busy_poll();
+
     static constexpr auto INVALID_PORT = 0xFFFFFFFF;
 
     struct syn_cache_entry
@@ -93,6 +99,7 @@ private:
     };
 
     static constexpr auto SYN_CACHE_TABLE_SIZE = 17;
+    static tunable<size_t> syn_cache_table_size_;
     // socket_id -> syn_cache_entry
     pooled_hash_map<tcp::socket_id, syn_cache_entry> *syn_cache_;
 
@@ -116,6 +123,13 @@ private:
 
     static constexpr auto TCP_MSS = 1460;
     static constexpr auto TCP_INITIAL_WINDOW_SIZE = TCP_MSS * 20;
+    static tunable<size_t> mss_;
+    static tunable<size_t> initial_window_size_; // Bounded by 16-bit window field, no window scaling
+    // Largest unit passed to a GSO capable link, bounded by 16-bit IP total length
+    static constexpr auto TCP_GSO_MAX_SIZE = UINT16_MAX - sizeof(ip_hdr) - sizeof(tcp_header);
+    static tunable<bool> gso_;
+
+    static constexpr auto BUSY_POLL_BUDGET = 8; // Frames per RX queue processed in one poll
 };
 
 } // otrix::net
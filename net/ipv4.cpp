@@ -5,6 +5,7 @@
 #include "net/sockbuf.hpp"
 #include "arch/asm.h"
 #include "otrix/immediate_console.hpp"
+#include "kernel/kbench.hpp"
 
 namespace otrix::net
 {
@@ -17,6 +18,39 @@ ipv4::ipv4(linkif *link, arp *arp, ipv4_t addr, ipv4_t gateway): link_(link), ar
             }, this);
 }
 
+bool parse_ipv4(const char *str, size_t len, ipv4_t *p_out)
+{
+    if (nullptr == str) {
+        return false;
+    }
+
+    ipv4_t addr = 0;
+    uint32_t octet = 0;
+    int num_digits = 0;
+    int num_octets = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || '.' == str[i]) {
+            if (0 == num_digits || octet > 0xff) {
+                return false;
+            }
+            addr = (addr << 8) | octet;
+            octet = 0;
+            num_digits = 0;
+            num_octets++;
+        } else if (str[i] >= '0' && str[i] <= '9' && num_digits < 3) {
+            octet = octet * 10 + (str[i] - '0');
+            num_digits++;
+        } else {
+            return false;
+        }
+    }
+    if (4 != num_octets) {
+        return false;
+    }
+    *p_out = addr;
+    return true;
+}
+
 static constexpr uint8_t VERSION_IHL_IPV4 = (4 << 4) | (sizeof(ip_hdr) / sizeof(uint32_t));
 
 kerror_t ipv4::write(sockbuf *data, ipv4_t dest, ipproto_t proto, uint64_t timeout_ms)
@@ -50,6 +84,11 @@ size_t ipv4::headers_size() const
     return sizeof(ip_hdr) + link_->headers_size();
 }
 
+uint32_t ipv4::offloads() const
+{
+    return link_->offloads();
+}
+
 kerror_t ipv4::subscribe_to_rx(ipproto_t type, l3_handler_t p_handler, void *ctx)
 {
     auto flags = arch_irq_save();
@@ -100,3 +139,19 @@ void ipv4::process_packet(sockbuf *data)
 }
 
 } // namespace otrix::net
+
+KBENCH(ip_checksum_header)
+{
+    static uint8_t data[sizeof(otrix::net::ip_hdr)];
+    while (s.run()) {
+        otrix::kbench::do_not_optimize(otrix::net::ip_checksum(data, sizeof(data)));
+    }
+}
+
+KBENCH(ip_checksum_1500)
+{
+    static uint8_t data[1500];
+    while (s.run()) {
+        otrix::kbench::do_not_optimize(otrix::net::ip_checksum(data, sizeof(data)));
+    }
+}
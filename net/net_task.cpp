@@ -2,6 +2,9 @@
 #include <memory>
 
 #include "kernel/kthread.hpp"
+#include "kernel/boot_info.hpp"
+#include "kernel/boot_trace.hpp"
+#include "kernel/tunable.hpp"
 #include "dev/pci.hpp"
 #include "dev/virtio_net.hpp"
 #include "otrix/immediate_console.hpp"
@@ -11,9 +14,20 @@
 #include "net/icmp.hpp"
 #include "net/tcp.hpp"
 #include "net/socket.hpp"
+#include "net/event_poll.hpp"
 
 namespace otrix::net {
 
+static constexpr auto NET_TASK_STACK_SIZE = 64 * 1024;
+static constexpr auto NET_TASK_PRIORITY = 2;
+static constexpr auto TCP_SERVER_PORT = 80;
+
+static tunable<ipv4_t> address("net.addr", make_ipv4(20, 0, 0, 2), parse_ipv4);
+static tunable<ipv4_t> gateway("net.gateway", make_ipv4(20, 0, 0, 1), parse_ipv4);
+static tunable<uint16_t> server_port("net.tcp_server_port", TCP_SERVER_PORT, 1, UINT16_MAX);
+static tunable<size_t> stack_size("net_task.stack_size", NET_TASK_STACK_SIZE, 4096, 1024 * 1024);
+static tunable<int> priority("net_task.priority", NET_TASK_PRIORITY, 0, scheduler::NUM_PRIORITIES - 1);
+
 static void tcp_server(tcp *p_tcp, uint16_t port)
 {
     std::shared_ptr<socket> srv = std::shared_ptr<socket>(p_tcp->create_socket());
@@ -34,50 +48,76 @@ static void tcp_server(tcp *p_tcp, uint16_t port)
         return;
     }
 
+    event_poll poller;
+    ret = poller.add(srv.get(), POLL_IN, srv.get());
+    if (E_OK != ret) {
+        immediate_console::print("Failed to poll listening socket, err %d\n", ret);
+        return;
+    }
+
     immediate_console::print("Listening for incoming connections on port %d\n", port);
 
+    static constexpr auto MAX_EVENTS = 16;
+    poll_event events[MAX_EVENTS];
     while (true) {
-        socket *client = srv->accept();
-        immediate_console::print("Accepted connection from %p %08x:%d\n", client, client->get_remote_addr(), client->get_remote_port());
-        while (true) {
+        const size_t num_events = poller.wait(events, MAX_EVENTS);
+        for (size_t i = 0; i < num_events; i++) {
+            socket *sock = (socket *)events[i].ctx;
+            if (sock == srv.get()) {
+                socket *client = nullptr;
+                while (nullptr != (client = srv->accept(0))) {
+                    immediate_console::print("Accepted connection from %p %08x:%d\n", client, client->get_remote_addr(), client->get_remote_port());
+                    client->set_nonblocking(true);
+                    if (E_OK != poller.add(client, POLL_IN, client)) {
+                        delete client;
+                    }
+                }
+                continue;
+            }
+
             char buf[256];
-            const size_t recv_ret = client->recv(buf, sizeof(buf));
-            if (recv_ret > 0) {
-                const size_t send_ret = client->send(buf, recv_ret);
+            size_t recv_ret = 0;
+            while ((recv_ret = sock->recv(buf, sizeof(buf))) > 0) {
+                const size_t send_ret = sock->send(buf, recv_ret);
                 if (send_ret != recv_ret) {
                     immediate_console::print("Failed to send %lu %lu\r\n", send_ret, recv_ret);
                 }
-            } else {
+            }
+            if (events[i].events & (POLL_HUP | POLL_ERR)) {
                 immediate_console::print("Remote connection closed\r\n");
-                break;
+                if (0 != socket::global_busy_poll_stats().polls) {
+                    socket::print_busy_poll_stats();
+                }
+                poller.remove(sock);
+                delete sock;
             }
         }
-        delete client;
     }
 }
 
 static void net_task_entry(void *arg)
 {
     otrix::dev::virtio_net net((otrix::dev::pci_dev *)arg);
-    immediate_console::print("Net device created:\n");
-    net.print_info();
-    const auto address = net::make_ipv4(20, 0, 0, 2);
-    const auto gateway = net::make_ipv4(20, 0, 0, 1);
+    if (!boot_info::fast_boot()) {
+        immediate_console::print("Net device created:\n");
+        net.print_info();
+    }
     net::arp arp_layer(&net, address);
     net::ipv4 ip_layer(&net, &arp_layer, address, gateway);
     net::icmp icmp_layer(&ip_layer);
     net::tcp tcp_layer(&ip_layer);
     arp_layer.announce();
     arp_layer.send_request(gateway);
+    boot_trace::complete("net");
 
-    tcp_server(&tcp_layer, 80);
+    tcp_server(&tcp_layer, server_port);
 
     scheduler::get().sleep(-1);
 }
 
 void net_task_start(otrix::dev::pci_dev *net_dev)
 {
-    kthread *net_task = new kthread(64 * 1024 / sizeof(uint64_t), net_task_entry, "net_task", 2, net_dev);
+    kthread *net_task = new kthread(stack_size / sizeof(uint64_t), net_task_entry, "net_task", priority, net_dev);
     otrix::scheduler::get().add_thread(net_task);
 }
 
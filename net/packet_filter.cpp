@@ -0,0 +1,183 @@
+#include "net/packet_filter.hpp"
+#include <cstring>
+#include "common/utils.h"
+#include "arch/asm.h"
+#include "otrix/immediate_console.hpp"
+
+namespace otrix::net
+{
+
+static constexpr size_t TCP_FLAGS_OFFSET = 13;
+
+// Fields of a frame the rules match on, network order
+struct filter_frame
+{
+    uint16_t type;
+    bool has_ip;
+    uint8_t proto;
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    bool has_ports;
+    uint16_t dst_port; // Host order
+    bool has_tcp_flags;
+    uint8_t tcp_flags;
+};
+
+static void parse_frame(const uint8_t *p_frame, size_t size, filter_frame *p_out)
+{
+    memset(p_out, 0, sizeof(*p_out));
+    if (size < sizeof(ethernet_hdr)) {
+        return;
+    }
+    const ethernet_hdr *p_eth = reinterpret_cast<const ethernet_hdr *>(p_frame);
+    p_out->type = p_eth->ethertype;
+    if (htons(static_cast<uint16_t>(ethertype::ipv4)) != p_eth->ethertype ||
+        size < sizeof(ethernet_hdr) + sizeof(ip_hdr))
+    {
+        return;
+    }
+    const ip_hdr *p_ip = reinterpret_cast<const ip_hdr *>(p_frame + sizeof(ethernet_hdr));
+    p_out->has_ip = true;
+    p_out->proto = p_ip->proto;
+    p_out->src_addr = p_ip->saddr;
+    p_out->dst_addr = p_ip->daddr;
+
+    // Ports are only in the first fragment
+    const size_t ip_header_size = (p_ip->version_ihl & 0xf) * sizeof(uint32_t);
+    const size_t l4_offset = sizeof(ethernet_hdr) + ip_header_size;
+    if (0 != (ntohs(p_ip->flags_offset) & 0x1fff) || ip_header_size < sizeof(ip_hdr)) {
+        return;
+    }
+    if ((uint8_t)ipproto_t::tcp != p_ip->proto && (uint8_t)ipproto_t::udp != p_ip->proto) {
+        return;
+    }
+    if (size < l4_offset + 2 * sizeof(uint16_t)) {
+        return;
+    }
+    const uint16_t *p_ports = reinterpret_cast<const uint16_t *>(p_frame + l4_offset);
+    p_out->has_ports = true;
+    p_out->dst_port = ntohs(p_ports[1]);
+    if ((uint8_t)ipproto_t::tcp == p_ip->proto && size > l4_offset + TCP_FLAGS_OFFSET) {
+        p_out->has_tcp_flags = true;
+        p_out->tcp_flags = p_frame[l4_offset + TCP_FLAGS_OFFSET];
+    }
+}
+
+static uint32_t prefix_mask(uint8_t prefix_len)
+{
+    return 0 == prefix_len ? 0 : htonl(~0u << (32 - prefix_len));
+}
+
+packet_filter::packet_filter(): num_rules_(0), num_frames_(0), num_dropped_(0), num_tx_(0)
+{
+}
+
+kerror_t packet_filter::add_rule(const filter_rule &rule)
+{
+    if (rule.src_prefix_len > 32 || rule.dst_prefix_len > 32 || filter_action::next == rule.action) {
+        return E_INVAL;
+    }
+    compiled_rule compiled;
+    compiled.p_func = nullptr;
+    compiled.ctx = nullptr;
+    compiled.type = htons(static_cast<uint16_t>(rule.type));
+    compiled.proto = (uint8_t)rule.proto;
+    compiled.src_mask = prefix_mask(rule.src_prefix_len);
+    compiled.src_addr = htonl(rule.src_addr) & compiled.src_mask;
+    compiled.dst_mask = prefix_mask(rule.dst_prefix_len);
+    compiled.dst_addr = htonl(rule.dst_addr) & compiled.dst_mask;
+    compiled.dst_port_min = rule.dst_port_min;
+    compiled.dst_port_max = 0 == rule.dst_port_max ? rule.dst_port_min : rule.dst_port_max;
+    compiled.tcp_flags_mask = rule.tcp_flags_mask;
+    compiled.tcp_flags = rule.tcp_flags & rule.tcp_flags_mask;
+    compiled.action = rule.action;
+    compiled.hits = 0;
+
+    auto flags = arch_irq_save();
+    if (MAX_RULES == num_rules_) {
+        arch_irq_restore(flags);
+        return E_NOMEM;
+    }
+    rules_[num_rules_++] = compiled;
+    arch_irq_restore(flags);
+    return E_OK;
+}
+
+kerror_t packet_filter::add_rule(filter_func_t p_func, void *ctx)
+{
+    if (nullptr == p_func) {
+        return E_INVAL;
+    }
+    auto flags = arch_irq_save();
+    if (MAX_RULES == num_rules_) {
+        arch_irq_restore(flags);
+        return E_NOMEM;
+    }
+    compiled_rule &compiled = rules_[num_rules_++];
+    memset(&compiled, 0, sizeof(compiled));
+    compiled.p_func = p_func;
+    compiled.ctx = ctx;
+    compiled.action = filter_action::next;
+    arch_irq_restore(flags);
+    return E_OK;
+}
+
+void packet_filter::clear()
+{
+    auto flags = arch_irq_save();
+    num_rules_ = 0;
+    arch_irq_restore(flags);
+}
+
+filter_action packet_filter::run(uint8_t *p_frame, size_t size)
+{
+    num_frames_++;
+    filter_frame frame;
+    parse_frame(p_frame, size, &frame);
+
+    filter_action action = filter_action::pass;
+    for (size_t i = 0; i < num_rules_; i++) {
+        compiled_rule &rule = rules_[i];
+        if (nullptr != rule.p_func) {
+            const filter_action result = rule.p_func(p_frame, size, rule.ctx);
+            if (filter_action::next == result) {
+                continue;
+            }
+            rule.hits++;
+            action = result;
+            break;
+        }
+        if ((0 != rule.type && rule.type != frame.type) ||
+            (0 != rule.proto && (!frame.has_ip || rule.proto != frame.proto)) ||
+            (0 != rule.src_mask && (!frame.has_ip || rule.src_addr != (frame.src_addr & rule.src_mask))) ||
+            (0 != rule.dst_mask && (!frame.has_ip || rule.dst_addr != (frame.dst_addr & rule.dst_mask))) ||
+            (0 != rule.dst_port_max && (!frame.has_ports || frame.dst_port < rule.dst_port_min ||
+                                        frame.dst_port > rule.dst_port_max)) ||
+            (0 != rule.tcp_flags_mask && (!frame.has_tcp_flags ||
+                                          rule.tcp_flags != (frame.tcp_flags & rule.tcp_flags_mask))))
+        {
+            continue;
+        }
+        rule.hits++;
+        action = rule.action;
+        break;
+    }
+
+    if (filter_action::drop == action) {
+        num_dropped_++;
+    } else if (filter_action::tx == action) {
+        num_tx_++;
+    }
+    return action;
+}
+
+void packet_filter::print_stats() const
+{
+    immediate_console::print("Packet filter: %lu frames, %lu dropped, %lu sent back\n",
+            num_frames_, num_dropped_, num_tx_);
+    for (size_t i = 0; i < num_rules_; i++) {
+        immediate_console::print("  rule %lu: %lu hits\n", i, rules_[i].hits);
+    }
+}
+
+} // namespace otrix::net
@@ -0,0 +1,52 @@
+#include "net/socket.hpp"
+#include "net/event_poll.hpp"
+#include "arch/asm.h"
+#include "otrix/immediate_console.hpp"
+
+namespace otrix::net
+{
+
+socket::busy_poll_stats_t socket::global_busy_poll_stats_;
+tunable<uint64_t> socket::default_busy_poll_us_("net.busy_poll_us", 0, 0, MAX_BUSY_POLL_US);
+
+socket::socket(): remote_addr_(0), remote_port_(0), nonblocking_(false), busy_poll_us_(default_busy_poll_us_),
+                  poll_entries_(nullptr), busy_poll_stats_()
+{
+
+}
+
+socket::~socket()
+{
+    // Unregister from all pollers watching this socket
+    while (nullptr != poll_entries_) {
+        event_poll *poller = container_of(poll_entries_, event_poll::entry_t, socket_node)->poller;
+        poller->remove(this);
+    }
+}
+
+void socket::notify_pollers(uint32_t events)
+{
+    event_poll::signal(poll_entries_, events);
+}
+
+void socket::account_busy_poll(uint64_t start_tsc, bool success)
+{
+    busy_poll_stats_.polls++;
+    global_busy_poll_stats_.polls++;
+    if (success) {
+        busy_poll_stats_.successes++;
+        global_busy_poll_stats_.successes++;
+    } else {
+        const uint64_t wasted_tsc = arch_tsc() - start_tsc;
+        busy_poll_stats_.wasted_tsc += wasted_tsc;
+        global_busy_poll_stats_.wasted_tsc += wasted_tsc;
+    }
+}
+
+void socket::print_busy_poll_stats()
+{
+    immediate_console::print("busy poll: %lu polls, %lu successful, wasted %lu ticks\n",
+            global_busy_poll_stats_.polls, global_busy_poll_stats_.successes, global_busy_poll_stats_.wasted_tsc);
+}
+
+} // namespace otrix::net
@@ -1,21 +1,24 @@
 #include "net/tcp.hpp"
+#include <cstddef>
 #include <functional>
 #include "common/utils.h"
 #include "net/sockbuf.hpp"
+#include "net/linkif.hpp"
 #include "net/tcp_socket.hpp"
 #include "otrix/immediate_console.hpp"
 
 namespace otrix::net
 {
 
-struct ipv4_pseudo_header
+// Received segment is linear, header is followed by payload
+static bool verify_checksum(const sockbuf *buf)
 {
-    uint32_t source_addr;
-    uint32_t dest_addr;
-    uint8_t zero;
-    uint8_t proto;
-    uint16_t tcp_length;
-} __attribute__((packed));
+    const ip_hdr *p_ip_hdr = (const ip_hdr *)buf->header(sockbuf_header_t::ip);
+    const uint8_t *p_tcp_hdr = buf->header(sockbuf_header_t::tcp);
+    const size_t tcp_length = buf->payload() + buf->payload_size() - p_tcp_hdr;
+    const uint32_t initial_csum = tcp_pseudo_header_sum(p_ip_hdr->saddr, p_ip_hdr->daddr, tcp_length);
+    return 0 == ip_checksum(p_tcp_hdr, tcp_length, initial_csum);
+}
 
 static size_t tcp_header_size(const sockbuf *buf)
 {
@@ -23,9 +26,12 @@ static size_t tcp_header_size(const sockbuf *buf)
     return (p_hdr->header_len >> 4) * sizeof(uint32_t);
 }
 
+tunable<size_t> tcp::listen_table_size_("tcp.listen_table_size", TCP_LISTEN_TABLE_SIZE, 1, 65536);
+tunable<size_t> tcp::connected_table_size_("tcp.connected_table_size", TCP_CONNECTED_TABLE_SIZE, 1, 65536);
+
 tcp::tcp(ipv4 *ip_layer): ip_layer_(ip_layer),
-                          listen_sockets_(TCP_LISTEN_TABLE_SIZE, [] (const socket_id &key) -> size_t { return key.host_port; }),
-                          connected_sockets_(TCP_CONNECTED_TABLE_SIZE, socket_id::hash_func)
+                          listen_sockets_(listen_table_size_, [] (const socket_id &key) -> size_t { return key.host_port; }),
+                          connected_sockets_(connected_table_size_, socket_id::hash_func)
 {
     ip_layer_->subscribe_to_rx(ipproto_t::tcp, [] (sockbuf *data, void *ctx) {
                 tcp *p_this = (tcp *)ctx;
@@ -40,20 +46,35 @@ socket *tcp::create_socket()
 
 uint16_t tcp::tcp_checksum(const sockbuf *buf, ipv4_t dest_address_network_order)
 {
-    ipv4_pseudo_header pseudo_ip;
-    pseudo_ip.source_addr = htonl(ip_layer_->get_addr());
-    pseudo_ip.dest_addr = dest_address_network_order;
-    pseudo_ip.zero = 0;
-    pseudo_ip.proto = (uint8_t)ipproto_t::tcp;
-    pseudo_ip.tcp_length = ntohs(buf->payload_size() + sizeof(tcp_header));
-    const uint16_t *ptr = (uint16_t *)&pseudo_ip;
-    uint32_t initial_csum = 0;
-    for (size_t i = 0; i < sizeof(pseudo_ip) / sizeof(uint16_t); i++) {
-        initial_csum += *ptr;
-        ptr++;
+    uint32_t initial_csum = tcp_pseudo_header_sum(htonl(ip_layer_->get_addr()), dest_address_network_order,
+            buf->payload_size() + sizeof(tcp_header));
+    const uint16_t *ptr;
+    const uint8_t *p_tcp_hdr = buf->header(sockbuf_header_t::tcp);
+    if (p_tcp_hdr + sizeof(tcp_header) != buf->payload()) {
+        // Zero-copy payload is not contiguous with the header, which is summed separately
+        ptr = (const uint16_t *)p_tcp_hdr;
+        for (size_t i = 0; i < sizeof(tcp_header) / sizeof(uint16_t); i++) {
+            initial_csum += *ptr;
+            ptr++;
+        }
+        return ip_checksum(buf->payload(), buf->payload_size(), initial_csum);
+    }
+    return ip_checksum(p_tcp_hdr, sizeof(tcp_header) + buf->payload_size(), initial_csum);
+}
+
+void tcp::fill_checksum(sockbuf *buf, ipv4_t dest_address_network_order)
+{
+    tcp_header *p_tcp_hdr = (tcp_header *)buf->header(sockbuf_header_t::tcp);
+    p_tcp_hdr->csum = 0;
+    // GSO units are split by the link, which completes checksums of the segments
+    if ((ip_layer_->offloads() & LINKIF_OFFLOAD_TX_CSUM) || 0 != buf->gso_size()) {
+        // Link sums the header and payload on top of the pseudo header
+        p_tcp_hdr->csum = ip_csum_fold(tcp_pseudo_header_sum(htonl(ip_layer_->get_addr()), dest_address_network_order,
+                    buf->payload_size() + sizeof(tcp_header)));
+        buf->set_csum_partial(sockbuf_header_t::tcp, offsetof(tcp_header, csum));
+        return;
     }
-    return ip_checksum(buf->header(sockbuf_header_t::tcp),
-            sizeof(tcp_header) + buf->payload_size(), initial_csum);
+    p_tcp_hdr->csum = tcp_checksum(buf, dest_address_network_order);
 }
 
 kerror_t tcp::bind_socket(tcp_socket *sock, uint16_t port)
@@ -100,6 +121,10 @@ kerror_t tcp::remove_connected_socket(tcp_socket *sock)
 void tcp::process_packet(sockbuf *data)
 {
     data->add_parsed_header(tcp_header_size(data), sockbuf_header_t::tcp);
+    // Link may have verified the checksum already
+    if (!data->csum_valid() && !verify_checksum(data)) {
+        return;
+    }
     const tcp_header *p_hdr = (tcp_header *)data->header(sockbuf_header_t::tcp);
     hash_map_node<socket_id> *hm_node = nullptr;
     const ip_hdr *p_ip_hdr = (ip_hdr *)data->header(sockbuf_header_t::ip);
@@ -139,19 +164,26 @@ kerror_t tcp::send_reply(const sockbuf *reply_to, uint8_t tcp_flags)
     p_tcp_hdr->csum = 0;
     p_tcp_hdr->urp = 0;
 
-    const uint16_t csum = tcp_checksum(reply, p_ip_hdr->saddr);
-    p_tcp_hdr->csum = csum;
+    fill_checksum(reply, p_ip_hdr->saddr);
     return ip_layer_->write(reply, ntohl(p_ip_hdr->saddr), ipproto_t::tcp, -1);
 }
 
 kerror_t tcp::send(ipv4_t remote_addr, sockbuf *buf)
 {
-    tcp_header *p_tcp_hdr = (tcp_header *)buf->header(sockbuf_header_t::tcp);
-    const uint16_t csum = tcp_checksum(buf, htonl(remote_addr));
-    p_tcp_hdr->csum = csum;
+    fill_checksum(buf, htonl(remote_addr));
     return ip_layer_->write(buf, remote_addr, ipproto_t::tcp, -1);
 }
 
+uint32_t tcp::offloads() const
+{
+    return ip_layer_->offloads();
+}
+
+linkif *tcp::link() const
+{
+    return ip_layer_->link();
+}
+
 size_t tcp::headers_size() const
 {
     return ip_layer_->headers_size() + sizeof(tcp_header);
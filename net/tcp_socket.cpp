@@ -4,14 +4,21 @@
 #include "net/tcp.hpp"
 #include "net/socket.hpp"
 #include "net/sockbuf.hpp"
+#include "net/linkif.hpp"
 #include "kernel/msgq.hpp"
 #include "common/utils.h"
 #include "arch/asm.h"
+#include "arch/clock.hpp"
 #include "otrix/immediate_console.hpp"
 
 namespace otrix::net
 {
 
+tunable<size_t> tcp_socket::syn_cache_table_size_("tcp.syn_cache_table_size", SYN_CACHE_TABLE_SIZE, 1, 65536);
+tunable<size_t> tcp_socket::mss_("tcp.mss", TCP_MSS, 64, TCP_MSS);
+tunable<size_t> tcp_socket::initial_window_size_("tcp.initial_window_size", TCP_INITIAL_WINDOW_SIZE, 1, UINT16_MAX);
+tunable<bool> tcp_socket::gso_("tcp.gso", true);
+
 tcp_socket::tcp_socket(tcp *tcp_layer): syn_cache_(nullptr), node_(this), tcp_layer_(tcp_layer),
                                         port_(INVALID_PORT), state_(TCP_STATE_CLOSED),
                                         listen_backlog_(nullptr), seq_(0), ack_(0),
@@ -31,16 +38,33 @@ tcp_socket::~tcp_socket()
 size_t tcp_socket::send(const void *data, size_t data_size)
 {
     send_mutex_.lock();
+    const size_t mss = mss_.get();
+    const bool gso = gso_.get() && (tcp_layer_->offloads() & LINKIF_OFFLOAD_GSO);
     size_t sent = 0;
     while (sent != data_size) {
-        const size_t to_send = std::min(data_size - sent, (size_t)TCP_MSS);
+        size_t unit = mss;
+        if (gso) {
+            // Bounded by the remote window, a larger unit would wait for the window to open up fully
+            const size_t window = std::min<size_t>(remote_window_size_, TCP_GSO_MAX_SIZE);
+            unit = std::max(mss, window / mss * mss);
+        }
+        const size_t to_send = std::min(data_size - sent, unit);
         sockbuf *buf = new sockbuf(tcp_layer_->headers_size(), (uint8_t *)data + sent, to_send);
+        if (to_send > mss) {
+            buf->set_gso_size(mss);
+        }
         const bool is_last_segment = ((sent + to_send) == data_size);
         const kerror_t ret = send_segment(buf, is_last_segment);
         if (E_PIPE == ret) {
+            delete buf;
             sent = 0;
             break;
+        } else if (E_TOUT == ret) {
+            // Non-blocking socket and remote window is full
+            delete buf;
+            break;
         } else if (E_OK != ret) {
+            delete buf;
             break;
         }
         sent += to_send;
@@ -55,11 +79,13 @@ size_t tcp_socket::recv(void *data, size_t data_size)
     recv_mutex_.lock();
 
     if (TCP_STATE_ESTABLISHED != state_ && TCP_STATE_SYN_SENT != state_
-            && TCP_STATE_SYN_RECEIVED != state_) {
+            && TCP_STATE_SYN_RECEIVED != state_ && TCP_STATE_CLOSE_WAIT != state_) {
+        recv_mutex_.unlock();
         return 0;
     }
 
     size_t received = 0;
+    bool busy_polled = false;
     while (received != data_size) {
         bool push_received = false;
 
@@ -67,16 +93,32 @@ size_t tcp_socket::recv(void *data, size_t data_size)
         // which means we need to send ACK with updated window size ASAP
         bool window_was_zero = false;
 
+        auto flags = arch_irq_save();
         if (nullptr == recv_skb_) {
+            if (nonblocking_ || TCP_STATE_CLOSE_WAIT == state_) {
+                // Nothing more to receive without blocking
+                arch_irq_restore(flags);
+                break;
+            }
+            if (0 != busy_poll_us_ && !busy_polled) {
+                arch_irq_restore(flags);
+                busy_polled = true;
+                busy_poll();
+                continue;
+            }
             recv_waitq_.wait();
+            if (nullptr == recv_skb_) {
+                arch_irq_restore(flags);
+                continue;
+            }
         }
-        auto flags = arch_irq_save();
         sockbuf *buf = container_of(recv_skb_, sockbuf::node_t, list_node)->p_skb;
         const size_t to_copy = std::min(data_size - received,
                 buf->payload_size() - recv_skb_payload_offset_);
         memcpy((char *)data + received, buf->payload() + recv_skb_payload_offset_, to_copy);
         received += to_copy;
         recv_skb_payload_offset_ += to_copy;
+        busy_polled = false;
         if (recv_window_used_ == recv_window_size_) {
             window_was_zero = true;
         }
@@ -131,7 +173,7 @@ kerror_t tcp_socket::listen(size_t backlog_size)
         delete syn_cache_;
     }
     syn_cache_ = new pooled_hash_map<tcp::socket_id, syn_cache_entry>(backlog_size,
-            SYN_CACHE_TABLE_SIZE, tcp::socket_id::hash_func);
+            syn_cache_table_size_, tcp::socket_id::hash_func);
     state_ = TCP_STATE_LISTEN;
     return E_OK;
 }
@@ -151,6 +193,57 @@ kerror_t tcp_socket::shutdown(bool read, bool write)
     return E_OK;
 }
 
+void tcp_socket::busy_poll()
+{
+    linkif *p_link = tcp_layer_->link();
+    if (!p_link->busy_poll_begin()) {
+        return;
+    }
+    const uint64_t start_tsc = arch_tsc();
+    const uint64_t deadline_tsc = start_tsc + arch::clock::ns_to_tsc(busy_poll_us_ * 1000);
+    bool success = false;
+    do {
+        // Segments are delivered to this socket by the stack running inline
+        if (0 == p_link->busy_poll(BUSY_POLL_BUDGET)) {
+            asm volatile("pause");
+        }
+        success = poll_events() & (POLL_IN | POLL_HUP);
+    } while (!success && arch_tsc() < deadline_tsc);
+    p_link->busy_poll_end();
+    account_busy_poll(start_tsc, success);
+}
+
+uint32_t tcp_socket::poll_events() const
+{
+    uint32_t events = 0;
+    switch (state_) {
+    case TCP_STATE_LISTEN:
+        if (nullptr != listen_backlog_ && !listen_backlog_->empty()) {
+            events |= POLL_IN;
+        }
+        break;
+    case TCP_STATE_ESTABLISHED:
+        if (nullptr != recv_skb_) {
+            events |= POLL_IN;
+        }
+        if (remote_window_size_ > 0) {
+            events |= POLL_OUT;
+        }
+        break;
+    case TCP_STATE_CLOSE_WAIT:
+        events |= POLL_IN | POLL_HUP;
+        break;
+    case TCP_STATE_CLOSED:
+        if (INVALID_PORT != port_) {
+            events |= POLL_HUP;
+        }
+        break;
+    default:
+        break;
+    }
+    return events;
+}
+
 void tcp_socket::process_packet(sockbuf *data)
 {
     switch (state_) {
@@ -199,14 +292,18 @@ kerror_t tcp_socket::accept_connection(sockbuf *data)
     new_conn->remote_port_ = ntohs(p_tcp_hdr->source_port);
     new_conn->seq_ = seq;
     new_conn->ack_ = ntohl(p_tcp_hdr->seq);
-    new_conn->recv_window_size_ = TCP_INITIAL_WINDOW_SIZE;
+    new_conn->recv_window_size_ = initial_window_size_;
     new_conn->recv_window_used_ = data->payload_size();
     tcp_layer_->add_connected_socket(new_conn, id);
 
     if (data->payload_size() > 0) {
         new_conn->handle_segment(data);
     }
-    return listen_backlog_->write(&new_conn) ? E_OK : E_NOMEM;
+    if (!listen_backlog_->write(&new_conn)) {
+        return E_NOMEM;
+    }
+    notify_pollers(POLL_IN);
+    return E_OK;
 }
 
 kerror_t tcp_socket::handle_syn(const sockbuf *data)
@@ -267,6 +364,7 @@ kerror_t tcp_socket::handle_segment(sockbuf *data)
     if (ntohs(p_in_hdr->window_size) > old_remote_window_size) {
         // Notify other thread (if any), that the remote window size has increased
         send_waitq_.notify_one();
+        notify_pollers(POLL_OUT);
     }
 
     if (data->payload_size() > 0 || is_fin) {
@@ -277,8 +375,14 @@ kerror_t tcp_socket::handle_segment(sockbuf *data)
         // TODO: Use copy semantics for smaller payloads to avoid holding
         // MTU-sized buffer in recv list
         sockbuf *sk_copy = new sockbuf(std::move(*data));
-        recv_skb_ = intrusive_list_push_back(recv_skb_, &sk_copy->node()->list_node);
+        // Keep recv_skb_ pointing to the oldest segment
+        if (nullptr == recv_skb_) {
+            recv_skb_ = intrusive_list_init(&sk_copy->node()->list_node);
+        } else {
+            intrusive_list_push_back(recv_skb_, &sk_copy->node()->list_node);
+        }
         recv_waitq_.notify_one();
+        notify_pollers(is_fin ? (POLL_IN | POLL_HUP) : POLL_IN);
     }
     arch_irq_restore(flags);
 
@@ -319,6 +423,7 @@ void tcp_socket::handle_close_wait_state(sockbuf *data)
         state_ = TCP_STATE_CLOSED;
         // Wakeup sending thread to terminate sending
         send_waitq_.notify_all();
+        notify_pollers(POLL_HUP);
     } else {
         // Handle ACKs for data
         handle_segment(data);
@@ -338,7 +443,7 @@ kerror_t tcp_socket::send_syn_ack(const sockbuf *reply_to, uint32_t isn)
     p_tcp_hdr->ack = htonl(ntohl(p_in_hdr->seq) + reply_to->payload_size() + 1);
     p_tcp_hdr->header_len = (sizeof(tcp_header) / sizeof(uint32_t)) << 4;
     p_tcp_hdr->flags = TCP_FLAG_SYN | TCP_FLAG_ACK;
-    p_tcp_hdr->window_size = htons(TCP_INITIAL_WINDOW_SIZE);
+    p_tcp_hdr->window_size = htons(initial_window_size_);
     p_tcp_hdr->csum = 0;
     p_tcp_hdr->urp = 0;
 
@@ -366,6 +471,10 @@ kerror_t tcp_socket::send_segment(sockbuf *data, bool is_last)
 {
     auto flags = arch_irq_save();
     while (remote_window_size_ < data->payload_size()) {
+        if (nonblocking_) {
+            arch_irq_restore(flags);
+            return E_TOUT;
+        }
         send_waitq_.wait();
         if (state_ == TCP_STATE_CLOSED) {
             arch_irq_restore(flags);
@@ -387,7 +496,15 @@ kerror_t tcp_socket::send_segment(sockbuf *data, bool is_last)
     p_tcp_hdr->csum = 0;
     p_tcp_hdr->urp = 0;
 
-    return tcp_layer_->send(get_remote_addr(), data);
+    const kerror_t ret = tcp_layer_->send(get_remote_addr(), data);
+    if (E_OK != ret) {
+        // Nothing was transmitted, the data goes out again with the same sequence numbers
+        flags = arch_irq_save();
+        seq_ -= data->payload_size();
+        remote_window_size_ += data->payload_size();
+        arch_irq_restore(flags);
+    }
+    return ret;
 }
 
 uint32_t tcp_socket::generate_isn()
@@ -1,8 +1,13 @@
 #!/usr/bin/env bash
 
+# Extra arguments are passed to QEMU, e.g. to benchmark packed virtqueues:
+#   ./run_qemu.sh -global virtio-net-pci.packed=on -global virtio-blk-pci.packed=on
+# Multiqueue needs the tap backend to be created with queues=N and vectors=2*N+2 on the device:
+#   -netdev tap,...,queues=4 -device virtio-net-pci,netdev=n1,mq=on,vectors=10
+
 qemu-kvm -cpu host -cdrom ./build/otrix.iso -nographic -s \
          -device virtio-serial -chardev file,path=/tmp/otrix-log,id=otrix-log \
          -device virtconsole,name=jobsfoo,chardev=otrix-log,name=c \
          -netdev tap,id=n1,script=no,downscript=no,ifname=otrix_tap -device virtio-net-pci,netdev=n1 \
          -object filter-dump,id=f1,netdev=n1,file=net_out.pcap \
-         -drive file=/data/otrix-images/image1.img,if=virtio
+         -drive file=/data/otrix-images/image1.img,if=virtio "$@"